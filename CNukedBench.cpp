@@ -0,0 +1,740 @@
+/******************************************************************************
+ * CNukedBench.cpp (microbenchmarks for the CNukedVST hot paths)              *
+ ******************************************************************************/
+
+#include "CNukedHost.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// 1) Minimal host plumbing (the rest is in CNukedHost.h)
+// -----------------------------------------------------------------------------
+static AEffect* openPlugin(float sampleRate, int32 blockSize)
+{
+    AEffect* effect = VSTPluginMain(hostCallback);
+    effect->dispatcher(effect, effOpen, 0, 0, nullptr, 0.f);
+    effect->dispatcher(effect, effSetSampleRate, 0, 0, nullptr, sampleRate);
+    effect->dispatcher(effect, effSetBlockSize, 0, blockSize, nullptr, 0.f);
+    effect->dispatcher(effect, effMainsChanged, 0, 1, nullptr, 0.f);
+    return effect;
+}
+
+static void sendMidi(AEffect* effect, unsigned char status, unsigned char data1, unsigned char data2)
+{
+    VstMidiEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = kVstMidiType;
+    ev.byteSize = sizeof(VstMidiEvent);
+    ev.midiData[0] = (char)status;
+    ev.midiData[1] = (char)data1;
+    ev.midiData[2] = (char)data2;
+
+    HostEvents events;
+    events.numEvents = 1;
+    events.reserved = 0;
+    events.events[0] = (VstEvent*)&ev;
+    effect->dispatcher(effect, effProcessEvents, 0, 0, &events, 0.f);
+}
+
+// Value below which `fraction` of the samples fall (nearest rank)
+static double percentile(std::vector<double> samples, double fraction)
+{
+    if (samples.empty()) return 0.0;
+    std::sort(samples.begin(), samples.end());
+    size_t rank = (size_t)(fraction * (samples.size() - 1) + 0.5);
+    return samples[rank];
+}
+
+// Every table row is also recorded here and written out with --json
+struct BenchResult {
+    std::string suite;
+    std::string name;
+    std::vector<std::pair<std::string, double> > metrics;
+};
+
+static std::vector<BenchResult> g_results;
+
+static void record(const char* suite, const std::string& name,
+                   std::initializer_list<std::pair<const char*, double> > metrics)
+{
+    BenchResult result;
+    result.suite = suite;
+    result.name = name;
+    for (const auto& metric : metrics) result.metrics.push_back(std::make_pair(std::string(metric.first), metric.second));
+    g_results.push_back(result);
+}
+
+static bool writeJson(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if (!f) return false;
+    fprintf(f, "[\n");
+    for (size_t i = 0; i < g_results.size(); i++) {
+        const BenchResult& r = g_results[i];
+        fprintf(f, "  {\"suite\": \"%s\", \"case\": \"%s\"", r.suite.c_str(), r.name.c_str());
+        for (const auto& metric : r.metrics) {
+            fprintf(f, ", \"%s\": %.6g", metric.first.c_str(), metric.second);
+        }
+        fprintf(f, "}%s\n", i + 1 < g_results.size() ? "," : "");
+    }
+    fprintf(f, "]\n");
+    fclose(f);
+    return true;
+}
+
+static std::string caseName(const char* format, int a, int b = 0)
+{
+    char name[64];
+    snprintf(name, sizeof(name), format, a, b);
+    return name;
+}
+
+// -----------------------------------------------------------------------------
+// 2) Event scheduling: cost per queued MIDI event
+// -----------------------------------------------------------------------------
+// Renders numBlocks blocks, each preceded by `count` note events spread evenly
+// across the block, and returns the average time per block in nanoseconds.
+static double timeEventBlocks(AEffect* effect, int count, int32 blockSize, int numBlocks)
+{
+    std::vector<float> left(blockSize), right(blockSize);
+    float* outputs[2] = { left.data(), right.data() };
+    std::vector<VstMidiEvent> midi(count > 0 ? count : 1);
+    HostEvents events;
+
+    double start = nowSeconds();
+    for (int block = 0; block < numBlocks; block++) {
+        // Alternate note-on/note-off pairs
+        events.numEvents = count;
+        events.reserved = 0;
+        for (int i = 0; i < count; i++) {
+            VstMidiEvent& ev = midi[i];
+            memset(&ev, 0, sizeof(ev));
+            ev.type = kVstMidiType;
+            ev.byteSize = sizeof(VstMidiEvent);
+            ev.deltaFrames = (int32)((int64)i * blockSize / count);
+            ev.midiData[0] = (char)((i & 1) ? 0x80 : 0x90);
+            ev.midiData[1] = (char)(36 + (i / 2) % 48);
+            ev.midiData[2] = 100;
+            events.events[i] = (VstEvent*)&ev;
+        }
+        if (count > 0) {
+            effect->dispatcher(effect, effProcessEvents, 0, 0, &events, 0.f);
+        }
+        effect->processReplacing(effect, nullptr, outputs, blockSize);
+    }
+    return (nowSeconds() - start) * 1e9 / numBlocks;
+}
+
+// Reports the extra time each event costs over the event-free baseline. Each
+// case is run several times and the fastest run is kept to filter out noise.
+static void benchEventScheduling()
+{
+    const float sampleRate = 44100.f;
+    const int32 blockSize = 512;
+    const int numBlocks = 500;
+    const int numRuns = 5;
+    const int eventCounts[] = { 0, 16, 64, 256, 1024 };
+
+    printf("Event scheduling (%d-frame blocks, %d blocks)\n", blockSize, numBlocks);
+    printf("%10s %14s %14s %14s\n", "events", "events/sec", "ns/block", "ns/event");
+
+    double baseline = 0.0;
+    for (int count : eventCounts) {
+        AEffect* effect = openPlugin(sampleRate, blockSize);
+
+        double nsPerBlock = 0.0;
+        for (int run = 0; run < numRuns; run++) {
+            double runNs = timeEventBlocks(effect, count, blockSize, numBlocks);
+            if (run == 0 || runNs < nsPerBlock) nsPerBlock = runNs;
+        }
+
+        if (count == 0) baseline = nsPerBlock;
+        double nsPerEvent = count > 0 ? (nsPerBlock - baseline) / count : 0.0;
+        double eventsPerSec = count * sampleRate / blockSize;
+        printf("%10d %14.0f %14.0f %14.1f\n", count, eventsPerSec, nsPerBlock, nsPerEvent);
+        record("events", caseName("%d events", count),
+               { { "events_per_sec", eventsPerSec }, { "ns_per_block", nsPerBlock }, { "ns_per_event", nsPerEvent } });
+
+        effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 3) Resampler tiers: CPU per second of audio and image rejection
+// -----------------------------------------------------------------------------
+static const int kNumResamplerModes = 4;
+
+// Magnitude of a Hann-windowed DFT bin at an arbitrary frequency
+static double toneMagnitude(const std::vector<float>& signal, double freq, double sampleRate)
+{
+    const size_t n = signal.size();
+    double w = 2.0 * M_PI * freq / sampleRate;
+    double re = 0.0, im = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double hann = 0.5 - 0.5 * cos(2.0 * M_PI * i / (n - 1));
+        re += signal[i] * hann * cos(w * i);
+        im -= signal[i] * hann * sin(w * i);
+    }
+    return sqrt(re * re + im * im);
+}
+
+// Finds the strongest frequency within +-span Hz of `center`
+static double findPeak(const std::vector<float>& signal, double center, double span, double sampleRate)
+{
+    double best = center, bestMag = -1.0;
+    for (double step = span / 20.0; step > 0.01; step /= 10.0) {
+        double from = best - step * 20.0, to = best + step * 20.0;
+        for (double f = from; f <= to; f += step) {
+            double mag = toneMagnitude(signal, f, sampleRate);
+            if (mag > bestMag) { bestMag = mag; best = f; }
+        }
+    }
+    return best;
+}
+
+static AEffect* openResamplerPlugin(float sampleRate, int32 blockSize, int mode)
+{
+    AEffect* effect = openPlugin(sampleRate, blockSize);
+    int32 resampler = findParameter(effect, "Resampler");
+    effect->setParameter(effect, resampler, (float)mode / (kNumResamplerModes - 1));
+    return effect;
+}
+
+static void benchResampler()
+{
+    const int32 blockSize = 256;
+    const float rates[] = { 44100.f, 96000.f, 192000.f };
+    const char* modeNames[kNumResamplerModes] = { "Linear", "Sinc 8", "Sinc 16", "Sinc 32" };
+
+    std::vector<float> left(blockSize), right(blockSize);
+    float* outputs[2] = { left.data(), right.data() };
+
+    // CPU cost: 8 held notes, 5 seconds of audio per case
+    printf("\nResampler CPU (8 voices, ms of CPU per second of audio)\n");
+    printf("%10s", "mode");
+    for (float rate : rates) printf(" %10.0f", rate);
+    printf("\n");
+    for (int mode = 0; mode < kNumResamplerModes; mode++) {
+        printf("%10s", modeNames[mode]);
+        for (float rate : rates) {
+            AEffect* effect = openResamplerPlugin(rate, blockSize, mode);
+            for (int note = 0; note < 8; note++) sendMidi(effect, 0x90, 48 + note * 3, 100);
+
+            int numBlocks = (int)(rate * 5 / blockSize);
+            double start = nowSeconds();
+            for (int block = 0; block < numBlocks; block++) {
+                effect->processReplacing(effect, nullptr, outputs, blockSize);
+            }
+            double seconds = (double)numBlocks * blockSize / rate;
+            double msPerSecond = (nowSeconds() - start) * 1e3 / seconds;
+            printf(" %10.2f", msPerSecond);
+            record("resampler", std::string(modeNames[mode]) + caseName(" %d Hz", (int)rate), { { "ms_cpu_per_sec", msPerSecond } });
+            effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+        }
+        printf("\n");
+    }
+
+    // Image rejection: a sustained near-sine tone at ~14 kHz. Resampling from the
+    // chip's 49716 Hz leaves an image at 49716 - f, which folds back into the
+    // 44.1 kHz output band. Report its level relative to the tone.
+    const float rate = 44100.f;
+    const double nativeRate = 49716.0;
+    printf("\nResampler image rejection (%.0f Hz output)\n", rate);
+    printf("%10s %12s %12s %12s\n", "mode", "tone Hz", "image Hz", "image dB");
+    for (int mode = 0; mode < kNumResamplerModes; mode++) {
+        AEffect* effect = openResamplerPlugin(rate, blockSize, mode);
+        effect->setParameter(effect, findParameter(effect, "Mod Level"), 1.f);
+        effect->setParameter(effect, findParameter(effect, "Car Sustain"), 1.f);
+        effect->setParameter(effect, findParameter(effect, "Car Decay"), 0.f);
+        effect->setParameter(effect, findParameter(effect, "Car Sustain Lv"), 0.f);
+        sendMidi(effect, 0x90, 110, 100);
+
+        // Skip the attack, then capture 32768 frames
+        std::vector<float> capture;
+        for (int block = 0; block < 40; block++) {
+            effect->processReplacing(effect, nullptr, outputs, blockSize);
+        }
+        while (capture.size() < 32768) {
+            effect->processReplacing(effect, nullptr, outputs, blockSize);
+            capture.insert(capture.end(), left.begin(), left.end());
+        }
+        effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+
+        // The carrier plays note 110 at its default 3x multiplier
+        double tone = findPeak(capture, 3.0 * 440.0 * pow(2.0, (110 - 69) / 12.0), 200.0, rate);
+        double image = fabs(rate - (nativeRate - tone));
+        image = findPeak(capture, image, 30.0, rate);
+        double db = 20.0 * log10(toneMagnitude(capture, image, rate) / toneMagnitude(capture, tone, rate));
+        printf("%10s %12.1f %12.1f %12.1f\n", modeNames[mode], tone, image, db);
+        record("resampler_images", modeNames[mode], { { "tone_hz", tone }, { "image_hz", image }, { "image_db", db } });
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 4) Chip scaling: CPU cost against the number of active chips
+// -----------------------------------------------------------------------------
+static const int kMaxChips = 8;
+static const int kVoicesPerChip = 18;
+
+static void benchChipScaling()
+{
+    const float sampleRate = 44100.f;
+    const int32 blockSize = 256;
+    const double seconds = 2.0;
+
+    std::vector<float> left(blockSize), right(blockSize);
+    float* outputs[2] = { left.data(), right.data() };
+
+    printf("\nChip scaling (every voice held, %.0f Hz, %d-frame blocks)\n", sampleRate, blockSize);
+    printf("%10s %10s %14s %14s\n", "chips", "voices", "ms CPU/sec", "us/voice/sec");
+    for (int chips = 1; chips <= kMaxChips; chips++) {
+        AEffect* effect = openPlugin(sampleRate, blockSize);
+        effect->setParameter(effect, findParameter(effect, "Chips"), (float)(chips - 1) / (kMaxChips - 1));
+        int voices = chips * kVoicesPerChip;
+        for (int v = 0; v < voices; v++) sendMidi(effect, 0x90, 24 + v % 96, 100);
+
+        int numBlocks = (int)(sampleRate * seconds / blockSize);
+        double start = nowSeconds();
+        for (int block = 0; block < numBlocks; block++) {
+            effect->processReplacing(effect, nullptr, outputs, blockSize);
+        }
+        double msPerSecond = (nowSeconds() - start) * 1e3 / seconds;
+        printf("%10d %10d %14.2f %14.1f\n", chips, voices, msPerSecond, msPerSecond * 1e3 / voices);
+        record("chips", caseName("%d chips", chips), { { "voices", (double)voices }, { "ms_cpu_per_sec", msPerSecond } });
+        effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 5) Render threads: wall-clock block time against the number of threads
+// -----------------------------------------------------------------------------
+static const int kMaxThreads = 8;
+
+static void benchRenderThreads()
+{
+    const float sampleRate = 44100.f;
+    const int32 blockSizes[] = { 64, 128, 256 };
+    const int threadCounts[] = { 1, 2, 4, 8 };
+    const double seconds = 2.0;
+
+    printf("\nRender threads (%d chips, every voice held, %.0f Hz)\n", kMaxChips, sampleRate);
+    printf("%10s %10s %14s %14s %10s\n", "block", "threads", "mean us/block", "max us/block", "load %");
+    for (int32 blockSize : blockSizes) {
+        std::vector<float> left(blockSize), right(blockSize);
+        float* outputs[2] = { left.data(), right.data() };
+        double budget = blockSize / sampleRate;
+
+        for (int threads : threadCounts) {
+            AEffect* effect = openPlugin(sampleRate, blockSize);
+            effect->setParameter(effect, findParameter(effect, "Chips"), 1.f);
+            effect->setParameter(effect, findParameter(effect, "Threads"), (float)(threads - 1) / (kMaxThreads - 1));
+            // Workers start when processing resumes, as in a host after a settings change
+            effect->dispatcher(effect, effMainsChanged, 0, 0, nullptr, 0.f);
+            effect->dispatcher(effect, effMainsChanged, 0, 1, nullptr, 0.f);
+            for (int v = 0; v < kMaxChips * kVoicesPerChip; v++) sendMidi(effect, 0x90, 24 + v % 96, 100);
+
+            // Blocks arrive at the real-time rate so idle workers go through their
+            // spin-then-park cycle the way they would in a host
+            int numBlocks = (int)(sampleRate * seconds / blockSize);
+            double total = 0.0, worst = 0.0;
+            double next = nowSeconds();
+            for (int block = 0; block < numBlocks; block++) {
+                while (nowSeconds() < next) {}
+                double start = nowSeconds();
+                effect->processReplacing(effect, nullptr, outputs, blockSize);
+                double elapsed = nowSeconds() - start;
+                total += elapsed;
+                if (elapsed > worst) worst = elapsed;
+                next = start + budget;
+            }
+            double mean = total / numBlocks;
+            printf("%10d %10d %14.1f %14.1f %10.1f\n", blockSize, threads, mean * 1e6, worst * 1e6, mean / budget * 100.0);
+            record("threads", caseName("%d frames %d threads", blockSize, threads),
+                   { { "mean_us_per_block", mean * 1e6 }, { "max_us_per_block", worst * 1e6 }, { "load_percent", mean / budget * 100.0 } });
+            effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 6) Render hot path: processReplacing across block sizes and voice counts
+// -----------------------------------------------------------------------------
+// Times every block on its own, so alongside the mean cost per frame the table
+// shows the block-time distribution a host would see. "voices/core" is how many
+// voices one core could keep running in real time at that cost.
+static void benchRender()
+{
+    const float sampleRate = 44100.f;
+    const int32 blockSizes[] = { 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+    const int voiceCounts[] = { 0, 8, 16 };
+    const double seconds = 1.0;
+
+    printf("\nRender (%.0f Hz, %.0f s of audio per case)\n", sampleRate, seconds);
+    printf("%10s %8s %10s %10s %10s %10s %12s\n", "block", "voices", "ns/frame", "p50 us", "p99 us", "max us", "voices/core");
+    for (int voices : voiceCounts) {
+        for (int32 blockSize : blockSizes) {
+            AEffect* effect = openPlugin(sampleRate, blockSize);
+            std::vector<float> left(blockSize), right(blockSize);
+            float* outputs[2] = { left.data(), right.data() };
+            for (int v = 0; v < voices; v++) sendMidi(effect, 0x90, 48 + v * 2, 100);
+
+            // One warm-up block applies the notes and faults the buffers in
+            effect->processReplacing(effect, nullptr, outputs, blockSize);
+
+            int numBlocks = std::max(1, (int)(sampleRate * seconds / blockSize));
+            std::vector<double> blockTimes(numBlocks);
+            double total = 0.0;
+            for (int block = 0; block < numBlocks; block++) {
+                double start = nowSeconds();
+                effect->processReplacing(effect, nullptr, outputs, blockSize);
+                blockTimes[block] = nowSeconds() - start;
+                total += blockTimes[block];
+            }
+            effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+
+            double nsPerFrame = total * 1e9 / ((double)numBlocks * blockSize);
+            double realtime = (double)numBlocks * blockSize / sampleRate / total;
+            double p50 = percentile(blockTimes, 0.50) * 1e6, p99 = percentile(blockTimes, 0.99) * 1e6;
+            double worst = percentile(blockTimes, 1.0) * 1e6;
+            printf("%10d %8d %10.1f %10.2f %10.2f %10.2f", blockSize, voices, nsPerFrame, p50, p99, worst);
+            std::string name = caseName("%d frames %d voices", blockSize, voices);
+            if (voices > 0) {
+                printf(" %12.0f\n", voices * realtime);
+                record("render", name, { { "ns_per_frame", nsPerFrame }, { "p50_us", p50 }, { "p99_us", p99 },
+                                         { "max_us", worst }, { "voices_per_core", voices * realtime } });
+            } else {
+                printf(" %12s\n", "-");
+                record("render", name, { { "ns_per_frame", nsPerFrame }, { "p50_us", p50 }, { "p99_us", p99 }, { "max_us", worst } });
+            }
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 7) setParameter bursts: the host-side call and the flush at the next block
+// -----------------------------------------------------------------------------
+static void benchParameterBursts()
+{
+    const float sampleRate = 44100.f;
+    const int32 blockSize = 64;
+    const int burstSizes[] = { 1, 8, 32, 128 };
+    const int numBlocks = 4000;
+    // Only sound parameters; engine parameters reallocate chips or threads
+    const int numSoundParams = 30;
+
+    std::vector<float> left(blockSize), right(blockSize);
+    float* outputs[2] = { left.data(), right.data() };
+
+    printf("\nsetParameter bursts (%d-frame blocks, 8 voices, %d blocks)\n", blockSize, numBlocks);
+    printf("%10s %12s %14s %10s %10s\n", "burst", "ns/call", "flush ns", "p50 us", "p99 us");
+
+    // Baseline: the same blocks without any parameter change
+    AEffect* effect = openPlugin(sampleRate, blockSize);
+    for (int v = 0; v < 8; v++) sendMidi(effect, 0x90, 48 + v * 2, 100);
+    std::vector<double> baseTimes(numBlocks);
+    for (int block = 0; block < numBlocks; block++) {
+        double start = nowSeconds();
+        effect->processReplacing(effect, nullptr, outputs, blockSize);
+        baseTimes[block] = nowSeconds() - start;
+    }
+    double baseline = percentile(baseTimes, 0.5);
+    effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+
+    for (int burst : burstSizes) {
+        effect = openPlugin(sampleRate, blockSize);
+        for (int v = 0; v < 8; v++) sendMidi(effect, 0x90, 48 + v * 2, 100);
+
+        unsigned seed = 12345;
+        double callTime = 0.0;
+        std::vector<double> blockTimes(numBlocks);
+        for (int block = 0; block < numBlocks; block++) {
+            double start = nowSeconds();
+            for (int i = 0; i < burst; i++) {
+                seed = seed * 1103515245u + 12345u;
+                int index = (int)((seed >> 16) % numSoundParams);
+                effect->setParameter(effect, index, (float)((seed >> 8) & 0xFF) / 255.f);
+            }
+            double mid = nowSeconds();
+            effect->processReplacing(effect, nullptr, outputs, blockSize);
+            blockTimes[block] = nowSeconds() - mid;
+            callTime += mid - start;
+        }
+        effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+
+        double nsPerCall = callTime * 1e9 / ((double)numBlocks * burst);
+        double flushNs = (percentile(blockTimes, 0.5) - baseline) * 1e9;
+        double p50 = percentile(blockTimes, 0.50) * 1e6, p99 = percentile(blockTimes, 0.99) * 1e6;
+        printf("%10d %12.1f %14.0f %10.2f %10.2f\n", burst, nsPerCall, flushNs, p50, p99);
+        record("params", caseName("burst %d", burst),
+               { { "ns_per_call", nsPerCall }, { "flush_ns", flushNs }, { "p50_us", p50 }, { "p99_us", p99 } });
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 8) Note storms: note-ons that exhaust the voices and force stealing
+// -----------------------------------------------------------------------------
+// Each block carries `count` note-ons on distinct notes and never releases them, so
+// once the voices are used up every further note-on steals one. The baseline holds
+// every voice without any events, so the difference is the cost of the events.
+static void benchNoteStorms()
+{
+    const float sampleRate = 44100.f;
+    const int32 blockSize = 256;
+    const int eventCounts[] = { 16, 64, 256, 1024 };
+    const int numBlocks = 400;
+
+    std::vector<float> left(blockSize), right(blockSize);
+    float* outputs[2] = { left.data(), right.data() };
+    std::vector<VstMidiEvent> midi(1024);
+    HostEvents events;
+
+    printf("\nNote storms (%d-frame blocks, no note-offs)\n", blockSize);
+    printf("%10s %14s %10s %10s\n", "notes", "ns/note", "p50 us", "p99 us");
+
+    AEffect* effect = openPlugin(sampleRate, blockSize);
+    for (int v = 0; v < kVoicesPerChip; v++) sendMidi(effect, 0x90, 24 + v, 100);
+    std::vector<double> baseTimes(numBlocks);
+    for (int block = 0; block < numBlocks; block++) {
+        double start = nowSeconds();
+        effect->processReplacing(effect, nullptr, outputs, blockSize);
+        baseTimes[block] = nowSeconds() - start;
+    }
+    effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+    double baseline = percentile(baseTimes, 0.5);
+
+    for (int count : eventCounts) {
+        effect = openPlugin(sampleRate, blockSize);
+        std::vector<double> blockTimes(numBlocks);
+        int note = 0;
+        for (int block = 0; block < numBlocks; block++) {
+            events.numEvents = count;
+            events.reserved = 0;
+            for (int i = 0; i < count; i++) {
+                VstMidiEvent& ev = midi[i];
+                memset(&ev, 0, sizeof(ev));
+                ev.type = kVstMidiType;
+                ev.byteSize = sizeof(VstMidiEvent);
+                ev.deltaFrames = (int32)((int64)i * blockSize / count);
+                ev.midiData[0] = (char)0x90;
+                ev.midiData[1] = (char)(24 + note++ % 96);
+                ev.midiData[2] = 100;
+                events.events[i] = (VstEvent*)&ev;
+            }
+            double start = nowSeconds();
+            effect->dispatcher(effect, effProcessEvents, 0, 0, &events, 0.f);
+            effect->processReplacing(effect, nullptr, outputs, blockSize);
+            blockTimes[block] = nowSeconds() - start;
+        }
+        effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+
+        double nsPerNote = (percentile(blockTimes, 0.5) - baseline) * 1e9 / count;
+        double p50 = percentile(blockTimes, 0.50) * 1e6, p99 = percentile(blockTimes, 0.99) * 1e6;
+        printf("%10d %14.1f %10.2f %10.2f\n", count, nsPerNote, p50, p99);
+        record("notes", caseName("%d notes", count), { { "ns_per_note", nsPerNote }, { "p50_us", p50 }, { "p99_us", p99 } });
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 9) Sample-rate changes: cost of effSetSampleRate
+// -----------------------------------------------------------------------------
+static void benchSampleRateChanges()
+{
+    const float rates[] = { 44100.f, 48000.f, 96000.f };
+    const int numCalls = 300;
+    const int chipCounts[] = { 1, 8 };
+
+    printf("\nSample-rate changes (%d calls, 8 voices held)\n", numCalls);
+    printf("%10s %10s %10s %10s\n", "chips", "p50 us", "p99 us", "max us");
+    for (int chips : chipCounts) {
+        AEffect* effect = openPlugin(44100.f, 256);
+        effect->setParameter(effect, findParameter(effect, "Chips"), (float)(chips - 1) / (kMaxChips - 1));
+        for (int v = 0; v < 8; v++) sendMidi(effect, 0x90, 48 + v * 2, 100);
+        std::vector<float> left(256), right(256);
+        float* outputs[2] = { left.data(), right.data() };
+        effect->processReplacing(effect, nullptr, outputs, 256);
+
+        std::vector<double> callTimes(numCalls);
+        for (int i = 0; i < numCalls; i++) {
+            double start = nowSeconds();
+            effect->dispatcher(effect, effSetSampleRate, 0, 0, nullptr, rates[i % 3]);
+            callTimes[i] = nowSeconds() - start;
+        }
+        effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+
+        double p50 = percentile(callTimes, 0.50) * 1e6, p99 = percentile(callTimes, 0.99) * 1e6;
+        double worst = percentile(callTimes, 1.0) * 1e6;
+        printf("%10d %10.1f %10.1f %10.1f\n", chips, p50, p99, worst);
+        record("rate", caseName("%d chips", chips), { { "p50_us", p50 }, { "p99_us", p99 }, { "max_us", worst } });
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 10) Emulation cores: speed and accuracy of the fast core against Nuked
+// -----------------------------------------------------------------------------
+static const int kNumCoreWorkloads = 4;
+static const char* CORE_WORKLOADS[kNumCoreWorkloads] = { "2-op", "4-op", "LFOs", "drums" };
+
+// Sets up one of the workloads and returns the Core parameter's index
+static int32 setupCoreWorkload(AEffect* effect, int workload, int core)
+{
+    int32 coreParam = findParameter(effect, "Core");
+    effect->setParameter(effect, coreParam, (float)core);
+    if (workload == 1) {
+        effect->setParameter(effect, findParameter(effect, "4-Op"), 0.25f);
+    } else if (workload == 2) {
+        const char* names[] = { "Mod Tremolo", "Mod Vibrato", "Car Tremolo", "Car Vibrato", "Tremolo Depth", "Vibrato Depth" };
+        for (const char* name : names) effect->setParameter(effect, findParameter(effect, name), 1.f);
+    } else if (workload == 3) {
+        effect->setParameter(effect, findParameter(effect, "Rhythm Mode"), 1.f);
+    }
+    return coreParam;
+}
+
+// Plays a workload for `seconds`, changing chords (or drum hits) every quarter
+// second so envelopes run through every stage, and returns the left channel
+static std::vector<float> renderCoreWorkload(int workload, int core, float sampleRate, double seconds, double* cpuSeconds)
+{
+    const int32 blockSize = 256;
+    const unsigned char drumNotes[] = { 36, 38, 42, 46, 45 };
+    AEffect* effect = openPlugin(sampleRate, blockSize);
+    setupCoreWorkload(effect, workload, core);
+    std::vector<float> left(blockSize), right(blockSize), capture;
+    float* outputs[2] = { left.data(), right.data() };
+
+    int numBlocks = (int)(sampleRate * seconds / blockSize);
+    int blocksPerStep = (int)(sampleRate / 4 / blockSize);
+    double cpu = 0.0;
+    for (int block = 0; block < numBlocks; block++) {
+        if (block % blocksPerStep == 0) {
+            int step = block / blocksPerStep;
+            if (workload == 3) {
+                for (int d = 0; d < 5; d++) sendMidi(effect, 0x89, drumNotes[d], 0);
+                sendMidi(effect, 0x99, drumNotes[step % 5], 100);
+                sendMidi(effect, 0x99, drumNotes[(step + 2) % 5], 100);
+            }
+            int voices = workload == 1 ? 3 : 6;
+            for (int v = 0; v < voices; v++) {
+                sendMidi(effect, 0x80, 36 + (step - 1) * 5 % 36 + v * 4, 0);
+                sendMidi(effect, 0x90, 36 + step * 5 % 36 + v * 4, 100);
+            }
+        }
+        double start = nowSeconds();
+        effect->processReplacing(effect, nullptr, outputs, blockSize);
+        cpu += nowSeconds() - start;
+        capture.insert(capture.end(), left.begin(), left.end());
+    }
+    effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+    *cpuSeconds = cpu;
+    return capture;
+}
+
+// Renders each workload with both cores, keeping the fastest of three runs, and
+// compares the outputs sample by sample. Errors are in 16-bit steps; an SNR of
+// "exact" means the outputs are identical.
+static void benchCores()
+{
+    const float sampleRate = 44100.f;
+    const double seconds = 2.0;
+
+    printf("\nEmulation cores (%.0f Hz, %.0f s per workload, fastest of 3 runs)\n", sampleRate, seconds);
+    printf("%10s %12s %12s %10s %10s %12s %10s\n", "workload", "Nuked ns/fr", "Fast ns/fr", "speedup", "max err", "err dBFS", "SNR dB");
+    for (int workload = 0; workload < kNumCoreWorkloads; workload++) {
+        std::vector<float> outputs[2];
+        double best[2] = { 1e30, 1e30 };
+        for (int core = 0; core < 2; core++) {
+            for (int run = 0; run < 3; run++) {
+                double cpu;
+                outputs[core] = renderCoreWorkload(workload, core, sampleRate, seconds, &cpu);
+                best[core] = std::min(best[core], cpu);
+            }
+        }
+
+        double maxError = 0.0, errorPower = 0.0, signalPower = 0.0;
+        size_t frames = outputs[0].size();
+        for (size_t i = 0; i < frames; i++) {
+            double error = ((double)outputs[1][i] - outputs[0][i]) * 32768.0;
+            maxError = std::max(maxError, fabs(error));
+            errorPower += error * error;
+            signalPower += (double)outputs[0][i] * outputs[0][i] * 32768.0 * 32768.0;
+        }
+        double nsNuked = best[0] * 1e9 / frames, nsFast = best[1] * 1e9 / frames;
+        printf("%10s %12.1f %12.1f %9.2fx %10.0f", CORE_WORKLOADS[workload], nsNuked, nsFast, nsNuked / nsFast, maxError);
+        if (errorPower > 0.0) {
+            double errorDb = 10.0 * log10(errorPower / frames / (32768.0 * 32768.0));
+            double snr = 10.0 * log10(signalPower / errorPower);
+            printf(" %12.1f %10.1f\n", errorDb, snr);
+            record("core", CORE_WORKLOADS[workload], { { "nuked_ns_per_frame", nsNuked }, { "fast_ns_per_frame", nsFast },
+                                                       { "speedup", nsNuked / nsFast }, { "max_error", maxError },
+                                                       { "error_dbfs", errorDb }, { "snr_db", snr } });
+        } else {
+            printf(" %12s %10s\n", "-", "exact");
+            record("core", CORE_WORKLOADS[workload], { { "nuked_ns_per_frame", nsNuked }, { "fast_ns_per_frame", nsFast },
+                                                       { "speedup", nsNuked / nsFast }, { "max_error", 0.0 }, { "exact", 1.0 } });
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 11) Entry point
+// -----------------------------------------------------------------------------
+struct BenchSuite {
+    const char* name;
+    void      (*run)();
+};
+
+static const BenchSuite SUITES[] = {
+    { "events",    benchEventScheduling },
+    { "resampler", benchResampler },
+    { "chips",     benchChipScaling },
+    { "threads",   benchRenderThreads },
+    { "render",    benchRender },
+    { "params",    benchParameterBursts },
+    { "notes",     benchNoteStorms },
+    { "rate",      benchSampleRateChanges },
+    { "core",      benchCores },
+};
+
+static void usage()
+{
+    fprintf(stderr, "usage: CNukedVSTBench [--json FILE] [suite ...]\nsuites:");
+    for (const BenchSuite& suite : SUITES) fprintf(stderr, " %s", suite.name);
+    fprintf(stderr, "\nWithout suites every suite runs.\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* jsonPath = nullptr;
+    std::vector<const BenchSuite*> selected;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--json") && i + 1 < argc) {
+            jsonPath = argv[++i];
+            continue;
+        }
+        const BenchSuite* match = nullptr;
+        for (const BenchSuite& suite : SUITES) {
+            if (!strcmp(argv[i], suite.name)) match = &suite;
+        }
+        if (!match) {
+            usage();
+            return 2;
+        }
+        selected.push_back(match);
+    }
+    if (selected.empty()) {
+        for (const BenchSuite& suite : SUITES) selected.push_back(&suite);
+    }
+
+    for (const BenchSuite* suite : selected) suite->run();
+
+    if (jsonPath && !writeJson(jsonPath)) {
+        fprintf(stderr, "cannot write %s\n", jsonPath);
+        return 1;
+    }
+    return 0;
+}
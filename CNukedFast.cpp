@@ -0,0 +1,799 @@
+/******************************************************************************
+ * CNukedFast.cpp (a structure-of-arrays OPL3 core derived from Nuked OPL3)    *
+ ******************************************************************************/
+/*
+ * Copyright (C) 2013-2020 Nuke.YKT (Nuked OPL3)
+ *
+ * This file is derived from Nuked OPL3 and, unlike the rest of CNukedVST, is
+ * licensed under the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "CNukedFast.h"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// A second emulation core, chosen with the Core parameter. It runs the same steps as
+// Nuked OPL3 in the same order, but keeps operator state as arrays indexed by slot
+// instead of a struct per slot reached through pointers, and moves work out of the
+// per-sample loop:
+//   - phase increments are worked out when the frequency, multiplier or vibrato
+//     position changes, and all 36 phases advance together in SSE2 lanes
+//   - the envelope output (attenuation plus level, key scaling and tremolo) is
+//     summed for every slot at once, and the envelope generator skips slots whose
+//     envelope cannot move: silent ones, and held notes of sustaining patches
+//   - a mask of the slots that are keyed on or still releasing limits the envelope
+//     and waveform work to those; a silent slot only works out its sign
+//   - feedback is worked out for all slots at once, the shift done as a multiply
+//   - each waveform is one table of log attenuation and sign, and the exponent one
+//     8K table, so an operator's output costs two loads
+//   - modulation inputs are slot indices set up when the algorithm changes, and
+//     the left and right mixes are dot products of the slot outputs with weights
+//     worked out at the same time
+// The waveform lookups stay serial, as a modulator's output feeds its carrier
+// within the same sample.
+
+// A constant zero, as an index into FastChip::signal
+static const int kSignalZero = 2 * kFastSlots;
+
+enum { kEnvAttack, kEnvDecay, kEnvSustain, kEnvRelease };
+enum { kChannel2Op, kChannel4Op, kChannel4Op2, kChannelDrum };
+
+// The log-sin and exponent ROMs of the chip, as in Nuked OPL3
+static const uint16_t FAST_LOGSIN_ROM[256] = {
+    0x859, 0x6c3, 0x607, 0x58b, 0x52e, 0x4e4, 0x4a6, 0x471, 0x443, 0x41a, 0x3f5, 0x3d3, 0x3b5, 0x398, 0x37e, 0x365,
+    0x34e, 0x339, 0x324, 0x311, 0x2ff, 0x2ed, 0x2dc, 0x2cd, 0x2bd, 0x2af, 0x2a0, 0x293, 0x286, 0x279, 0x26d, 0x261,
+    0x256, 0x24b, 0x240, 0x236, 0x22c, 0x222, 0x218, 0x20f, 0x206, 0x1fd, 0x1f5, 0x1ec, 0x1e4, 0x1dc, 0x1d4, 0x1cd,
+    0x1c5, 0x1be, 0x1b7, 0x1b0, 0x1a9, 0x1a2, 0x19b, 0x195, 0x18f, 0x188, 0x182, 0x17c, 0x177, 0x171, 0x16b, 0x166,
+    0x160, 0x15b, 0x155, 0x150, 0x14b, 0x146, 0x141, 0x13c, 0x137, 0x133, 0x12e, 0x129, 0x125, 0x121, 0x11c, 0x118,
+    0x114, 0x10f, 0x10b, 0x107, 0x103, 0x0ff, 0x0fb, 0x0f8, 0x0f4, 0x0f0, 0x0ec, 0x0e9, 0x0e5, 0x0e2, 0x0de, 0x0db,
+    0x0d7, 0x0d4, 0x0d1, 0x0cd, 0x0ca, 0x0c7, 0x0c4, 0x0c1, 0x0be, 0x0bb, 0x0b8, 0x0b5, 0x0b2, 0x0af, 0x0ac, 0x0a9,
+    0x0a7, 0x0a4, 0x0a1, 0x09f, 0x09c, 0x099, 0x097, 0x094, 0x092, 0x08f, 0x08d, 0x08a, 0x088, 0x086, 0x083, 0x081,
+    0x07f, 0x07d, 0x07a, 0x078, 0x076, 0x074, 0x072, 0x070, 0x06e, 0x06c, 0x06a, 0x068, 0x066, 0x064, 0x062, 0x060,
+    0x05e, 0x05c, 0x05b, 0x059, 0x057, 0x055, 0x053, 0x052, 0x050, 0x04e, 0x04d, 0x04b, 0x04a, 0x048, 0x046, 0x045,
+    0x043, 0x042, 0x040, 0x03f, 0x03e, 0x03c, 0x03b, 0x039, 0x038, 0x037, 0x035, 0x034, 0x033, 0x031, 0x030, 0x02f,
+    0x02e, 0x02d, 0x02b, 0x02a, 0x029, 0x028, 0x027, 0x026, 0x025, 0x024, 0x023, 0x022, 0x021, 0x020, 0x01f, 0x01e,
+    0x01d, 0x01c, 0x01b, 0x01a, 0x019, 0x018, 0x017, 0x017, 0x016, 0x015, 0x014, 0x014, 0x013, 0x012, 0x011, 0x011,
+    0x010, 0x00f, 0x00f, 0x00e, 0x00d, 0x00d, 0x00c, 0x00c, 0x00b, 0x00a, 0x00a, 0x009, 0x009, 0x008, 0x008, 0x007,
+    0x007, 0x007, 0x006, 0x006, 0x005, 0x005, 0x005, 0x004, 0x004, 0x004, 0x003, 0x003, 0x003, 0x002, 0x002, 0x002,
+    0x002, 0x001, 0x001, 0x001, 0x001, 0x001, 0x001, 0x001, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000
+};
+
+static const uint16_t FAST_EXP_ROM[256] = {
+    0x7fa, 0x7f5, 0x7ef, 0x7ea, 0x7e4, 0x7df, 0x7da, 0x7d4, 0x7cf, 0x7c9, 0x7c4, 0x7bf, 0x7b9, 0x7b4, 0x7ae, 0x7a9,
+    0x7a4, 0x79f, 0x799, 0x794, 0x78f, 0x78a, 0x784, 0x77f, 0x77a, 0x775, 0x770, 0x76a, 0x765, 0x760, 0x75b, 0x756,
+    0x751, 0x74c, 0x747, 0x742, 0x73d, 0x738, 0x733, 0x72e, 0x729, 0x724, 0x71f, 0x71a, 0x715, 0x710, 0x70b, 0x706,
+    0x702, 0x6fd, 0x6f8, 0x6f3, 0x6ee, 0x6e9, 0x6e5, 0x6e0, 0x6db, 0x6d6, 0x6d2, 0x6cd, 0x6c8, 0x6c4, 0x6bf, 0x6ba,
+    0x6b5, 0x6b1, 0x6ac, 0x6a8, 0x6a3, 0x69e, 0x69a, 0x695, 0x691, 0x68c, 0x688, 0x683, 0x67f, 0x67a, 0x676, 0x671,
+    0x66d, 0x668, 0x664, 0x65f, 0x65b, 0x657, 0x652, 0x64e, 0x649, 0x645, 0x641, 0x63c, 0x638, 0x634, 0x630, 0x62b,
+    0x627, 0x623, 0x61e, 0x61a, 0x616, 0x612, 0x60e, 0x609, 0x605, 0x601, 0x5fd, 0x5f9, 0x5f5, 0x5f0, 0x5ec, 0x5e8,
+    0x5e4, 0x5e0, 0x5dc, 0x5d8, 0x5d4, 0x5d0, 0x5cc, 0x5c8, 0x5c4, 0x5c0, 0x5bc, 0x5b8, 0x5b4, 0x5b0, 0x5ac, 0x5a8,
+    0x5a4, 0x5a0, 0x59c, 0x599, 0x595, 0x591, 0x58d, 0x589, 0x585, 0x581, 0x57e, 0x57a, 0x576, 0x572, 0x56f, 0x56b,
+    0x567, 0x563, 0x560, 0x55c, 0x558, 0x554, 0x551, 0x54d, 0x549, 0x546, 0x542, 0x53e, 0x53b, 0x537, 0x534, 0x530,
+    0x52c, 0x529, 0x525, 0x522, 0x51e, 0x51b, 0x517, 0x514, 0x510, 0x50c, 0x509, 0x506, 0x502, 0x4ff, 0x4fb, 0x4f8,
+    0x4f4, 0x4f1, 0x4ed, 0x4ea, 0x4e7, 0x4e3, 0x4e0, 0x4dc, 0x4d9, 0x4d6, 0x4d2, 0x4cf, 0x4cc, 0x4c8, 0x4c5, 0x4c2,
+    0x4be, 0x4bb, 0x4b8, 0x4b5, 0x4b1, 0x4ae, 0x4ab, 0x4a8, 0x4a4, 0x4a1, 0x49e, 0x49b, 0x498, 0x494, 0x491, 0x48e,
+    0x48b, 0x488, 0x485, 0x482, 0x47e, 0x47b, 0x478, 0x475, 0x472, 0x46f, 0x46c, 0x469, 0x466, 0x463, 0x460, 0x45d,
+    0x45a, 0x457, 0x454, 0x451, 0x44e, 0x44b, 0x448, 0x445, 0x442, 0x43f, 0x43c, 0x439, 0x436, 0x433, 0x430, 0x42d,
+    0x42a, 0x428, 0x425, 0x422, 0x41f, 0x41c, 0x419, 0x416, 0x414, 0x411, 0x40e, 0x40b, 0x408, 0x406, 0x403, 0x400
+};
+
+// Register decoding tables, as in Nuked OPL3
+static const uint8_t FAST_MULT[16] = { 1, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 20, 24, 24, 30, 30 };
+static const uint8_t FAST_KSL[16] = { 0, 32, 40, 45, 48, 51, 53, 55, 56, 58, 59, 60, 61, 62, 63, 64 };
+static const uint8_t FAST_KSL_SHIFT[4] = { 8, 1, 2, 0 };
+static const uint8_t FAST_EG_INCSTEP[4][4] = {
+    { 0, 0, 0, 0 }, { 1, 0, 0, 0 }, { 1, 0, 1, 0 }, { 1, 1, 1, 0 }
+};
+static const uint8_t FAST_CHANNEL_SLOTS[9] = { 0, 1, 2, 6, 7, 8, 12, 13, 14 };
+static const int8_t FAST_AD_SLOT[0x20] = {
+    0, 1, 2, 3, 4, 5, -1, -1, 6, 7, 8, 9, 10, 11, -1, -1,
+    12, 13, 14, 15, 16, 17, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+// The waveforms, with the log-sin and exponent ROMs folded in. A wave entry holds the
+// log attenuation of a phase in its low 13 bits and the sign in bit 15.
+struct FastTables {
+    uint16_t waves[8][1024];
+    int16_t  exp[0x2000];
+
+    FastTables()
+    {
+        const uint16_t* logsin = FAST_LOGSIN_ROM;
+        for (int level = 0; level < 0x2000; level++) {
+            exp[level] = (int16_t)((FAST_EXP_ROM[level & 0xFF] << 1) >> (level >> 8));
+        }
+        for (int p = 0; p < 1024; p++) {
+            uint16_t quarter = (p & 0x100) ? logsin[(p & 0xFF) ^ 0xFF] : logsin[p & 0xFF];
+            uint16_t doubled = (p & 0x80) ? logsin[((p ^ 0xFF) << 1) & 0xFF] : logsin[(p << 1) & 0xFF];
+            uint16_t negative = 0x8000;
+            waves[0][p] = quarter | ((p & 0x200) ? negative : 0);
+            waves[1][p] = (p & 0x200) ? 0x1000 : quarter;
+            waves[2][p] = quarter;
+            waves[3][p] = (p & 0x100) ? 0x1000 : logsin[p & 0xFF];
+            waves[4][p] = ((p & 0x200) ? 0x1000 : doubled) | (((p & 0x300) == 0x100) ? negative : 0);
+            waves[5][p] = (p & 0x200) ? 0x1000 : doubled;
+            waves[6][p] = (p & 0x200) ? negative : 0;
+            waves[7][p] = (p & 0x200) ? ((((p & 0x1FF) ^ 0x1FF) << 3) | negative) : (p << 3);
+        }
+    }
+};
+
+static const FastTables& getFastTables()
+{
+    static const FastTables tables;
+    return tables;
+}
+
+// Slot of a channel's operator 0 (modulator) or 1 (carrier), as Nuked numbers them
+static int getFastSlot(int channel, int op)
+{
+    return (channel / 9) * 18 + FAST_CHANNEL_SLOTS[channel % 9] + 3 * op;
+}
+
+// The other channel of a 4-op pair, or -1
+static int getFastPair(int channel)
+{
+    if (channel % 9 < 3) return channel + 3;
+    if (channel % 9 < 6) return channel - 3;
+    return -1;
+}
+
+// Works out a slot's phase increment from its channel's frequency, its multiplier
+// and the vibrato position
+static void fastUpdateStep(FastChip& chip, int s)
+{
+    int ch = chip.channelOf[s];
+    uint16_t fnum = chip.fnum[ch];
+    if (chip.vib[s]) {
+        int range = (fnum >> 7) & 7;
+        if (!(chip.vibpos & 3)) range = 0;
+        else if (chip.vibpos & 1) range >>= 1;
+        range >>= chip.vibshift;
+        if (chip.vibpos & 4) range = -range;
+        fnum = (uint16_t)(fnum + range);
+    }
+    uint32_t base = ((uint32_t)fnum << chip.block[ch]) >> 1;
+    chip.phaseStep[s] = (base * FAST_MULT[chip.mult[s]]) >> 1;
+}
+
+// Works out a slot's fixed attenuation from its level and its channel's key scaling
+static void fastUpdateLevel(FastChip& chip, int s)
+{
+    int ch = chip.channelOf[s];
+    int ksl = (FAST_KSL[chip.fnum[ch] >> 6] << 2) - ((8 - chip.block[ch]) << 5);
+    if (ksl < 0) ksl = 0;
+    chip.egBase[s] = (uint16_t)((chip.tl[s] << 2) + (ksl >> FAST_KSL_SHIFT[chip.ksl[s]]));
+}
+
+// Recomputes both slots of a channel after a frequency change
+static void fastUpdateChannel(FastChip& chip, int ch)
+{
+    int s = getFastSlot(ch, 0);
+    fastUpdateStep(chip, s);
+    fastUpdateStep(chip, s + 3);
+    fastUpdateLevel(chip, s);
+    fastUpdateLevel(chip, s + 3);
+}
+
+// Recounts the mix weights from the channel outputs and their left and right enables.
+// Nuked takes the left mix after slot 14 and the right after slot 32, so the slots
+// above those still hold the previous sample's output (its channel sample delay).
+// A channel sums at most four outputs of at most 4085 in magnitude, so its 16-bit
+// sum never wraps, and the mix is a plain weighted sum of the slot outputs.
+static void fastUpdateMix(FastChip& chip)
+{
+    memset(chip.leftNow, 0, sizeof(chip.leftNow));
+    memset(chip.leftLast, 0, sizeof(chip.leftLast));
+    memset(chip.rightNow, 0, sizeof(chip.rightNow));
+    memset(chip.rightLast, 0, sizeof(chip.rightLast));
+    for (int ch = 0; ch < kFastChannels; ch++) {
+        for (int i = 0; i < 4; i++) {
+            int s = chip.outSlots[ch][i];
+            if (s >= kFastSlots) continue;
+            if (chip.outLeft[ch]) (s < 15 ? chip.leftNow : chip.leftLast)[s]++;
+            if (chip.outRight[ch]) (s < 33 ? chip.rightNow : chip.rightLast)[s]++;
+        }
+    }
+}
+
+// Stores the signals summed into a channel's output
+static void fastSetOutputs(FastChip& chip, int ch, int a, int b, int c, int d)
+{
+    chip.outSlots[ch][0] = (uint8_t)a;
+    chip.outSlots[ch][1] = (uint8_t)b;
+    chip.outSlots[ch][2] = (uint8_t)c;
+    chip.outSlots[ch][3] = (uint8_t)d;
+    fastUpdateMix(chip);
+}
+
+// Connects a channel's slots for its algorithm, as OPL3_ChannelSetupAlg
+static void fastSetupAlgorithm(FastChip& chip, int ch)
+{
+    int s = getFastSlot(ch, 0);
+    const int z = kSignalZero;
+    if (chip.type[ch] == kChannelDrum) {
+        if (ch == 7 || ch == 8) {
+            chip.modSource[s] = z;
+            chip.modSource[s + 3] = z;
+            return;
+        }
+        chip.modSource[s] = (uint8_t)(kSignalFeedback + s);
+        chip.modSource[s + 3] = (uint8_t)((chip.alg[ch] & 1) ? z : s);
+        return;
+    }
+    if (chip.alg[ch] & 0x08) return;
+    if (chip.alg[ch] & 0x04) {
+        int pair = getFastPair(ch);
+        int p = getFastSlot(pair, 0);
+        fastSetOutputs(chip, pair, z, z, z, z);
+        chip.modSource[p] = (uint8_t)(kSignalFeedback + p);
+        switch (chip.alg[ch] & 0x03) {
+            case 0x00:
+                chip.modSource[p + 3] = (uint8_t)p;
+                chip.modSource[s] = (uint8_t)(p + 3);
+                chip.modSource[s + 3] = (uint8_t)s;
+                fastSetOutputs(chip, ch, s + 3, z, z, z);
+                break;
+            case 0x01:
+                chip.modSource[p + 3] = (uint8_t)p;
+                chip.modSource[s] = z;
+                chip.modSource[s + 3] = (uint8_t)s;
+                fastSetOutputs(chip, ch, p + 3, s + 3, z, z);
+                break;
+            case 0x02:
+                chip.modSource[p + 3] = z;
+                chip.modSource[s] = (uint8_t)(p + 3);
+                chip.modSource[s + 3] = (uint8_t)s;
+                fastSetOutputs(chip, ch, p, s + 3, z, z);
+                break;
+            case 0x03:
+                chip.modSource[p + 3] = z;
+                chip.modSource[s] = (uint8_t)(p + 3);
+                chip.modSource[s + 3] = z;
+                fastSetOutputs(chip, ch, p, s, s + 3, z);
+                break;
+        }
+        return;
+    }
+    chip.modSource[s] = (uint8_t)(kSignalFeedback + s);
+    if (chip.alg[ch] & 0x01) {
+        chip.modSource[s + 3] = z;
+        fastSetOutputs(chip, ch, s, s + 3, z, z);
+    } else {
+        chip.modSource[s + 3] = (uint8_t)s;
+        fastSetOutputs(chip, ch, s + 3, z, z, z);
+    }
+}
+
+// Works out a channel's algorithm from its connection bit and, in a 4-op pair, its
+// partner's, as OPL3_ChannelUpdateAlg
+static void fastUpdateAlgorithm(FastChip& chip, int ch)
+{
+    chip.alg[ch] = chip.con[ch];
+    if (chip.newm && chip.type[ch] == kChannel4Op) {
+        int pair = getFastPair(ch);
+        chip.alg[pair] = (uint8_t)(0x04 | (chip.con[ch] << 1) | chip.con[pair]);
+        chip.alg[ch] = 0x08;
+        fastSetupAlgorithm(chip, pair);
+    } else if (chip.newm && chip.type[ch] == kChannel4Op2) {
+        int pair = getFastPair(ch);
+        chip.alg[ch] = (uint8_t)(0x04 | (chip.con[pair] << 1) | chip.con[ch]);
+        chip.alg[pair] = 0x08;
+        fastSetupAlgorithm(chip, ch);
+    } else {
+        fastSetupAlgorithm(chip, ch);
+    }
+}
+
+static void fastKeyOn(FastChip& chip, int s, uint8_t type)
+{
+    chip.key[s] |= type;
+    chip.activeSlots |= 1ull << s;
+}
+
+static void fastKeyOff(FastChip& chip, int s, uint8_t type) { chip.key[s] &= (uint8_t)~type; }
+
+static void fastKeyDrum(FastChip& chip, int s, bool on)
+{
+    if (on) fastKeyOn(chip, s, 2);
+    else fastKeyOff(chip, s, 2);
+}
+
+// Keys a channel's slots on or off, both channels' in a 4-op pair
+static void fastKeyChannel(FastChip& chip, int ch, bool on)
+{
+    int slots[4];
+    int count = 0;
+    if (!chip.newm || chip.type[ch] == kChannel2Op || chip.type[ch] == kChannelDrum) {
+        slots[count++] = getFastSlot(ch, 0);
+    } else if (chip.type[ch] == kChannel4Op) {
+        slots[count++] = getFastSlot(ch, 0);
+        slots[count++] = getFastSlot(getFastPair(ch), 0);
+    }
+    for (int i = 0; i < count; i++) {
+        if (on) {
+            fastKeyOn(chip, slots[i], 1);
+            fastKeyOn(chip, slots[i] + 3, 1);
+        } else {
+            fastKeyOff(chip, slots[i], 1);
+            fastKeyOff(chip, slots[i] + 3, 1);
+        }
+    }
+}
+
+// Switches rhythm mode and keys the drums, as OPL3_ChannelUpdateRhythm
+static void fastUpdateRhythm(FastChip& chip, uint8_t data)
+{
+    chip.rhy = data & 0x3F;
+    const int hh = getFastSlot(7, 0), sd = hh + 3, tom = getFastSlot(8, 0), tc = tom + 3, bd = getFastSlot(6, 0);
+    if (chip.rhy & 0x20) {
+        const int z = kSignalZero;
+        fastSetOutputs(chip, 6, bd + 3, bd + 3, z, z);
+        fastSetOutputs(chip, 7, hh, hh, sd, sd);
+        fastSetOutputs(chip, 8, tom, tom, tc, tc);
+        for (int ch = 6; ch < 9; ch++) {
+            chip.type[ch] = kChannelDrum;
+            fastSetupAlgorithm(chip, ch);
+        }
+        fastKeyDrum(chip, hh, (chip.rhy & 0x01) != 0);
+        fastKeyDrum(chip, tc, (chip.rhy & 0x02) != 0);
+        fastKeyDrum(chip, tom, (chip.rhy & 0x04) != 0);
+        fastKeyDrum(chip, sd, (chip.rhy & 0x08) != 0);
+        fastKeyDrum(chip, bd, (chip.rhy & 0x10) != 0);
+        fastKeyDrum(chip, bd + 3, (chip.rhy & 0x10) != 0);
+    } else {
+        for (int ch = 6; ch < 9; ch++) {
+            chip.type[ch] = kChannel2Op;
+            fastSetupAlgorithm(chip, ch);
+            fastKeyOff(chip, getFastSlot(ch, 0), 2);
+            fastKeyOff(chip, getFastSlot(ch, 0) + 3, 2);
+        }
+    }
+}
+
+// Turns 4-op pairs on and off from register 0x104
+static void fastSetFourOp(FastChip& chip, uint8_t data)
+{
+    for (int bit = 0; bit < 6; bit++) {
+        int ch = bit < 3 ? bit : bit + 6;
+        if ((data >> bit) & 1) {
+            chip.type[ch] = kChannel4Op;
+            chip.type[ch + 3] = kChannel4Op2;
+            fastUpdateAlgorithm(chip, ch);
+        } else {
+            chip.type[ch] = kChannel2Op;
+            chip.type[ch + 3] = kChannel2Op;
+            fastUpdateAlgorithm(chip, ch);
+            fastUpdateAlgorithm(chip, ch + 3);
+        }
+    }
+}
+
+// Sets a channel's F-number and block from A0 (lowBits) or B0, copying them to the
+// second channel of a 4-op pair
+static void fastWriteFrequency(FastChip& chip, int ch, uint8_t data, bool lowBits)
+{
+    if (chip.newm && chip.type[ch] == kChannel4Op2) return;
+    if (lowBits) {
+        chip.fnum[ch] = (uint16_t)((chip.fnum[ch] & 0x300) | data);
+    } else {
+        chip.fnum[ch] = (uint16_t)((chip.fnum[ch] & 0xFF) | ((data & 0x03) << 8));
+        chip.block[ch] = (data >> 2) & 0x07;
+    }
+    chip.ksv[ch] = (uint8_t)((chip.block[ch] << 1) | ((chip.fnum[ch] >> (9 - chip.nts)) & 1));
+    fastUpdateChannel(chip, ch);
+    if (chip.newm && chip.type[ch] == kChannel4Op) {
+        int pair = getFastPair(ch);
+        chip.fnum[pair] = chip.fnum[ch];
+        chip.block[pair] = chip.block[ch];
+        chip.ksv[pair] = chip.ksv[ch];
+        fastUpdateChannel(chip, pair);
+    }
+}
+
+// The output rate as Nuked 1.8's OPL3_Reset sets rateratio, over the 49716 Hz
+// native rate with kFastRsmFrac fractional bits
+void fastSetSampleRate(FastChip& chip, uint32_t sampleRate)
+{
+    chip.rateRatio = (int32_t)((sampleRate << kFastRsmFrac) / 49716);
+}
+
+void fastInitTables()
+{
+    getFastTables();
+}
+
+// Clears a chip to its power-on state, as OPL3_Reset
+void fastReset(FastChip& chip, uint32_t sampleRate)
+{
+    memset(&chip, 0, sizeof(chip));
+    for (int s = 0; s < kFastSlots; s++) {
+        chip.egRout[s] = 0x1FF;
+        chip.egOut[s] = 0x1FF;
+        chip.egGen[s] = kEnvRelease;
+        chip.modSource[s] = kSignalZero;
+    }
+    for (int ch = 0; ch < kFastChannels; ch++) {
+        int s = getFastSlot(ch, 0);
+        chip.channelOf[s] = chip.channelOf[s + 3] = (uint8_t)ch;
+        chip.type[ch] = kChannel2Op;
+        chip.outLeft[ch] = chip.outRight[ch] = 0xFFFF;
+        fastSetupAlgorithm(chip, ch);
+    }
+    chip.noise = 1;
+    fastSetSampleRate(chip, sampleRate);
+    chip.tremoloshift = 4;
+    chip.vibshift = 1;
+}
+
+// Decodes a register write, as OPL3_WriteReg
+void fastWriteReg(FastChip& chip, uint16_t reg, uint8_t v)
+{
+    int high = (reg >> 8) & 1;
+    int regm = reg & 0xFF;
+    int slotIndex = FAST_AD_SLOT[regm & 0x1F];
+    int s = 18 * high + slotIndex;
+    int ch = 9 * high + (regm & 0x0F);
+    switch (regm & 0xF0) {
+        case 0x00:
+            if (high && (regm & 0x0F) == 0x04) fastSetFourOp(chip, v);
+            else if (high && (regm & 0x0F) == 0x05) chip.newm = v & 0x01;
+            else if (!high && (regm & 0x0F) == 0x08) chip.nts = (v >> 6) & 0x01;
+            break;
+        case 0x20: case 0x30:
+            if (slotIndex < 0) break;
+            chip.amMask[s] = ((v >> 7) & 1) ? 0xFFFF : 0;
+            chip.vib[s] = (v >> 6) & 1;
+            chip.egType[s] = (v >> 5) & 1;
+            chip.ksr[s] = (v >> 4) & 1;
+            chip.mult[s] = v & 0x0F;
+            fastUpdateStep(chip, s);
+            break;
+        case 0x40: case 0x50:
+            if (slotIndex < 0) break;
+            chip.ksl[s] = (v >> 6) & 3;
+            chip.tl[s] = v & 0x3F;
+            fastUpdateLevel(chip, s);
+            break;
+        case 0x60: case 0x70:
+            if (slotIndex < 0) break;
+            chip.dr[s] = v & 0x0F;
+            chip.ar[s] = (v >> 4) & 0x0F;
+            break;
+        case 0x80: case 0x90:
+            if (slotIndex < 0) break;
+            chip.rr[s] = v & 0x0F;
+            chip.sl[s] = (v >> 4) & 0x0F;
+            if (chip.sl[s] == 0x0F) chip.sl[s] = 0x1F;
+            break;
+        case 0xE0: case 0xF0:
+            if (slotIndex < 0) break;
+            chip.wf[s] = v & 0x07;
+            if (!chip.newm) chip.wf[s] &= 0x03;
+            break;
+        case 0xA0:
+            if ((regm & 0x0F) < 9) fastWriteFrequency(chip, ch, v, true);
+            break;
+        case 0xB0:
+            if (regm == 0xBD && !high) {
+                chip.tremoloshift = (uint8_t)((((v >> 7) ^ 1) << 1) + 2);
+                chip.vibshift = ((v >> 6) & 1) ^ 1;
+                for (int i = 0; i < kFastSlots; i++) fastUpdateStep(chip, i);
+                fastUpdateRhythm(chip, v);
+            } else if ((regm & 0x0F) < 9) {
+                fastWriteFrequency(chip, ch, v, false);
+                fastKeyChannel(chip, ch, (v & 0x20) != 0);
+            }
+            break;
+        case 0xC0:
+            if ((regm & 0x0F) < 9) {
+                chip.fb[ch] = (v & 0x0E) >> 1;
+                chip.con[ch] = v & 0x01;
+                int s0 = getFastSlot(ch, 0);
+                chip.fbMul[s0] = chip.fbMul[s0 + 3] = (int16_t)(chip.fb[ch] ? 1 << (chip.fb[ch] + 7) : 0);
+                fastUpdateAlgorithm(chip, ch);
+                if (chip.newm) {
+                    chip.outLeft[ch] = ((v >> 4) & 1) ? 0xFFFF : 0;
+                    chip.outRight[ch] = ((v >> 5) & 1) ? 0xFFFF : 0;
+                } else {
+                    chip.outLeft[ch] = chip.outRight[ch] = 0xFFFF;
+                }
+                fastUpdateMix(chip);
+            }
+            break;
+    }
+}
+
+// Steps a slot's envelope generator, as OPL3_EnvelopeCalc without the output sum
+static void fastStepEnvelope(FastChip& chip, int s)
+{
+    uint8_t regRate = 0;
+    bool reset = false;
+    if (chip.key[s] && chip.egGen[s] == kEnvRelease) {
+        reset = true;
+        regRate = chip.ar[s];
+    } else {
+        switch (chip.egGen[s]) {
+            case kEnvAttack:  regRate = chip.ar[s]; break;
+            case kEnvDecay:   regRate = chip.dr[s]; break;
+            case kEnvSustain: if (!chip.egType[s]) regRate = chip.rr[s]; break;
+            case kEnvRelease: regRate = chip.rr[s]; break;
+        }
+    }
+    chip.phaseReset[s] = reset ? 0xFFFFFFFFu : 0;
+
+    int ks = chip.ksv[chip.channelOf[s]] >> ((chip.ksr[s] ^ 1) << 1);
+    int rate = ks + (regRate << 2);
+    int rateHi = rate >> 2;
+    int rateLo = rate & 0x03;
+    if (rateHi & 0x10) rateHi = 0x0F;
+    int egShift = rateHi + chip.egAdd;
+    int shift = 0;
+    if (regRate != 0) {
+        if (rateHi < 12) {
+            if (chip.egState) {
+                if (egShift == 12) shift = 1;
+                else if (egShift == 13) shift = (rateLo >> 1) & 1;
+                else if (egShift == 14) shift = rateLo & 1;
+            }
+        } else {
+            shift = (rateHi & 0x03) + FAST_EG_INCSTEP[rateLo][chip.egTimerLo];
+            if (shift & 0x04) shift = 0x03;
+            if (!shift) shift = chip.egState;
+        }
+    }
+
+    int rout = chip.egRout[s];
+    int next = rout;
+    int inc = 0;
+    if (reset && rateHi == 0x0F) next = 0;
+    bool off = (rout & 0x1F8) == 0x1F8;
+    if (chip.egGen[s] != kEnvAttack && !reset && off) next = 0x1FF;
+    switch (chip.egGen[s]) {
+        case kEnvAttack:
+            if (!rout) chip.egGen[s] = kEnvDecay;
+            else if (chip.key[s] && shift > 0 && rateHi != 0x0F) inc = ~rout >> (4 - shift);
+            break;
+        case kEnvDecay:
+            if ((rout >> 4) == chip.sl[s]) chip.egGen[s] = kEnvSustain;
+            else if (!off && !reset && shift > 0) inc = 1 << (shift - 1);
+            break;
+        default:
+            if (!off && !reset && shift > 0) inc = 1 << (shift - 1);
+            break;
+    }
+    chip.egRout[s] = (uint16_t)((next + inc) & 0x1FF);
+    if (reset) chip.egGen[s] = kEnvAttack;
+    if (!chip.key[s]) chip.egGen[s] = kEnvRelease;
+}
+
+// Steps the 23-bit noise generator. Each step shifts in bit 0 ^ bit 14 at the top;
+// a new bit only reaches bit 14 after 9 steps, so up to 9 steps go at once.
+static uint32_t fastStepNoise(uint32_t noise, int steps)
+{
+    while (steps > 0) {
+        int n = steps < 9 ? steps : 9;
+        noise = (noise >> n) | (((noise ^ (noise >> 14)) & ((1u << n) - 1)) << (23 - n));
+        steps -= n;
+    }
+    return noise;
+}
+
+static int16_t fastClip(int32_t sample)
+{
+    if (sample > 32767) return 32767;
+    if (sample < -32768) return -32768;
+    return (int16_t)sample;
+}
+
+// Generates one native-rate stereo sample, as OPL3_Generate
+static void fastClock(FastChip& chip, const FastTables& tables, int16_t* frame)
+{
+    int16_t* current = chip.signal[0];
+    int16_t* previous = chip.signal[1];
+
+    // Feedback from the last two outputs, shifted right by 9 - FB. The sum is at
+    // most 8170 in magnitude, and taking the high half of its product with
+    // 2^(7 + FB) rounds down just as the shift does.
+#if defined(__SSE2__)
+    for (int s = 0; s < kFastLanes; s += 8) {
+        __m128i sum = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(previous + s)),
+                                    _mm_loadu_si128((const __m128i*)(current + s)));
+        __m128i feedback = _mm_mulhi_epi16(sum, _mm_load_si128((const __m128i*)(chip.fbMul + s)));
+        _mm_storeu_si128((__m128i*)(current + kSignalFeedback + s), feedback);
+    }
+#else
+    for (int s = 0; s < kFastSlots; s++) {
+        current[kSignalFeedback + s] = (int16_t)(((previous[s] + current[s]) * chip.fbMul[s]) >> 16);
+    }
+#endif
+    memcpy(previous, current, kFastSlots * sizeof(int16_t));
+
+    // Envelope outputs, from the attenuation before this sample's step
+    uint16_t tremolo = chip.tremolo;
+#if defined(__SSE2__)
+    const __m128i limit = _mm_set1_epi16(0x1FF);
+    const __m128i trem = _mm_set1_epi16((short)tremolo);
+    for (int s = 0; s < kFastLanes; s += 8) {
+        __m128i out = _mm_add_epi16(_mm_load_si128((const __m128i*)(chip.egRout + s)),
+                                    _mm_load_si128((const __m128i*)(chip.egBase + s)));
+        out = _mm_add_epi16(out, _mm_and_si128(trem, _mm_load_si128((const __m128i*)(chip.amMask + s))));
+        _mm_store_si128((__m128i*)(chip.egOut + s), _mm_min_epi16(out, limit));
+    }
+#else
+    for (int s = 0; s < kFastSlots; s++) {
+        int out = chip.egRout[s] + chip.egBase[s] + (tremolo & chip.amMask[s]);
+        chip.egOut[s] = (uint16_t)(out > 0x1FF ? 0x1FF : out);
+    }
+#endif
+
+    // Envelope generators of the active slots. A slot leaves the mask once it is
+    // keyed off at full attenuation, where its envelope cannot move. Holding at the
+    // sustain level of a sustaining patch (rate 0) cannot move either, unless the
+    // level is in the top 8 steps, which snap to full attenuation.
+    uint64_t active = chip.activeSlots;
+    for (uint64_t pending = active; pending; pending &= pending - 1) {
+        int s = __builtin_ctzll(pending);
+        uint16_t rout = chip.egRout[s];
+        if (chip.key[s] && chip.egGen[s] == kEnvSustain && chip.egType[s] && (rout & 0x1F8) != 0x1F8) continue;
+        fastStepEnvelope(chip, s);
+        if (!chip.key[s] && chip.egGen[s] == kEnvRelease && chip.egRout[s] == 0x1FF) {
+            chip.activeSlots &= ~(1ull << s);
+        }
+    }
+
+    // Phases
+#if defined(__SSE2__)
+    for (int s = 0; s < kFastSlots; s += 4) {
+        __m128i phase = _mm_load_si128((const __m128i*)(chip.phase + s));
+        __m128i reset = _mm_load_si128((const __m128i*)(chip.phaseReset + s));
+        __m128i step = _mm_load_si128((const __m128i*)(chip.phaseStep + s));
+        _mm_store_si128((__m128i*)(chip.phaseOut + s), _mm_srli_epi32(phase, 9));
+        _mm_store_si128((__m128i*)(chip.phase + s), _mm_add_epi32(_mm_andnot_si128(reset, phase), step));
+    }
+#else
+    for (int s = 0; s < kFastSlots; s++) {
+        chip.phaseOut[s] = chip.phase[s] >> 9;
+        chip.phase[s] = (chip.phase[s] & ~chip.phaseReset[s]) + chip.phaseStep[s];
+    }
+#endif
+
+    // The noise generator steps once per slot. The hi-hat (slot 13), snare (16) and
+    // top cymbal (17) take their phases from it and from each other's phase bits.
+    uint32_t noise = fastStepNoise(chip.noise, 13);
+    uint32_t hh = chip.phaseOut[13];
+    chip.hhBit2 = (hh >> 2) & 1;
+    chip.hhBit3 = (hh >> 3) & 1;
+    chip.hhBit7 = (hh >> 7) & 1;
+    chip.hhBit8 = (hh >> 8) & 1;
+    bool rhythm = (chip.rhy & 0x20) != 0;
+    if (rhythm) {
+        uint32_t rmXor = (chip.hhBit2 ^ chip.hhBit7) | (chip.hhBit3 ^ chip.tcBit5) | (chip.tcBit3 ^ chip.tcBit5);
+        chip.phaseOut[13] = (rmXor << 9) | ((rmXor ^ (noise & 1)) ? 0xD0 : 0x34);
+    }
+    noise = fastStepNoise(noise, 3);
+    if (rhythm) {
+        chip.phaseOut[16] = (chip.hhBit8 << 9) | ((chip.hhBit8 ^ (noise & 1)) << 8);
+        uint32_t tc = chip.phaseOut[17];
+        chip.tcBit3 = (tc >> 3) & 1;
+        chip.tcBit5 = (tc >> 5) & 1;
+        uint32_t rmXor = (chip.hhBit2 ^ chip.hhBit7) | (chip.hhBit3 ^ chip.tcBit5) | (chip.tcBit3 ^ chip.tcBit5);
+        chip.phaseOut[17] = (rmXor << 9) | 0x80;
+    }
+    chip.noise = fastStepNoise(noise, kFastSlots - 16);
+
+    // Waveforms, in slot order: a modulator always has a lower slot than its carrier.
+    // A slot outside the mask (taken before the envelope step, as egOut was) is at
+    // full attenuation, where the exponent is 0 whatever the phase: it outputs -1
+    // where its waveform is negative and 0 elsewhere, and needs only the sign.
+    for (int s = 0; s < kFastSlots; s++) {
+        uint16_t wave = tables.waves[chip.wf[s]][(chip.phaseOut[s] + current[chip.modSource[s]]) & 0x3FF];
+        if (!((active >> s) & 1)) {
+            current[s] = (int16_t)-(wave >> 15);
+            continue;
+        }
+        uint32_t level = (wave & 0x1FFF) + (chip.egOut[s] << 3);
+        if (level > 0x1FFF) level = 0x1FFF;
+        current[s] = (int16_t)(tables.exp[level] ^ -(int16_t)(wave >> 15));
+    }
+
+    // Mixes, as weighted sums of this sample's and the last sample's outputs
+    int32_t left = 0, right = 0;
+#if defined(__SSE2__)
+    __m128i sumLeft = _mm_setzero_si128();
+    __m128i sumRight = _mm_setzero_si128();
+    for (int s = 0; s < kFastLanes; s += 8) {
+        __m128i now = _mm_loadu_si128((const __m128i*)(current + s));
+        __m128i last = _mm_loadu_si128((const __m128i*)(previous + s));
+        sumLeft = _mm_add_epi32(sumLeft, _mm_madd_epi16(now, _mm_load_si128((const __m128i*)(chip.leftNow + s))));
+        sumLeft = _mm_add_epi32(sumLeft, _mm_madd_epi16(last, _mm_load_si128((const __m128i*)(chip.leftLast + s))));
+        sumRight = _mm_add_epi32(sumRight, _mm_madd_epi16(now, _mm_load_si128((const __m128i*)(chip.rightNow + s))));
+        sumRight = _mm_add_epi32(sumRight, _mm_madd_epi16(last, _mm_load_si128((const __m128i*)(chip.rightLast + s))));
+    }
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, sumLeft);
+    left = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_si128((__m128i*)lanes, sumRight);
+    right = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#else
+    for (int s = 0; s < kFastSlots; s++) {
+        left += current[s] * chip.leftNow[s] + previous[s] * chip.leftLast[s];
+        right += current[s] * chip.rightNow[s] + previous[s] * chip.rightLast[s];
+    }
+#endif
+    frame[0] = fastClip(left);
+    frame[1] = fastClip(chip.mixRight);
+    chip.mixRight = right;
+
+    // Tremolo, vibrato and envelope timers
+    if ((chip.timer & 0x3F) == 0x3F) chip.tremolopos = (chip.tremolopos + 1) % 210;
+    if (chip.tremolopos < 105) chip.tremolo = chip.tremolopos >> chip.tremoloshift;
+    else chip.tremolo = (uint8_t)((210 - chip.tremolopos) >> chip.tremoloshift);
+    if ((chip.timer & 0x3FF) == 0x3FF) {
+        chip.vibpos = (chip.vibpos + 1) & 7;
+        for (int s = 0; s < kFastSlots; s++) {
+            if (chip.vib[s]) fastUpdateStep(chip, s);
+        }
+    }
+    chip.timer++;
+
+    if (chip.egState) {
+        // The lowest set bit of the timer, if it is among the low 13
+        int shift = chip.egTimer ? __builtin_ctzll(chip.egTimer) : 13;
+        chip.egAdd = shift > 12 ? 0 : (uint8_t)(shift + 1);
+        chip.egTimerLo = (uint8_t)(chip.egTimer & 0x3);
+    }
+    if (chip.egTimerRem || chip.egState) {
+        if (chip.egTimer == 0xFFFFFFFFFull) {
+            chip.egTimer = 0;
+            chip.egTimerRem = 1;
+        } else {
+            chip.egTimer++;
+            chip.egTimerRem = 0;
+        }
+    }
+    chip.egState ^= 1;
+}
+
+// Generates numFrames native-rate frames of interleaved stereo
+void fastGenerate(FastChip& chip, int16_t* buffer, int32_t numFrames)
+{
+    const FastTables& tables = getFastTables();
+    for (int32_t i = 0; i < numFrames; i++) {
+        fastClock(chip, tables, buffer + i * 2);
+    }
+}
+
+// Generates numFrames frames at the host rate through the same linear resampler as
+// OPL3_GenerateStream, so both cores sound alike in the Linear resampler mode
+void fastGenerateStream(FastChip& chip, int16_t* buffer, int32_t numFrames)
+{
+    const FastTables& tables = getFastTables();
+    for (int32_t i = 0; i < numFrames; i++) {
+        while (chip.sampleCount >= chip.rateRatio) {
+            chip.oldSamples[0] = chip.samples[0];
+            chip.oldSamples[1] = chip.samples[1];
+            fastClock(chip, tables, chip.samples);
+            chip.sampleCount -= chip.rateRatio;
+        }
+        for (int side = 0; side < 2; side++) {
+            buffer[i * 2 + side] = (int16_t)((chip.oldSamples[side] * (chip.rateRatio - chip.sampleCount)
+                                              + chip.samples[side] * chip.sampleCount) / chip.rateRatio);
+        }
+        chip.sampleCount += 1 << kFastRsmFrac;
+    }
+}
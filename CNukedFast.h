@@ -0,0 +1,111 @@
+/******************************************************************************
+ * CNukedFast.h (the fast OPL3 core, see CNukedFast.cpp)                       *
+ ******************************************************************************/
+/*
+ * Copyright (C) 2013-2020 Nuke.YKT (Nuked OPL3)
+ *
+ * This file is derived from Nuked OPL3 and, unlike the rest of CNukedVST, is
+ * licensed under the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CNUKED_FAST_H
+#define CNUKED_FAST_H
+
+#include <stdint.h>
+
+// Slots and channels of one chip
+static const int kFastSlots = 36;
+static const int kFastChannels = 18;
+
+// 16-bit slot arrays are padded to whole SSE2 vectors
+static const int kFastLanes = 40;
+
+// FastChip::signal holds the slot outputs, then the slots' feedback from here
+static const int kSignalFeedback = kFastSlots;
+
+// Fractional bits of the linear resampler's rate ratio: RSM_FRAC of Nuked OPL3 1.8,
+// the version this core follows
+static const int kFastRsmFrac = 10;
+
+// Operator, channel and timer state of one chip
+struct FastChip {
+    // Slots
+    alignas(16) uint32_t phase[kFastSlots];      // phase accumulator, 10.9 fixed point
+    alignas(16) uint32_t phaseStep[kFastSlots];  // added every sample, vibrato included
+    alignas(16) uint32_t phaseReset[kFastSlots]; // all ones when a key-on restarts the phase
+    alignas(16) uint32_t phaseOut[kFastSlots];   // phase the waveform is read at
+    alignas(16) uint16_t egRout[kFastLanes];               // envelope attenuation, 0..0x1FF
+    alignas(16) uint16_t egBase[kFastLanes];               // total level plus key scale level
+    alignas(16) uint16_t amMask[kFastLanes];               // all ones when tremolo applies
+    alignas(16) uint16_t egOut[kFastLanes];                // attenuation the waveform is read with
+    // This sample's outputs and feedback, and the last outputs. A row has room for the
+    // feedback of all kFastLanes lanes; the lanes past the last slot store zeros.
+    alignas(16) int16_t signal[2][kSignalFeedback + kFastLanes];
+    alignas(16) int16_t fbMul[kFastLanes];    // 2^(16 - shift) for a feedback shift, 0 for none
+    uint8_t  modSource[kFastSlots]; // signal modulating each slot
+    uint8_t  egGen[kFastSlots];     // kEnvAttack..kEnvRelease
+    uint8_t  key[kFastSlots];       // 1 keyed on by its channel, 2 by the rhythm register
+    uint8_t  channelOf[kFastSlots];
+    uint8_t  vib[kFastSlots], egType[kFastSlots];
+    uint8_t  ksr[kFastSlots], mult[kFastSlots], ksl[kFastSlots];
+    uint8_t  tl[kFastSlots], ar[kFastSlots], dr[kFastSlots];
+    uint8_t  sl[kFastSlots], rr[kFastSlots], wf[kFastSlots];
+    uint64_t activeSlots;  // bit s set while slot s is keyed on or has not finished its release
+
+    // Channels
+    uint16_t fnum[kFastChannels];
+    uint8_t  block[kFastChannels], ksv[kFastChannels];
+    uint8_t  fb[kFastChannels], con[kFastChannels];
+    uint8_t  alg[kFastChannels], type[kFastChannels];
+    uint16_t outLeft[kFastChannels], outRight[kFastChannels]; // 0 or 0xFFFF
+    uint8_t  outSlots[kFastChannels][4];   // signals summed into the channel's output
+
+    // How many times each slot's output counts in the left and right mix, from this
+    // sample's outputs (Now) or the last sample's (Last)
+    alignas(16) int16_t leftNow[kFastLanes], leftLast[kFastLanes];
+    alignas(16) int16_t rightNow[kFastLanes], rightLast[kFastLanes];
+
+    // Timers, LFOs, rhythm and the output
+    uint16_t timer;
+    uint64_t egTimer;
+    uint8_t  egTimerRem, egState, egAdd, egTimerLo;
+    uint8_t  newm, nts, rhy;
+    uint8_t  vibpos, vibshift, tremolo, tremolopos, tremoloshift;
+    uint32_t noise;
+    uint8_t  hhBit2, hhBit3, hhBit7, hhBit8, tcBit3, tcBit5;
+    int32_t  mixRight;  // the right output lags the left by one sample
+
+    // Nuked's linear resampler
+    int32_t  rateRatio, sampleCount;
+    int16_t  oldSamples[2], samples[2];
+};
+
+// Builds the lookup tables; call before the first chip is clocked
+void fastInitTables();
+
+// Clears a chip to its power-on state, as OPL3_Reset
+void fastReset(FastChip& chip, uint32_t sampleRate);
+
+// Sets the output rate of fastGenerateStream, keeping the chip's state
+void fastSetSampleRate(FastChip& chip, uint32_t sampleRate);
+
+// Decodes a register write, as OPL3_WriteReg
+void fastWriteReg(FastChip& chip, uint16_t reg, uint8_t v);
+
+// Generates numFrames native-rate frames of interleaved stereo
+void fastGenerate(FastChip& chip, int16_t* buffer, int32_t numFrames);
+
+// Generates numFrames frames at the output rate through Nuked's linear resampler
+void fastGenerateStream(FastChip& chip, int16_t* buffer, int32_t numFrames);
+
+#endif
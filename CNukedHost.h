@@ -0,0 +1,47 @@
+/******************************************************************************
+ * CNukedHost.h (minimal VST2 host plumbing shared by the bench and renderer) *
+ ******************************************************************************/
+
+#ifndef __cnukedhost_h__
+#define __cnukedhost_h__
+
+#include "aeffect.h"
+#include "aeffectx.h"
+
+#include <chrono>
+#include <cstring>
+
+// The tools load the plugin in-process and answer every host request with 0
+static inline intptr hostCallback(AEffect* effect, int32 opcode, int32 index, intptr value, void* ptr, float opt)
+{
+    return 0;
+}
+
+// VstEvents only declares two event pointers, so we carry our own storage
+static const int kHostMaxEvents = 4096;
+
+struct HostEvents {
+    int32     numEvents;
+    intptr    reserved;
+    VstEvent* events[kHostMaxEvents];
+};
+
+// Looks up a parameter by the name the plugin reports, -1 if there is none
+static inline int32 findParameter(AEffect* effect, const char* name)
+{
+    char label[64];
+    for (int32 i = 0; i < effect->numParams; i++) {
+        label[0] = 0;
+        effect->dispatcher(effect, effGetParamName, i, 0, label, 0.f);
+        if (!strcmp(label, name)) return i;
+    }
+    return -1;
+}
+
+static inline double nowSeconds()
+{
+    using namespace std::chrono;
+    return duration_cast<duration<double> >(steady_clock::now().time_since_epoch()).count();
+}
+
+#endif // __cnukedhost_h__
@@ -0,0 +1,468 @@
+/******************************************************************************
+ * CNukedRender.cpp (offline renderer: Standard MIDI File in, audio out)      *
+ ******************************************************************************/
+
+#include "CNukedHost.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// 1) Minimal host plumbing (see CNukedHost.h)
+// -----------------------------------------------------------------------------
+// Events are handed over in calls of up to kMaxBlockEvents, the plugin's queue size
+static const int kMaxBlockEvents = 1024;
+static_assert(kMaxBlockEvents <= kHostMaxEvents, "a call must fit in HostEvents");
+
+// -----------------------------------------------------------------------------
+// 2) Standard MIDI File reader
+// -----------------------------------------------------------------------------
+// Reads format 0 and 1 files with PPQ or SMPTE timing. Every track is flattened
+// into one list of channel messages stamped with their tick; the tempo map is
+// collected separately. SysEx and meta events other than tempo are skipped.
+struct MidiMessage {
+    uint64_t tick;
+    int      order;      // position in the file, keeps simultaneous events stable
+    uint8_t  data[3];
+    uint64_t frame;      // filled in once the tempo map is applied
+};
+
+struct TempoChange {
+    uint64_t tick;
+    uint32_t usPerQuarter;
+};
+
+struct MidiFile {
+    int                       division;   // ticks per quarter note, or negative for SMPTE
+    std::vector<MidiMessage>  messages;
+    std::vector<TempoChange>  tempos;
+};
+
+static uint32_t readBE(const uint8_t* p, int bytes)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < bytes; i++) v = (v << 8) | p[i];
+    return v;
+}
+
+// Variable-length quantity; returns false when it runs past `end`
+static bool readVLQ(const uint8_t*& p, const uint8_t* end, uint32_t& value)
+{
+    value = 0;
+    for (int i = 0; i < 4; i++) {
+        if (p >= end) return false;
+        uint8_t b = *p++;
+        value = (value << 7) | (b & 0x7F);
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static bool parseTrack(const uint8_t* p, const uint8_t* end, MidiFile& midi)
+{
+    uint64_t tick = 0;
+    uint8_t running = 0;
+    while (p < end) {
+        uint32_t delta;
+        if (!readVLQ(p, end, delta)) return false;
+        tick += delta;
+        if (p >= end) return false;
+
+        uint8_t status = *p;
+        if (status == 0xFF) {
+            // Meta event: only tempo matters, end of track stops the track
+            if (end - p < 2) return false;
+            uint8_t type = p[1];
+            p += 2;
+            uint32_t length;
+            if (!readVLQ(p, end, length) || (uint32_t)(end - p) < length) return false;
+            if (type == 0x51 && length == 3) {
+                TempoChange tempo = { tick, readBE(p, 3) };
+                midi.tempos.push_back(tempo);
+            }
+            p += length;
+            if (type == 0x2F) break;
+            continue;
+        }
+        if (status == 0xF0 || status == 0xF7) {
+            // SysEx: skipped, and it cancels running status
+            p++;
+            uint32_t length;
+            if (!readVLQ(p, end, length) || (uint32_t)(end - p) < length) return false;
+            p += length;
+            running = 0;
+            continue;
+        }
+
+        if (status & 0x80) {
+            running = status;
+            p++;
+        } else if (!running) {
+            return false;
+        }
+
+        uint8_t type = running & 0xF0;
+        int dataBytes = (type == 0xC0 || type == 0xD0) ? 1 : 2;
+        if (end - p < dataBytes) return false;
+
+        MidiMessage msg;
+        msg.tick = tick;
+        msg.order = (int)midi.messages.size();
+        msg.data[0] = running;
+        msg.data[1] = p[0];
+        msg.data[2] = dataBytes > 1 ? p[1] : 0;
+        msg.frame = 0;
+        midi.messages.push_back(msg);
+        p += dataBytes;
+    }
+    return true;
+}
+
+static bool loadMidiFile(const char* path, MidiFile& midi)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    std::vector<uint8_t> bytes;
+    uint8_t buffer[65536];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        bytes.insert(bytes.end(), buffer, buffer + got);
+    }
+    fclose(f);
+
+    const uint8_t* p = bytes.data();
+    const uint8_t* end = p + bytes.size();
+    if (bytes.size() < 14 || memcmp(p, "MThd", 4) || readBE(p + 4, 4) < 6) {
+        fprintf(stderr, "%s is not a Standard MIDI File\n", path);
+        return false;
+    }
+    uint32_t headerLength = readBE(p + 4, 4);
+    int numTracks = (int)readBE(p + 10, 2);
+    midi.division = (int16_t)readBE(p + 12, 2);
+    if (midi.division == 0 || (uint64_t)(end - p) < 8 + (uint64_t)headerLength) {
+        fprintf(stderr, "%s has a broken header\n", path);
+        return false;
+    }
+    p += 8 + headerLength;
+
+    for (int track = 0; track < numTracks && end - p >= 8; track++) {
+        uint32_t length = readBE(p + 4, 4);
+        bool isTrack = !memcmp(p, "MTrk", 4);
+        p += 8;
+        if ((uint32_t)(end - p) < length) {
+            fprintf(stderr, "%s: track %d is truncated\n", path, track);
+            return false;
+        }
+        // Unknown chunks are skipped, as the format requires
+        if (isTrack && !parseTrack(p, p + length, midi)) {
+            fprintf(stderr, "%s: track %d is malformed\n", path, track);
+            return false;
+        }
+        p += length;
+    }
+    return true;
+}
+
+// Converts ticks to sample frames at `sampleRate` through the tempo map
+static void applyTempoMap(MidiFile& midi, double sampleRate)
+{
+    std::stable_sort(midi.messages.begin(), midi.messages.end(),
+                     [](const MidiMessage& a, const MidiMessage& b) {
+                         return a.tick != b.tick ? a.tick < b.tick : a.order < b.order;
+                     });
+    std::stable_sort(midi.tempos.begin(), midi.tempos.end(),
+                     [](const TempoChange& a, const TempoChange& b) { return a.tick < b.tick; });
+
+    if (midi.division < 0) {
+        // SMPTE: frames per second times ticks per frame, no tempo map
+        int fps = -(midi.division >> 8);
+        int ticksPerFrame = midi.division & 0xFF;
+        double secondsPerTick = 1.0 / ((fps == 29 ? 29.97 : fps) * ticksPerFrame);
+        for (MidiMessage& msg : midi.messages) {
+            msg.frame = (uint64_t)(msg.tick * secondsPerTick * sampleRate + 0.5);
+        }
+        return;
+    }
+
+    // Walk the messages and the tempo changes together, accumulating seconds
+    double seconds = 0.0;
+    uint64_t lastTick = 0;
+    double secondsPerTick = 500000.0 / 1e6 / midi.division;   // 120 BPM until told otherwise
+    size_t t = 0;
+    for (MidiMessage& msg : midi.messages) {
+        while (t < midi.tempos.size() && midi.tempos[t].tick <= msg.tick) {
+            seconds += (midi.tempos[t].tick - lastTick) * secondsPerTick;
+            lastTick = midi.tempos[t].tick;
+            secondsPerTick = midi.tempos[t].usPerQuarter / 1e6 / midi.division;
+            t++;
+        }
+        msg.frame = (uint64_t)((seconds + (msg.tick - lastTick) * secondsPerTick) * sampleRate + 0.5);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 3) Output: WAV (32-bit float) or raw interleaved float, with a running hash
+// -----------------------------------------------------------------------------
+struct Output {
+    FILE*    file;
+    bool     wav;
+    uint64_t frames;
+    uint64_t hash;       // FNV-1a over the bytes of every interleaved sample
+};
+
+static void putLE(FILE* f, uint32_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++) fputc((v >> (8 * i)) & 0xFF, f);
+}
+
+// Writes the RIFF header; the sizes are patched in by finishOutput
+static void writeWavHeader(FILE* f, uint32_t sampleRate, uint64_t frames)
+{
+    const uint32_t channels = 2, bytesPerSample = 4;
+    uint64_t dataBytes = frames * channels * bytesPerSample;
+    uint32_t dataSize = dataBytes > 0xFFFFFFF0ull - 50 ? 0xFFFFFFF0u - 50 : (uint32_t)dataBytes;
+
+    fwrite("RIFF", 1, 4, f);
+    putLE(f, 50 + dataSize, 4);
+    fwrite("WAVE", 1, 4, f);
+    fwrite("fmt ", 1, 4, f);
+    putLE(f, 18, 4);
+    putLE(f, 3, 2);                                   // WAVE_FORMAT_IEEE_FLOAT
+    putLE(f, channels, 2);
+    putLE(f, sampleRate, 4);
+    putLE(f, sampleRate * channels * bytesPerSample, 4);
+    putLE(f, channels * bytesPerSample, 2);
+    putLE(f, bytesPerSample * 8, 2);
+    putLE(f, 0, 2);                                   // no extension
+    fwrite("fact", 1, 4, f);
+    putLE(f, 4, 4);
+    putLE(f, (uint32_t)frames, 4);
+    fwrite("data", 1, 4, f);
+    putLE(f, dataSize, 4);
+}
+
+static void writeFrames(Output& out, const float* left, const float* right, int32 numFrames)
+{
+    float interleaved[2 * 4096];
+    for (int32 done = 0; done < numFrames; ) {
+        int32 chunk = std::min<int32>(numFrames - done, 4096);
+        for (int32 i = 0; i < chunk; i++) {
+            interleaved[i * 2] = left[done + i];
+            interleaved[i * 2 + 1] = right[done + i];
+        }
+        const uint8_t* bytes = (const uint8_t*)interleaved;
+        for (size_t b = 0; b < chunk * 2 * sizeof(float); b++) {
+            out.hash = (out.hash ^ bytes[b]) * 0x100000001B3ull;
+        }
+        if (out.file) fwrite(interleaved, sizeof(float), chunk * 2, out.file);
+        done += chunk;
+    }
+    out.frames += numFrames;
+}
+
+static void finishOutput(Output& out, uint32_t sampleRate)
+{
+    if (!out.file) return;
+    if (out.wav) {
+        fseek(out.file, 0, SEEK_SET);
+        writeWavHeader(out.file, sampleRate, out.frames);
+    }
+    fclose(out.file);
+}
+
+// -----------------------------------------------------------------------------
+// 4) Rendering
+// -----------------------------------------------------------------------------
+struct RenderOptions {
+    float       sampleRate;
+    int32       blockSize;
+    double      tailSeconds;
+    std::vector<std::pair<std::string, float> > params;
+};
+
+// Feeds the messages to the plugin block by block at their frame offsets and
+// renders until `tailSeconds` after the last one
+static void render(const MidiFile& midi, const RenderOptions& options, Output& out)
+{
+    AEffect* effect = VSTPluginMain(hostCallback);
+    effect->dispatcher(effect, effOpen, 0, 0, nullptr, 0.f);
+    effect->dispatcher(effect, effSetSampleRate, 0, 0, nullptr, options.sampleRate);
+    effect->dispatcher(effect, effSetBlockSize, 0, options.blockSize, nullptr, 0.f);
+    for (const auto& param : options.params) {
+        int32 index = findParameter(effect, param.first.c_str());
+        if (index < 0) {
+            fprintf(stderr, "unknown parameter \"%s\", ignored\n", param.first.c_str());
+            continue;
+        }
+        effect->setParameter(effect, index, param.second);
+    }
+    effect->dispatcher(effect, effMainsChanged, 0, 1, nullptr, 0.f);
+
+    uint64_t lastFrame = midi.messages.empty() ? 0 : midi.messages.back().frame;
+    uint64_t totalFrames = lastFrame + (uint64_t)(options.tailSeconds * options.sampleRate);
+
+    std::vector<float> left(options.blockSize), right(options.blockSize);
+    float* outputs[2] = { left.data(), right.data() };
+    std::vector<VstMidiEvent> blockEvents(kMaxBlockEvents);
+    HostEvents events;
+    size_t next = 0;
+
+    for (uint64_t pos = 0; pos < totalFrames; pos += options.blockSize) {
+        int32 frames = (int32)std::min<uint64_t>(options.blockSize, totalFrames - pos);
+
+        // Hand over everything that starts in this block; a block with more
+        // events than one call can carry is sent in several calls
+        events.numEvents = 0;
+        events.reserved = 0;
+        while (next < midi.messages.size() && midi.messages[next].frame < pos + frames) {
+            const MidiMessage& msg = midi.messages[next++];
+            VstMidiEvent& ev = blockEvents[events.numEvents];
+            memset(&ev, 0, sizeof(ev));
+            ev.type = kVstMidiType;
+            ev.byteSize = sizeof(VstMidiEvent);
+            ev.deltaFrames = (int32)(msg.frame - pos);
+            ev.midiData[0] = (char)msg.data[0];
+            ev.midiData[1] = (char)msg.data[1];
+            ev.midiData[2] = (char)msg.data[2];
+            events.events[events.numEvents++] = (VstEvent*)&ev;
+            if (events.numEvents == kMaxBlockEvents) {
+                effect->dispatcher(effect, effProcessEvents, 0, 0, &events, 0.f);
+                events.numEvents = 0;
+            }
+        }
+        if (events.numEvents > 0) {
+            effect->dispatcher(effect, effProcessEvents, 0, 0, &events, 0.f);
+        }
+
+        effect->processReplacing(effect, nullptr, outputs, frames);
+        writeFrames(out, left.data(), right.data(), frames);
+    }
+
+    effect->dispatcher(effect, effMainsChanged, 0, 0, nullptr, 0.f);
+    effect->dispatcher(effect, effClose, 0, 0, nullptr, 0.f);
+}
+
+// -----------------------------------------------------------------------------
+// 5) Entry point
+// -----------------------------------------------------------------------------
+static void usage()
+{
+    fprintf(stderr,
+        "usage: CNukedVSTRender [options] input.mid [output.wav|output.raw]\n"
+        "  -r RATE          output sample rate (default 44100)\n"
+        "  -b FRAMES        block size passed to processReplacing (default 512)\n"
+        "  -t SECONDS       render this long after the last event (default 2)\n"
+        "  -p NAME=VALUE    set a parameter by its display name, 0..1 (repeatable)\n"
+        "  --raw            write raw interleaved 32-bit float instead of WAV\n"
+        "  --hash           print a 64-bit FNV-1a hash of the rendered samples\n"
+        "  --expect HASH    exit with status 1 unless the hash matches\n"
+        "Hashed renders use the baseline kernels, so hashes match across CPUs; set\n"
+        "CNUKEDVST_ISA to choose the kernels yourself.\n"
+        "Without an output file the audio is only rendered (and hashed).\n");
+}
+
+static bool endsWith(const std::string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+int main(int argc, char** argv)
+{
+    RenderOptions options;
+    options.sampleRate = 44100.f;
+    options.blockSize = 512;
+    options.tailSeconds = 2.0;
+
+    const char* input = nullptr;
+    const char* output = nullptr;
+    bool raw = false, printHash = false;
+    const char* expect = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-r" && hasValue) {
+            options.sampleRate = (float)atof(argv[++i]);
+        } else if (arg == "-b" && hasValue) {
+            options.blockSize = atoi(argv[++i]);
+        } else if (arg == "-t" && hasValue) {
+            options.tailSeconds = atof(argv[++i]);
+        } else if (arg == "-p" && hasValue) {
+            std::string assignment = argv[++i];
+            size_t eq = assignment.rfind('=');
+            if (eq == std::string::npos) {
+                usage();
+                return 2;
+            }
+            options.params.push_back(std::make_pair(assignment.substr(0, eq), (float)atof(assignment.c_str() + eq + 1)));
+        } else if (arg == "--raw") {
+            raw = true;
+        } else if (arg == "--hash") {
+            printHash = true;
+        } else if (arg == "--expect" && hasValue) {
+            expect = argv[++i];
+        } else if (arg[0] == '-' && arg.size() > 1) {
+            usage();
+            return 2;
+        } else if (!input) {
+            input = argv[i];
+        } else if (!output) {
+            output = argv[i];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (!input || options.sampleRate < 8000.f || options.blockSize < 1 || options.tailSeconds < 0.0) {
+        usage();
+        return 2;
+    }
+
+    // A hash should not depend on the CPU: the plugin's AVX2 kernels round differently
+    if (printHash || expect) setenv("CNUKEDVST_ISA", "baseline", 0);
+
+    MidiFile midi;
+    if (!loadMidiFile(input, midi)) return 1;
+    applyTempoMap(midi, options.sampleRate);
+
+    Output out;
+    out.file = nullptr;
+    out.wav = false;
+    out.frames = 0;
+    out.hash = 0xCBF29CE484222325ull;
+    if (output) {
+        out.file = fopen(output, "wb");
+        if (!out.file) {
+            fprintf(stderr, "cannot create %s\n", output);
+            return 1;
+        }
+        out.wav = !raw && !endsWith(output, ".raw");
+        if (out.wav) writeWavHeader(out.file, (uint32_t)options.sampleRate, 0);
+    }
+
+    double start = nowSeconds();
+    render(midi, options, out);
+    double elapsed = nowSeconds() - start;
+    finishOutput(out, (uint32_t)options.sampleRate);
+
+    double seconds = out.frames / options.sampleRate;
+    fprintf(stderr, "%zu events, %.2f s of audio in %.3f s (%.0fx real time)\n",
+            midi.messages.size(), seconds, elapsed, elapsed > 0.0 ? seconds / elapsed : 0.0);
+
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)out.hash);
+    if (printHash) printf("%s\n", hash);
+    if (expect && strcmp(expect, hash) != 0) {
+        fprintf(stderr, "hash mismatch: expected %s, got %s\n", expect, hash);
+        return 1;
+    }
+    return 0;
+}
@@ -4,12 +4,44 @@
 
 #include "aeffect.h"
 #include "aeffectx.h"
+#include "CNukedVST.h"
+#include "CNukedFast.h"
 #include "opl3.h"
 
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <utility>  // For std::pair and std::make_pair
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <mutex>
+
+#if defined(__linux__)
+#include <climits>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <strings.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Kernels built for AVX2 next to the SSE2 baseline, chosen at load time (see section 12)
+#if defined(__SSE2__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CNUKED_AVX2_KERNELS 1
+#define KERNEL_AVX2 __attribute__((target("avx2")))
+#define KERNEL_AVX2_FMA __attribute__((target("avx2,fma")))
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
 
 // Define VSTCALLBACK if not defined (usually from VST SDK)
 #ifndef VSTCALLBACK
@@ -27,15 +59,21 @@ static inline void unused(T&& /*arg*/) {}
 // -----------------------------------------------------------------------------
 // 1) Some VST constant definitions
 // -----------------------------------------------------------------------------
-#define kNumPrograms 1
+#define kNumPrograms 128
 #define kNumInputs   0
 #define kNumOutputs  2
 
+// Program names are up to this long, terminator included, like VST's own limit
+static const int kProgramNameLength = 24;
+
 // For OPL3, we have up to 18 "channels," each with 2 operators => 36 operators.
 static const int OPL3_CHANNEL_COUNT = 18;
 static const int OPL3_OPERATORS_PER_CHANNEL = 2;
 static const int OPL3_TOTAL_OPERATORS = OPL3_CHANNEL_COUNT * OPL3_OPERATORS_PER_CHANNEL;
 
+// The chip's own sample rate (14.318 MHz / 288). F-numbers are relative to this clock.
+static const double OPL3_NATIVE_RATE = 49716.0;
+
 // Every single synthesis parameter for OPL3
 enum {
     // Each operator has these parameters:
@@ -79,6 +117,10 @@ enum {
     kNumGlobalParams // = 8
 };
 
+// Operators of the rhythm mode drum kit: both operators of the bass drum, then the
+// single operators of the hi-hat, snare drum, tom-tom and top cymbal
+static const int kNumDrumOps = 6;
+
 // VST Parameter enumeration - MONOTIMBRAL design (one set of parameters for all voices)
 enum {
     // Modulator parameters
@@ -115,21 +157,80 @@ enum {
     kVST_LEFT,
     kVST_RIGHT,
     
+    // Operators 3 and 4 of a 4-op patch, and its algorithm
+    kVST_Op3_AM,
+    kVST_Op3_VIB,
+    kVST_Op3_EGT,
+    kVST_Op3_KSR,
+    kVST_Op3_MULT,
+    kVST_Op3_KSL,
+    kVST_Op3_TL,
+    kVST_Op3_AR,
+    kVST_Op3_DR,
+    kVST_Op3_SL,
+    kVST_Op3_RR,
+    kVST_Op3_WS,
+    kVST_Op4_AM,
+    kVST_Op4_VIB,
+    kVST_Op4_EGT,
+    kVST_Op4_KSR,
+    kVST_Op4_MULT,
+    kVST_Op4_KSL,
+    kVST_Op4_TL,
+    kVST_Op4_AR,
+    kVST_Op4_DR,
+    kVST_Op4_SL,
+    kVST_Op4_RR,
+    kVST_Op4_WS,
+    kVST_FourOp,
+    
+    // The parameters above make up a part's patch
+    kNumPatchParams,
+    
     // Global parameters - only keep essential ones
-    kVST_TremoloDepth,
+    kVST_TremoloDepth = kNumPatchParams,
     kVST_VibratoDepth,
+    kVST_RhythmMode,
     
-    // No longer exposing these rhythm mode parameters:
-    // kVST_RhythmMode,
-    // kVST_HH,
-    // kVST_TC,
-    // kVST_TOM,
-    // kVST_SD,
-    // kVST_BD,
+    // The drum kit: kNumDrumOps operator blocks in DRUM_OP_NAMES order, then the bass
+    // drum's feedback. The HH, TC, TOM, SD and BD key bits are played from MIDI.
+    kVST_DrumOps,
+    kVST_BD_FB = kVST_DrumOps + kNumDrumOps * kNumOperatorParams,
+    
+    // Engine parameters
+    kVST_Resampler,
+    kVST_Chips,
+    kVST_Threads,
+    kVST_VoiceSteal,
+    kVST_BendRange,
+    kVST_Smoothing,
+    kVST_Multi,
+    kVST_EditPart,
+    kVST_Core,
+    kVST_IdleSkip,
     
     kNumVSTParams
 };
 
+// The enum above is the order the plugin keeps its parameters in, with a part's
+// patch first. Hosts number them differently: a host that does not save chunks
+// stores a project and its automation by parameter number, so the original 30
+// parameters keep their numbers and every later group is appended in the order it
+// was added. These ranges of the enum, in host order, map one to the other.
+static const int HOST_PARAM_RANGES[][2] = {
+    { kVST_Mod_AM, kVST_RIGHT },
+    { kVST_TremoloDepth, kVST_VibratoDepth },
+    { kVST_Resampler, kVST_EditPart },
+    { kVST_Op3_AM, kVST_FourOp },
+    { kVST_RhythmMode, kVST_BD_FB },
+    { kVST_Core, kVST_IdleSkip }
+};
+static const int kNumHostParamRanges = sizeof(HOST_PARAM_RANGES) / sizeof(HOST_PARAM_RANGES[0]);
+static_assert((kVST_RIGHT - kVST_Mod_AM + 1) + (kVST_VibratoDepth - kVST_TremoloDepth + 1) +
+              (kVST_EditPart - kVST_Resampler + 1) + (kVST_FourOp - kVST_Op3_AM + 1) +
+              (kVST_BD_FB - kVST_RhythmMode + 1) + (kVST_IdleSkip - kVST_Core + 1) == kNumVSTParams,
+              "HOST_PARAM_RANGES must cover every parameter once");
+
 // So total parameters = OPL3_TOTAL_OPERATORS * kNumOperatorParams + OPL3_CHANNEL_COUNT * kNumChannelParams + kNumGlobalParams
 static const int TOTAL_OPERATOR_PARAMETERS = OPL3_TOTAL_OPERATORS * kNumOperatorParams;
 static const int TOTAL_CHANNEL_PARAMETERS = OPL3_CHANNEL_COUNT * kNumChannelParams;
@@ -148,13 +249,223 @@ static const char* GLOBAL_NAMES[kNumGlobalParams] = {
     "Tremolo Depth", "Vibrato Depth", "Rhythm Mode", "HH", "TC", "TOM", "SD", "BD"
 };
 
+static const char* DRUM_OP_NAMES[kNumDrumOps] = {
+    "BD Mod", "BD Car", "HH", "SD", "TOM", "TC"
+};
+
+// Default drum kit, as register field values: MULT, TL, AR, DR, SL, RR, WS
+static const int kNumDrumDefaults = 7;
+static const uint8_t DRUM_DEFAULTS[kNumDrumOps][kNumDrumDefaults] = {
+    { 0, 11, 15, 8,  4, 6, 0 },  // BD Mod
+    { 0,  0, 15, 5,  6, 5, 0 },  // BD Car
+    { 1,  4, 15, 9, 15, 9, 0 },  // HH
+    { 1,  2, 15, 8, 15, 8, 0 },  // SD
+    { 2,  4, 15, 7, 15, 7, 0 },  // TOM
+    { 1,  6, 15, 6, 15, 6, 0 }   // TC
+};
+
+// Engine parameters come after the last exposed global parameter
+static const int kNumEngineParams = kNumVSTParams - kVST_Resampler;
+static const char* ENGINE_NAMES[kNumEngineParams] = {
+    "Resampler", "Chips", "Threads", "Voice Steal", "Bend Range", "Smoothing",
+    "Multi", "Edit Part", "Core", "Idle Skip"
+};
+
 // New descriptive names for the operators
-static const char* OPERATOR_TYPES[2] = {
-    "Mod", "Car"  // Modulator and Carrier
+static const char* OPERATOR_TYPES[4] = {
+    "Mod", "Car", // Modulator and Carrier
+    "Op3", "Op4"  // The extra operators of a 4-op patch
+};
+
+// The 4-Op parameter turns a patch into a 4-operator patch with one of the OPL3's
+// four algorithms, named after the connection bits of the pair's two channels
+static const int kNumFourOpModes = 5;
+static const char* FOUR_OP_NAMES[kNumFourOpModes] = {
+    "Off", "FM-FM", "AM-FM", "FM-AM", "AM-AM"
+};
+
+// Up to kMaxChips OPL3 chips run side by side, each contributing its 18 channels
+// as voices. Voice v lives on chip v / 18, channel v % 18.
+static const int kMaxChips = 8;
+static const int MAX_VOICES = kMaxChips * OPL3_CHANNEL_COUNT;
+
+// MIDI events received through effProcessEvents are held here until processReplacing
+// reaches their deltaFrames offset. The queue is part of the plugin struct, so queueing
+// never allocates on the audio thread. When it is full, note-ons give way so that
+// note-offs and controllers are never lost (see makeQueueRoom).
+static const int kMaxQueuedEvents = 1024;
+
+// The five rhythm mode drums, in the order of their key-on bits in register 0xBD,
+// and the chip 0 channel each one takes its pitch from. In rhythm mode MIDI channel
+// 10 plays the drums, and channels 6-8 of chip 0 leave the voice pool.
+enum {
+    kDrumHH = 0,
+    kDrumTC,
+    kDrumTOM,
+    kDrumSD,
+    kDrumBD,
+
+    kNumDrums
+};
+
+static const int DRUM_CHANNELS[kNumDrums] = { 7, 8, 8, 7, 6 };
+static const int kFirstDrumChannel = 6;
+static const int kDrumMidiChannel = 9;
+
+// In multi-timbral mode each MIDI channel plays its own part, with its own patch and
+// controller state; otherwise every channel plays part 0. All parts share the voices.
+static const int kNumParts = 16;
+
+// The VST parameters below kNumPatchParams make up a part's patch: the modulator,
+// the carrier, the channel parameters and the 4-op settings
+static_assert(kNumPatchParams <= 64, "patchDirty holds one bit per patch parameter");
+
+// The OPL3 is rendered in chunks of up to this many frames into an interleaved
+// int16 scratch buffer, then converted to float in a separate pass.
+static const int kRenderBlockFrames = 256;
+
+// The OPL3 register space: bank 0 at 0x000-0x0FF, bank 1 at 0x100-0x1FF
+static const int OPL3_REGISTER_COUNT = 0x200;
+
+// Operator registers that hold parameter values, in the order of OPERATOR_REG_BASES
+static const int kNumOperatorRegs = 5;
+static const int OPERATOR_REG_BASES[kNumOperatorRegs] = { 0x20, 0x40, 0x60, 0x80, 0xE0 };
+
+// Which of the operator registers each operator parameter lives in
+static const int OPERATOR_PARAM_REGS[kNumOperatorParams] = {
+    0, 0, 0, 0, 0,  // AM, VIB, EGT, KSR, MULT => 0x20
+    1, 1,           // KSL, TL                 => 0x40
+    2, 2,           // AR, DR                  => 0x60
+    3, 3,           // SL, RR                  => 0x80
+    4               // WS                      => 0xE0
+};
+
+// A parameter change dirties one group of registers: one operator register type for
+// either all modulators or all carriers, the 0xC0 register of every channel, or 0xBD.
+enum {
+    kRegGroupOperators = 0,                        // + role * kNumOperatorRegs + register
+    kRegGroupChannels = 2 * kNumOperatorRegs,
+    kRegGroupGlobal,
+
+    kNumRegGroups
+};
+
+// Registers the old per-parameter sweep wrote: 0xBD, 5 per operator and 0xC0 per channel
+static const int kFullRegisterSweep = 1 + OPL3_TOTAL_OPERATORS * kNumOperatorRegs + OPL3_CHANNEL_COUNT;
+
+// Output resampling modes. kResamplerNuked uses Nuked's built-in linear resampler;
+// the others run the chip at its native rate and convert with a windowed-sinc filter.
+enum {
+    kResamplerNuked = 0,
+    kResamplerLow,
+    kResamplerMedium,
+    kResamplerHigh,
+
+    kNumResamplerModes
+};
+
+struct ResamplerTier {
+    const char* name;
+    int         taps;     // filter length in native samples, a multiple of 4
+    double      rolloff;  // cutoff as a fraction of the lower Nyquist frequency
+    double      beta;     // Kaiser window shape
+};
+
+static const ResamplerTier RESAMPLER_TIERS[kNumResamplerModes] = {
+    { "Linear",  0,  0.0,  0.0 },
+    { "Sinc 8",  8,  0.80, 5.0 },
+    { "Sinc 16", 16, 0.88, 7.0 },
+    { "Sinc 32", 32, 0.92, 9.0 }
+};
+
+// Native samples are kept in a ring buffer. The first kMaxResampleTaps samples are
+// mirrored past its end so a filter window can always be read contiguously.
+static const int kMaxResampleTaps = 32;
+static const int kResampleRingSize = 4096;
+
+// Filter coefficients are tabulated at kResamplePhases + 1 fractional positions
+// and interpolated linearly in between.
+static const int kResamplePhaseBits = 7;
+static const int kResamplePhases = 1 << kResamplePhaseBits;
+// The bits of a read position's fraction below the phase, and their weight
+static const int kResampleFracBits = 32 - kResamplePhaseBits;
+static const float kResampleFracScale = 1.f / (1u << kResampleFracBits);
+static const int kResampleCoefCount = (kResamplePhases + 1) * (8 + 16 + 32);
+
+// Chips can be rendered in parallel by up to this many threads, the audio thread
+// included. Runs shorter than kMinParallelFrames are not worth the handoff and are
+// always rendered on the audio thread.
+static const int kMaxRenderThreads = kMaxChips;
+static const int kMinParallelFrames = 16;
+
+// Pause instructions an idle worker spins through before it parks in the kernel
+static const int kWorkerSpinCount = 16384;
+
+// Voice stealing policies, applied when a note-on finds no idle voice
+enum {
+    kStealOldest = 0,   // the voice whose note started first
+    kStealQuietest,     // the voice whose carrier envelope is most attenuated
+    kStealSameNote,     // a repeated note retriggers its own voice, otherwise the oldest
+
+    kNumStealPolicies
+};
+
+static const char* STEAL_POLICY_NAMES[kNumStealPolicies] = {
+    "Oldest", "Quietest", "Same Note"
+};
+
+// Emulation cores. kCoreNuked runs Nuked OPL3; kCoreFast runs the structure-of-arrays
+// core of section 11, which follows the same steps with less work per sample.
+enum {
+    kCoreNuked = 0,
+    kCoreFast,
+
+    kNumCores
 };
 
-// We manage 16 voices in software, mapped onto 16 out of 18 possible OPL3 channels.
-static const int MAX_VOICES = 16;
+static const char* CORE_NAMES[kNumCores] = {
+    "Nuked", "Fast"
+};
+
+// First slot of channels 0-8 of a register bank; the second operator is 3 slots on
+static const int CHANNEL_SLOTS[9] = { 0, 1, 2, 6, 7, 8, 12, 13, 14 };
+
+// Pitches are kept in fine steps of 1/64 semitone (about 1.6 cents). Every step of
+// every MIDI note has a precomputed F-number/block pair.
+static const int kPitchSteps = 64;
+static const int kNumPitches = 128 * kPitchSteps;
+
+// The Bend Range parameter covers 0..kMaxBendRange semitones; RPN 0 can set any
+// range up to 127 semitones and 99 cents
+static const int kMaxBendRange = 24;
+static const int kBendCenter = 8192;
+
+// Parameters that glide to a new value instead of jumping, so automating them does not
+// step audibly at block boundaries. levels is the number of values the register field
+// can hold; a glide only rewrites the register when the quantized value changes.
+struct SmoothedParam {
+    int index;
+    int levels;
+};
+
+static const int kNumSmoothedParams = 9;
+static const SmoothedParam SMOOTHED_PARAMS[kNumSmoothedParams] = {
+    { kVST_Mod_MULT, 16 }, { kVST_Mod_TL, 64 },
+    { kVST_Car_MULT, 16 }, { kVST_Car_TL, 64 },
+    { kVST_Op3_MULT, 16 }, { kVST_Op3_TL, 64 },
+    { kVST_Op4_MULT, 16 }, { kVST_Op4_TL, 64 },
+    { kVST_FB, 8 }
+};
+
+// The Smoothing parameter covers 0..kMaxSmoothingMs. Gliding parameters are stepped
+// every kSmoothInterval frames; glides shorter than that are applied at once.
+static const float kMaxSmoothingMs = 100.0f;
+static const int kSmoothInterval = 32;
+
+// Chips are checked for silence every kIdleCheckInterval frames, on a grid that does
+// not depend on the host's block size. A silent chip is not emulated until it is
+// written to again.
+static const int kIdleCheckInterval = 256;
 
 // -----------------------------------------------------------------------------
 // We define a minimal VoiceInfo structure to handle MIDI notes -> channel assignment
@@ -162,8 +473,124 @@ static const int MAX_VOICES = 16;
 struct VoiceInfo {
     bool active;
     int midiNote;
-    float frequency;
+    int pitch;        // note * kPitchSteps plus any fine offset, indexes pitchTable
     int channelIndex; // which OPL3 channel is being used
+    int chipIndex;    // which OPL3 chip that channel belongs to
+    int part;         // part whose patch is loaded on the channel
+    bool fourOp;      // first channel of a 4-op pair, playing with the channel 3 above it
+    bool paired;      // second channel of a 4-op pair, on no voice list
+    bool drum;        // plays the drum kit in rhythm mode, on no voice list
+    int prev, next;   // neighbours in the idle or held voice list, -1 at either end
+    int nextSameNote; // next held voice playing the same MIDI note, -1 at the end
+    bool keyOnPending; // taken over before the chip saw its key-off; keyed on once it has
+    bool releasing;   // keyed off, but its envelope has not reached silence yet
+    int64 releasedAt; // framesRendered when it was keyed off
+    int64 idleSince;  // idleCount when it joined its chip's idle list
+};
+
+// A doubly linked list of voices threaded through VoiceInfo::prev/next
+struct VoiceList {
+    int head, tail;   // -1 when empty
+};
+
+// MIDI state kept separately for every part
+struct PartState {
+    int noteVoices[128];      // most recent held voice of each MIDI note, -1 if none
+    int lastNoteVoices[128];  // voice that last played each MIDI note, -1 if none
+    int bendValue;            // last 14-bit bend applied, kBendCenter = no bend
+    int bendRangeCents;       // full-scale bend, from Bend Range or RPN 0
+    bool rpnBendRange;        // RPN 0 set bendRangeCents, so Bend Range leaves it alone
+    int bendSteps;            // current bend in pitch steps
+    int queuedBend;           // bend in effect after the queued events, -1 if unknown
+    int rpnMsb, rpnLsb;       // selected registered parameter, 127/127 = none
+    int program;              // bank program the part's patch was loaded from and edits
+};
+
+// The registers of a patch, compiled once so that loading the patch onto a channel
+// only compares and copies bytes
+struct PatchImage {
+    uint8_t ops[4][kNumOperatorRegs]; // modulator, carrier, operators 3 and 4
+    uint8_t channel;                  // 0xC0 of a 2-op voice
+    uint8_t fourOpChannels[2];        // 0xC0 of both channels of a 4-op voice
+};
+
+// A program of the bank: a patch and its compiled registers
+struct Program {
+    float      patch[kNumPatchParams];
+    PatchImage image;
+};
+
+// A smoothed parameter on its way to a new value
+struct ParamSmoother {
+    float   value;      // where the glide is now
+    float   target;     // where it ends
+    float   step;       // change per frame
+    int32_t framesLeft; // 0 when the parameter is not gliding
+};
+
+// Worker threads that render chips in parallel (see section 9)
+struct RenderPool;
+
+// Hot loops that are built for more than one instruction set. The integer kernels
+// give identical output in every build; the resampler's float sums may round
+// differently. selectKernels() points kernels at the fastest build the CPU runs
+// (see section 12).
+enum { kIsaBaseline, kIsaAvx2, kNumIsas };
+
+struct Kernels {
+    const char* name;
+    void (*deinterleave)(const int16_t* in, float* outL, float* outR, int32_t numFrames);
+    void (*sumChips)(int32_t* mix, const int16_t (*chips)[kRenderBlockFrames * 2], int numChips, int32_t numSamples);
+    void (*convertMix)(const int32_t* mix, float* outL, float* outR, int32_t numFrames);
+    void (*resample)(const float* table, int taps, const float* ringL, const float* ringR,
+                     uint64_t pos, uint64_t step, float* outL, float* outR, int32_t numFrames);
+};
+
+static const Kernels* kernels;
+
+// Parameter values as the host last set them. setParameter may be called from any
+// host thread, so it only stores the value and flags it here; the audio thread takes
+// the flagged values at the start of the next block. Neither side ever blocks.
+struct ParameterMailbox {
+    std::atomic<float>    values[kNumVSTParams];            // patch parameters excepted
+    std::atomic<uint32_t> dirty[(kNumVSTParams + 31) / 32]; // one bit per parameter
+    std::atomic<float>    patchValues[kNumParts][kNumPatchParams];
+    std::atomic<uint64_t> patchDirty[kNumParts];            // one bit per patch parameter
+    std::atomic<int>      changes;    // setParameter calls since the last drain
+    std::atomic<bool>     releaseAll; // effMainsChanged stopped processing
+    std::atomic<bool>     jump;       // apply the next changes at once, without glides
+
+    // The program bank as the host last set it, and the program of every part
+    std::atomic<float>    bank[kNumPrograms][kNumPatchParams];
+    std::atomic<int>      partPrograms[kNumParts];
+    std::atomic<uint32_t> programChanges; // parts switched by effSetProgram, one bit each
+    std::atomic<bool>     bankChanged;    // a chunk replaced the whole bank
+    std::atomic<bool>     latencyChanged; // setParameter changed the Resampler mode
+
+    // The host rate as effSetSampleRate last set it, with the resampler filters
+    // designed for it. The audio thread takes both over at the start of a block.
+    std::mutex            rateLock;
+    std::atomic<bool>     rateChanged;
+    std::atomic<float>    sampleRate;
+    float                 resampleCoefs[kResampleCoefCount];
+};
+
+// The state saved with a project through effGetChunk and restored through effSetChunk:
+// every parameter as the host sees it, and the patch of every part. The registers
+// follow from these, so they are rebuilt rather than stored. kChunkVersion changes
+// whenever the layout does; chunks of another version are refused.
+static const uint32_t kChunkMagic = CCONST('O', 'P', 'L', 'c');
+static const uint32_t kChunkVersion = 4;
+
+struct OPL3Chunk {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                             // sizeof(OPL3Chunk)
+    float    values[kNumVSTParams];            // patch parameters excepted
+    float    patches[kNumParts][kNumPatchParams];
+    uint32_t partPrograms[kNumParts];
+    float    bank[kNumPrograms][kNumPatchParams];
+    char     programNames[kNumPrograms][kProgramNameLength];
 };
 
 // -----------------------------------------------------------------------------
@@ -172,15 +599,95 @@ struct VoiceInfo {
 // -----------------------------------------------------------------------------
 typedef struct MyOPL3VST {
     AEffect         aeffect;                  // VST2 struct
+    audioMasterCallback audioMaster;          // the host, for telling it about latency changes
     float           sampleRate;
     VoiceInfo       voices[MAX_VOICES];
-    opl3_chip       chip;                     // Nuked-OPL3 instance (correct type from opl3.h)
+    opl3_chip       chips[kMaxChips];         // Nuked-OPL3 instances (correct type from opl3.h)
+    FastChip*       fastChips;                // the same chips in the fast core, kMaxChips of them
+    int             core;                     // kCoreNuked or kCoreFast
+    int             numChips;                 // chips currently rendering, 1..kMaxChips
 
     // We store all parameter values in a float array. Each is [0..1], we scale them later.
-    float           paramValues[TOTAL_INTERNAL_PARAMETERS];
+    // Every chip has its own copy, as the same channel can play different parts on each chip.
+    float           paramValues[kMaxChips][TOTAL_INTERNAL_PARAMETERS];
     
-    // For the monotimbral interface, we need to store the current settings that apply to all voices
-    float           currentSettings[2*kNumOperatorParams + kNumChannelParams + kNumGlobalParams];
+    // The patch of every part, and the settings of the global and engine parameters.
+    // Owned by the audio thread; the host's view of them lives in the mailbox.
+    float           patches[kNumParts][kNumPatchParams];
+    float           currentSettings[kNumVSTParams];   // patch parameters are in patches
+    ParameterMailbox* mailbox;
+    OPL3Chunk       chunk;                    // effGetChunk's buffer, host thread only
+
+    // The program bank. The audio thread plays from programs and keeps every part's
+    // patch compiled in partImages; the names are only used by the host thread.
+    Program         programs[kNumPrograms];
+    PatchImage      partImages[kNumParts];
+    char            programNames[kNumPrograms][kProgramNameLength];
+
+    // Time-sorted MIDI events for the next processReplacing block
+    VstMidiEvent    eventQueue[kMaxQueuedEvents];
+    int             numQueuedEvents;
+
+    // Interleaved stereo output of each chip, and their sum when more than one chip runs
+    int16_t         chipBuffers[kMaxChips][kRenderBlockFrames * 2];
+    int32_t         mixBuffer[kRenderBlockFrames * 2];
+
+    // Shadow copy of every register byte written to each chip, so unchanged bytes are never resent
+    uint8_t         regShadow[kMaxChips][OPL3_REGISTER_COUNT];
+
+    // Idle chips (see section 6). A chip whose bit is clear is silent and not emulated;
+    // any register write sets the bit again. Only with Idle Skip on do bits get cleared.
+    bool            idleSkip;                 // Idle Skip: put silent chips to sleep
+    uint32_t        awakeChips;               // one bit per chip
+    int32_t         idleDelay;                // frames left until the next idle check
+
+    // Counters reported through kOPL3VendorGetStats
+    OPL3VSTStats    stats;
+
+    // Native-rate rendering (see section 8)
+    int             resamplerMode;            // one of kResamplerNuked..kResamplerHigh
+    uint64_t        resamplePos;              // read position in native samples, 32.32 fixed point
+    uint64_t        resampleStep;             // native samples per output frame, 32.32 fixed point
+    uint32_t        nativeWritePos;           // native samples written to the ring so far
+    uint32_t        nativeSilentFrom;         // native sample from which the ring holds only silence
+    float           ringL[kResampleRingSize + kMaxResampleTaps];
+    float           ringR[kResampleRingSize + kMaxResampleTaps];
+    float           resampleCoefs[kResampleCoefCount];
+
+    // F-number and block of every pitch, packed as block << 10 | fnum so the high
+    // byte is the B0 register without the key-on bit and the low byte is A0
+    uint16_t        pitchTable[kNumPitches];
+
+    // Parallel chip rendering (see section 9)
+    RenderPool*     renderPool;               // allocated with the plugin, workers start on demand
+    int             renderThreads;            // threads asked for, the audio thread included
+
+    // Voice allocation (see section 7)
+    VoiceList       idleVoices[kMaxChips];    // silent voices of each chip, longest idle first
+    int64           idleCount;                // voices that have gone idle so far
+    VoiceList       releasingVoices;          // keyed-off voices still sounding, longest released first
+    VoiceList       heldVoices;               // keyed-on voices, oldest note-on first
+    int             stealPolicy;              // one of kStealOldest..kStealSameNote
+    int             pendingKeyOns[MAX_VOICES]; // stolen voices waiting for their key-on
+    int             numPendingKeyOns;
+    int32_t         keyOnDelay;               // frames left until the pending key-ons are written
+    int64           framesRendered;           // host frames rendered so far
+
+    // Notes, pitch bend and RPNs of each part (see section 7)
+    PartState       parts[kNumParts];
+    bool            multiTimbral;             // MIDI channel n plays part n, else part 0
+
+    // Rhythm mode (see section 7)
+    bool            rhythmMode;               // chip 0 channels 6-8 play the drum kit
+    uint8_t         drumKeys;                 // 0xBD key-on bits of the sounding drums
+    uint8_t         drumRetrigger;            // drums keyed off to restart, keyed on with the pending key-ons
+    bool            drumKeysDirty;            // drumKeys changed since 0xBD was written
+
+    // Parameter smoothing (see section 5)
+    float           smoothingMs;              // glide time of the smoothed parameters
+    ParamSmoother   smoothers[kNumParts][kNumSmoothedParams];
+    int             numSmoothing;             // smoothers still gliding
+    int32_t         smoothDelay;              // frames left until the next glide step
 
 } MyOPL3VST;
 
@@ -194,23 +701,175 @@ static intptr_t    dispatcher(AEffect* effect, int32_t opCode, int32_t index, in
 static void getParameterName(MyOPL3VST* vst, int32_t index, char* label);
 static void getParameterDisplay(MyOPL3VST* vst, int32_t index, char* text);
 
+// Helpers for the host's view of the parameters
+static int getParamOfHostIndex(int32_t index);
+static int getHostEditPart(ParameterMailbox* mailbox);
+static std::atomic<float>& getHostValue(MyOPL3VST* vst, int32_t index);
+
+// Helpers for the program bank
+static void setHostProgram(MyOPL3VST* vst, int program);
+static void setPartProgram(MyOPL3VST* vst, int part, int program);
+static void syncProgram(MyOPL3VST* vst, int program);
+static void publishPartPatch(MyOPL3VST* vst, int part);
+static void compilePatchImage(const float* patch, PatchImage& image);
+
+// Helpers to save and restore the plugin state
+static int32_t saveChunk(MyOPL3VST* vst, void** data);
+static bool loadChunk(MyOPL3VST* vst, const void* data, intptr_t size);
+
+// Helpers to import instrument bank files into the program bank
+static int importBankData(MyOPL3VST* vst, const uint8_t* data, size_t size, int firstProgram, int bank);
+static int importBankFile(MyOPL3VST* vst, const char* path, int firstProgram, int bank);
+
+// Maps the 0..1 Resampler parameter to a resampling mode
+static int getResamplerMode(float value);
+
+// Maps the 0..1 Chips parameter to a chip count
+static int getChipCount(float value);
+
+// Maps the 0..1 Threads parameter to a render thread count
+static int getThreadCount(float value);
+
+// Maps the 0..1 Voice Steal parameter to a stealing policy
+static int getStealPolicy(float value);
+
+// Maps the 0..1 Bend Range parameter to semitones
+static int getBendRange(float value);
+
+// Maps the 0..1 Smoothing parameter to milliseconds
+static float getSmoothingTime(float value);
+
+// Maps the 0..1 Multi parameter to multi-timbral mode on or off
+static bool getMultiTimbral(float value);
+
+// Maps the 0..1 Edit Part parameter to a part
+static int getEditPart(float value);
+
+// Maps the 0..1 4-Op parameter to Off or one of the four algorithms
+static int getFourOpMode(float value);
+
+// Maps the 0..1 Core parameter to an emulation core
+static int getCore(float value);
+
+// Maps the 0..1 Idle Skip parameter to on or off
+static bool getIdleSkip(float value);
+
 // Helper function for MIDI handling
 static void handleMidiEvent(MyOPL3VST* vst, VstMidiEvent& midiEvent);
 
-// We'll make a small helper so we can write OPL3 registers for each parameter
-static void updateOPL3Parameters(MyOPL3VST* vst);
+// Helper to queue a MIDI event for sample-accurate playback in processReplacing
+static void queueMidiEvent(MyOPL3VST* vst, const VstMidiEvent& midiEvent);
+
+// Helpers for voice allocation
+static int getPart(MyOPL3VST* vst, int midiChannel);
+static void resetVoiceAllocator(MyOPL3VST* vst);
+static uint8_t getFourOpMask(MyOPL3VST* vst, int chip);
+static int32_t getKeyOffFrames(MyOPL3VST* vst);
+static void startVoice(MyOPL3VST* vst, int part, int midiNote);
+static void releaseVoice(MyOPL3VST* vst, int v);
+static void releasePartVoices(MyOPL3VST* vst, int part);
+static void releaseAllVoices(MyOPL3VST* vst);
+static void applyPendingKeyOns(MyOPL3VST* vst);
+static void updateReleasingVoices(MyOPL3VST* vst);
+
+// Helpers for rhythm mode
+static void setRhythmMode(MyOPL3VST* vst, bool on);
+static void handleDrumNote(MyOPL3VST* vst, int status, int note, int velocity);
+static void releaseDrums(MyOPL3VST* vst);
+static void writeDrumKeys(MyOPL3VST* vst);
+
+// Helpers for pitch bend
+static void setPitchBend(MyOPL3VST* vst, int part, int value);
+static void updatePitchBend(MyOPL3VST* vst, int part);
+static void handleDataEntry(MyOPL3VST* vst, int part, int controller, int value);
+
+// Helper to render a run of frames from the OPL3 into the output buffers
+static void renderFrames(MyOPL3VST* vst, float* outL, float* outR, int32_t numFrames);
 
-// Helper to apply current voice settings to all OPL3 channels
+// Kernels to convert interleaved int16 stereo to two float channels, and to sum
+// several chips' output in int32 and convert the sum
+static void deinterleaveToFloat(const int16_t* in, float* outL, float* outR, int32_t numFrames);
+static void sumChips(int32_t* mix, const int16_t (*chips)[kRenderBlockFrames * 2], int numChips, int32_t numSamples);
+static void convertMixToFloat(const int32_t* mix, float* outL, float* outR, int32_t numFrames);
+
+// Helpers to run every active chip for a run of frames and mix their output
+static void generateChips(MyOPL3VST* vst, int32_t numFrames, bool nativeRate);
+static bool allChipsIdle(MyOPL3VST* vst);
+static void updateIdleChips(MyOPL3VST* vst);
+static void mixChipsToFloat(MyOPL3VST* vst, float* outL, float* outR, int32_t numFrames);
+
+// Helpers for native-rate rendering through the polyphase resampler
+static void buildResamplerTables(float sampleRate, float* coefs);
+static void resetResampler(MyOPL3VST* vst);
+static void setOutputRate(MyOPL3VST* vst);
+static void updateLatency(MyOPL3VST* vst);
+static int32_t getStreamRateRatio(uint32_t sampleRate);
+static void renderResampled(MyOPL3VST* vst, float* outL, float* outR, int32_t numFrames);
+static void resampleFrames(const float* table, int taps, const float* ringL, const float* ringR,
+                           uint64_t pos, uint64_t step, float* outL, float* outR, int32_t numFrames);
+
+// Helper to fill pitchTable
+static void buildPitchTable(MyOPL3VST* vst);
+
+// Helpers for the shadow register file
+static void writeRegister(MyOPL3VST* vst, int chip, uint16_t reg, uint8_t value);
+static void setRegister(MyOPL3VST* vst, int chip, uint16_t reg, uint8_t value);
+static void resetChip(MyOPL3VST* vst, int chip);
+static void updateRegisterGroup(MyOPL3VST* vst, int chip, int group);
+static void flushParameterChanges(MyOPL3VST* vst);
+static void updateRegisterGroups(MyOPL3VST* vst, const bool* dirtyGroups);
+
+// Helpers for parameter smoothing
+static int getSmoothedSlot(int index);
+static bool startSmoothing(MyOPL3VST* vst, int part, int slot, float value);
+static void advanceSmoothing(MyOPL3VST* vst);
+
+// Helper to change the number of rendering chips
+static void setChipCount(MyOPL3VST* vst, int numChips);
+
+// Helpers to apply current voice settings to all OPL3 channels
+static void loadVoicePatch(MyOPL3VST* vst, int v);
+static void writePatchImage(MyOPL3VST* vst, int v, const PatchImage& image);
+static void loadDrumPatch(MyOPL3VST* vst, int v);
 static void applyVoiceSettingsToAllChannels(MyOPL3VST* vst);
+static uint16_t getChannelRegister(int ch, int base);
+
+// Helpers for the render worker pool
+static RenderPool* createRenderPool(MyOPL3VST* vst);
+static void startRenderWorkers(MyOPL3VST* vst, int threads);
+static void destroyRenderPool(MyOPL3VST* vst);
+static void renderChipShare(MyOPL3VST* vst, int first, int stride, int32_t numFrames, bool nativeRate);
+static int getActiveRenderThreads(MyOPL3VST* vst, int32_t numFrames);
+static void dispatchRenderJob(MyOPL3VST* vst, int threads, int32_t numFrames, bool nativeRate);
+
+// Fast emulation core
+static FastChip* createFastChips();
+static void destroyFastChips(MyOPL3VST* vst);
+static void resetFastChip(MyOPL3VST* vst, int chip);
+static void writeFastRegister(MyOPL3VST* vst, int chip, uint16_t reg, uint8_t value);
+static void renderFastChip(MyOPL3VST* vst, int chip, int32_t numFrames, bool nativeRate);
+static void setFastChipRate(MyOPL3VST* vst, int chip);
+static int getSlotEnvelope(MyOPL3VST* vst, int chip, int slot);
+static int getSlotAttenuation(MyOPL3VST* vst, int chip, int slot);
+static bool isSlotKeyed(MyOPL3VST* vst, int chip, int slot);
+static int getChannelSlot(int channel, int op);
+static void setCore(MyOPL3VST* vst, int core);
+
+// CPU feature dispatch
+static void selectKernels();
 
 // -----------------------------------------------------------------------------
 // 2) Entry point to create the plugin object
 // -----------------------------------------------------------------------------
 extern "C" AEffect* VSTPluginMain(audioMasterCallback audioMaster)
 {
+    // Pick the kernel builds for this CPU, the first time a plugin is created
+    selectKernels();
+
     // Allocate our plugin struct
     MyOPL3VST* vst = new MyOPL3VST;
     memset(vst, 0, sizeof(MyOPL3VST));
+    vst->audioMaster = audioMaster;
 
     // Fill out the AEffect
     AEffect& ae = vst->aeffect;
@@ -221,12 +880,12 @@ extern "C" AEffect* VSTPluginMain(audioMasterCallback audioMaster)
     ae.getParameter     = getParameter;
     ae.processReplacing = processReplacing;
     ae.numPrograms      = kNumPrograms;
-    ae.numParams        = kNumVSTParams;  // Monotimbral interface has fewer parameters
+    ae.numParams        = kNumVSTParams;  // The edit part's patch and the engine settings
     ae.numInputs        = kNumInputs;
     ae.numOutputs       = kNumOutputs;
     
     // Set flags to indicate a synth plugin with replacing process function
-    ae.flags            = effFlagsIsSynth | effFlagsCanReplacing | effFlagsProgramChunks;
+    ae.flags            = effFlagsIsSynth | effFlagsCanReplacing | effFlagsProgramChunks | effFlagsNoSoundInStop;
     ae.initialDelay     = 0;
     ae.uniqueID         = CCONST('O', 'P', 'L', '3');
     ae.version          = 1000;  // 1.0.0.0
@@ -240,105 +899,255 @@ extern "C" AEffect* VSTPluginMain(audioMasterCallback audioMaster)
     for (int i = 0; i < MAX_VOICES; i++) {
         vst->voices[i].active = false;
         vst->voices[i].midiNote = -1;
-        vst->voices[i].frequency = 0.f;
-        vst->voices[i].channelIndex = i; // simple 1:1 mapping
+        vst->voices[i].pitch = 0;
+        vst->voices[i].channelIndex = i % OPL3_CHANNEL_COUNT;
+        vst->voices[i].chipIndex = i / OPL3_CHANNEL_COUNT;
+        vst->voices[i].prev = -1;
+        vst->voices[i].next = -1;
+        vst->voices[i].nextSameNote = -1;
+        vst->voices[i].keyOnPending = false;
+        vst->voices[i].releasing = false;
     }
 
     // Initialize paramValues with sensible defaults
-    for (int i = 0; i < TOTAL_INTERNAL_PARAMETERS; i++) {
-        // Default initialization to prevent undefined behavior
-        vst->paramValues[i] = 0.f;
+    for (int c = 0; c < kMaxChips; c++) {
+        for (int i = 0; i < TOTAL_INTERNAL_PARAMETERS; i++) {
+            // Default initialization to prevent undefined behavior
+            vst->paramValues[c][i] = 0.f;
+        }
     }
     
-    // Initialize VST interface parameters with sensible defaults
+    // Initialize VST interface parameters with sensible defaults. Every part starts
+    // out with the patch of part 0.
     // Modulator (operator 0)
-    vst->currentSettings[kVST_Mod_AM]   = 0.0f; // AM off
-    vst->currentSettings[kVST_Mod_VIB]  = 0.0f; // VIB off
-    vst->currentSettings[kVST_Mod_EGT]  = 0.0f; // EGT non-sustaining
-    vst->currentSettings[kVST_Mod_KSR]  = 0.0f; // KSR off
-    vst->currentSettings[kVST_Mod_MULT] = 0.2f; // MULT around 2-3
-    vst->currentSettings[kVST_Mod_KSL]  = 0.0f; // KSL 0
-    vst->currentSettings[kVST_Mod_TL]   = 0.1f; // Modulator level
-    vst->currentSettings[kVST_Mod_AR]   = 1.0f; // Fastest attack
-    vst->currentSettings[kVST_Mod_DR]   = 0.4f; // Medium decay
-    vst->currentSettings[kVST_Mod_SL]   = 0.3f; // Medium sustain level
-    vst->currentSettings[kVST_Mod_RR]   = 0.5f; // Medium release
-    vst->currentSettings[kVST_Mod_WS]   = 0.0f; // Sine wave
+    vst->patches[0][kVST_Mod_AM]   = 0.0f; // AM off
+    vst->patches[0][kVST_Mod_VIB]  = 0.0f; // VIB off
+    vst->patches[0][kVST_Mod_EGT]  = 0.0f; // EGT non-sustaining
+    vst->patches[0][kVST_Mod_KSR]  = 0.0f; // KSR off
+    vst->patches[0][kVST_Mod_MULT] = 0.2f; // MULT around 2-3
+    vst->patches[0][kVST_Mod_KSL]  = 0.0f; // KSL 0
+    vst->patches[0][kVST_Mod_TL]   = 0.1f; // Modulator level
+    vst->patches[0][kVST_Mod_AR]   = 1.0f; // Fastest attack
+    vst->patches[0][kVST_Mod_DR]   = 0.4f; // Medium decay
+    vst->patches[0][kVST_Mod_SL]   = 0.3f; // Medium sustain level
+    vst->patches[0][kVST_Mod_RR]   = 0.5f; // Medium release
+    vst->patches[0][kVST_Mod_WS]   = 0.0f; // Sine wave
     
     // Carrier (operator 1)
-    vst->currentSettings[kVST_Car_AM]   = 0.0f; // AM off
-    vst->currentSettings[kVST_Car_VIB]  = 0.0f; // VIB off
-    vst->currentSettings[kVST_Car_EGT]  = 0.0f; // EGT non-sustaining
-    vst->currentSettings[kVST_Car_KSR]  = 0.0f; // KSR off
-    vst->currentSettings[kVST_Car_MULT] = 0.2f; // MULT around 2-3
-    vst->currentSettings[kVST_Car_KSL]  = 0.0f; // KSL 0
-    vst->currentSettings[kVST_Car_TL]   = 0.0f; // Maximum volume for carrier
-    vst->currentSettings[kVST_Car_AR]   = 1.0f; // Fastest attack
-    vst->currentSettings[kVST_Car_DR]   = 0.4f; // Medium decay
-    vst->currentSettings[kVST_Car_SL]   = 0.3f; // Medium sustain level
-    vst->currentSettings[kVST_Car_RR]   = 0.5f; // Medium release
-    vst->currentSettings[kVST_Car_WS]   = 0.0f; // Sine wave
+    vst->patches[0][kVST_Car_AM]   = 0.0f; // AM off
+    vst->patches[0][kVST_Car_VIB]  = 0.0f; // VIB off
+    vst->patches[0][kVST_Car_EGT]  = 0.0f; // EGT non-sustaining
+    vst->patches[0][kVST_Car_KSR]  = 0.0f; // KSR off
+    vst->patches[0][kVST_Car_MULT] = 0.2f; // MULT around 2-3
+    vst->patches[0][kVST_Car_KSL]  = 0.0f; // KSL 0
+    vst->patches[0][kVST_Car_TL]   = 0.0f; // Maximum volume for carrier
+    vst->patches[0][kVST_Car_AR]   = 1.0f; // Fastest attack
+    vst->patches[0][kVST_Car_DR]   = 0.4f; // Medium decay
+    vst->patches[0][kVST_Car_SL]   = 0.3f; // Medium sustain level
+    vst->patches[0][kVST_Car_RR]   = 0.5f; // Medium release
+    vst->patches[0][kVST_Car_WS]   = 0.0f; // Sine wave
     
     // Channel parameters
-    vst->currentSettings[kVST_FB]     = 0.0f; // No feedback
-    vst->currentSettings[kVST_CON]    = 0.0f; // FM mode
-    vst->currentSettings[kVST_LEFT]   = 1.0f; // Left output on
-    vst->currentSettings[kVST_RIGHT]  = 1.0f; // Right output on
+    vst->patches[0][kVST_FB]     = 0.0f; // No feedback
+    vst->patches[0][kVST_CON]    = 0.0f; // FM mode
+    vst->patches[0][kVST_LEFT]   = 1.0f; // Left output on
+    vst->patches[0][kVST_RIGHT]  = 1.0f; // Right output on
+    
+    // Operators 3 and 4 start out like the modulator and the carrier
+    for (int param = 0; param < kNumOperatorParams; param++) {
+        vst->patches[0][kVST_Op3_AM + param] = vst->patches[0][kVST_Mod_AM + param];
+        vst->patches[0][kVST_Op4_AM + param] = vst->patches[0][kVST_Car_AM + param];
+    }
+    vst->patches[0][kVST_FourOp] = 0.0f; // 2-op patch
     
     // Global parameters
     vst->currentSettings[kVST_TremoloDepth] = 0.0f; // Normal tremolo
     vst->currentSettings[kVST_VibratoDepth] = 0.0f; // Normal vibrato
+    vst->currentSettings[kVST_RhythmMode]   = 0.0f; // All 18 channels melodic
     
-    // Apply these settings to the internal OPL3 parameters for all voices
-    applyVoiceSettingsToAllChannels(vst);
-
-    // Initialize OPL3 at 44.1k
-    OPL3_Reset(&vst->chip, vst->sampleRate);
-    
-    // Enable OPL3 features (not OPL2 mode)
-    OPL3_WriteReg(&vst->chip, 0x105, 1);
+    // Drum kit: non-sustaining envelopes, so drums decay without a note-off
+    for (int drumOp = 0; drumOp < kNumDrumOps; drumOp++) {
+        float* op = &vst->currentSettings[kVST_DrumOps + drumOp * kNumOperatorParams];
+        const uint8_t* fields = DRUM_DEFAULTS[drumOp];
+        op[kParamMULT] = fields[0] / 15.0f;
+        op[kParamTL]   = fields[1] / 63.0f;
+        op[kParamAR]   = fields[2] / 15.0f;
+        op[kParamDR]   = fields[3] / 15.0f;
+        op[kParamSL]   = fields[4] / 15.0f;
+        op[kParamRR]   = fields[5] / 15.0f;
+        op[kParamWS]   = fields[6] / 7.0f;
+    }
+    vst->currentSettings[kVST_BD_FB] = 3.0f / 7.0f;
     
-    // Set waveform select enable bit
-    OPL3_WriteReg(&vst->chip, 0x01, 0x20);
+    // Engine parameters
+    vst->currentSettings[kVST_Resampler] = 0.0f; // Nuked's built-in resampler
+    vst->currentSettings[kVST_Chips]     = 0.0f; // One chip, 18 voices
+    vst->currentSettings[kVST_Threads]   = 0.0f; // Render on the audio thread only
+    vst->currentSettings[kVST_VoiceSteal] = 0.0f; // Steal the oldest note
+    vst->currentSettings[kVST_BendRange] = 2.0f / kMaxBendRange; // +-2 semitones
+    vst->currentSettings[kVST_Smoothing] = 10.0f / kMaxSmoothingMs; // 10 ms glides
+    vst->currentSettings[kVST_Multi]     = 0.0f; // Every MIDI channel plays part 1
+    vst->currentSettings[kVST_EditPart]  = 0.0f; // Patch parameters edit part 1
+    vst->currentSettings[kVST_Core]      = 0.0f; // Nuked OPL3
+    vst->currentSettings[kVST_IdleSkip]  = 0.0f; // Emulate silent chips too
+    vst->resamplerMode = kResamplerNuked;
+    vst->renderThreads = 1;
+    vst->stealPolicy = kStealOldest;
+    for (int p = 0; p < kNumParts; p++) {
+        memcpy(vst->patches[p], vst->patches[0], sizeof(vst->patches[p]));
+        vst->parts[p].bendValue = kBendCenter;
+        vst->parts[p].queuedBend = kBendCenter;
+        vst->parts[p].bendRangeCents = 200;
+        vst->parts[p].rpnBendRange = false;
+        vst->parts[p].rpnMsb = vst->parts[p].rpnLsb = 127;
+    }
+    vst->smoothingMs = 10.0f;
+    vst->idleDelay = kIdleCheckInterval;
+    vst->awakeChips = ~0u;  // Idle Skip starts off
+    vst->renderPool = createRenderPool(vst);
+    vst->fastChips = createFastChips();
+
+    // Every program of the bank starts out as the default patch
+    for (int n = 0; n < kNumPrograms; n++) {
+        memcpy(vst->programs[n].patch, vst->patches[0], sizeof(vst->programs[n].patch));
+        compilePatchImage(vst->programs[n].patch, vst->programs[n].image);
+        snprintf(vst->programNames[n], kProgramNameLength, "Program %d", n + 1);
+    }
+    for (int p = 0; p < kNumParts; p++) {
+        vst->partImages[p] = vst->programs[0].image;
+    }
+
+    // The host sees the defaults through the mailbox
+    vst->mailbox = new ParameterMailbox;
+    for (int i = 0; i < kNumVSTParams; i++) {
+        vst->mailbox->values[i].store(vst->currentSettings[i], std::memory_order_relaxed);
+    }
+    for (int i = 0; i < (kNumVSTParams + 31) / 32; i++) {
+        vst->mailbox->dirty[i].store(0, std::memory_order_relaxed);
+    }
+    for (int p = 0; p < kNumParts; p++) {
+        for (int i = 0; i < kNumPatchParams; i++) {
+            vst->mailbox->patchValues[p][i].store(vst->patches[p][i], std::memory_order_relaxed);
+        }
+        vst->mailbox->patchDirty[p].store(0, std::memory_order_relaxed);
+    }
+    vst->mailbox->changes.store(0, std::memory_order_relaxed);
+    vst->mailbox->releaseAll.store(false, std::memory_order_relaxed);
+    vst->mailbox->jump.store(false, std::memory_order_relaxed);
+    for (int n = 0; n < kNumPrograms; n++) {
+        for (int i = 0; i < kNumPatchParams; i++) {
+            vst->mailbox->bank[n][i].store(vst->programs[n].patch[i], std::memory_order_relaxed);
+        }
+    }
+    for (int p = 0; p < kNumParts; p++) {
+        vst->mailbox->partPrograms[p].store(0, std::memory_order_relaxed);
+    }
+    vst->mailbox->programChanges.store(0, std::memory_order_relaxed);
+    vst->mailbox->bankChanged.store(false, std::memory_order_relaxed);
+    vst->mailbox->latencyChanged.store(false, std::memory_order_relaxed);
+    vst->mailbox->rateChanged.store(false, std::memory_order_relaxed);
+    vst->mailbox->sampleRate.store(vst->sampleRate, std::memory_order_relaxed);
     
-    // Initialize all parameters to the default values
-    updateOPL3Parameters(vst);
+    // Initialize the first OPL3 at 44.1k with all parameters at their default values
+    vst->numChips = 1;
+    applyVoiceSettingsToAllChannels(vst);
+    resetChip(vst, 0);
+    vst->releasingVoices.head = vst->releasingVoices.tail = -1;
+    vst->heldVoices.head = vst->heldVoices.tail = -1;
+    resetVoiceAllocator(vst);
+
+    buildResamplerTables(vst->sampleRate, vst->resampleCoefs);
+    setOutputRate(vst);
+    resetResampler(vst);
+    buildPitchTable(vst);
 
     return &ae;
 }
 
 // -----------------------------------------------------------------------------
-// Helper to apply the current voice settings to all channels
+// Helpers to apply the current voice settings to all channels
 // -----------------------------------------------------------------------------
+// Copies the patch of a voice's part into the paramValues of its channel, and of
+// its partner channel for a 4-op voice
+static void loadVoicePatch(MyOPL3VST* vst, int v)
+{
+    const VoiceInfo& voice = vst->voices[v];
+    if (voice.paired) return;  // loaded along with the first channel of its pair
+    if (voice.drum) {
+        loadDrumPatch(vst, v);
+        return;
+    }
+    const float* patch = vst->patches[voice.part];
+    float* params = vst->paramValues[voice.chipIndex];
+
+    // Modulator (operator 0 in the channel), then carrier (operator 1)
+    int op = voice.channelIndex * 2;
+    for (int param = 0; param < kNumOperatorParams; param++) {
+        params[op*kNumOperatorParams + param] = patch[param];
+        params[(op + 1)*kNumOperatorParams + param] = patch[kNumOperatorParams + param];
+    }
+
+    // Channel parameters
+    int chParamIndex = TOTAL_OPERATOR_PARAMETERS + voice.channelIndex * kNumChannelParams;
+    for (int param = 0; param < kNumChannelParams; param++) {
+        params[chParamIndex + param] = patch[2*kNumOperatorParams + param];
+    }
+    if (!voice.fourOp) return;
+
+    // Operators 3 and 4 go to the partner channel, and the algorithm sets the
+    // connection bit of both channels. Only operator 1 has feedback.
+    int mode = getFourOpMode(patch[kVST_FourOp]);
+    int algorithm = mode > 0 ? mode - 1 : (patch[kVST_CON] > 0.5f ? 1 : 0);
+    op = (voice.channelIndex + 3) * 2;
+    for (int param = 0; param < kNumOperatorParams; param++) {
+        params[op*kNumOperatorParams + param] = patch[kVST_Op3_AM + param];
+        params[(op + 1)*kNumOperatorParams + param] = patch[kVST_Op4_AM + param];
+    }
+    int pairParamIndex = chParamIndex + 3 * kNumChannelParams;
+    params[chParamIndex + kParamConnection] = (algorithm & 1) ? 1.0f : 0.0f;
+    params[pairParamIndex + kParamFeedback] = 0.0f;
+    params[pairParamIndex + kParamConnection] = (algorithm & 2) ? 1.0f : 0.0f;
+    params[pairParamIndex + kParamLeftOutput] = patch[kVST_LEFT];
+    params[pairParamIndex + kParamRightOutput] = patch[kVST_RIGHT];
+}
+
+// Copies the drum kit into the paramValues of a rhythm mode channel: channel 6 plays
+// the bass drum on both operators, channels 7 and 8 one drum on each operator
+static void loadDrumPatch(MyOPL3VST* vst, int v)
+{
+    const VoiceInfo& voice = vst->voices[v];
+    float* params = vst->paramValues[voice.chipIndex];
+    const float* drums = &vst->currentSettings[kVST_DrumOps + (voice.channelIndex - kFirstDrumChannel) * 2 * kNumOperatorParams];
+
+    int op = voice.channelIndex * 2;
+    for (int param = 0; param < 2 * kNumOperatorParams; param++) {
+        params[op*kNumOperatorParams + param] = drums[param];
+    }
+
+    // Only the bass drum has feedback; every drum plays on both outputs
+    int chParamIndex = TOTAL_OPERATOR_PARAMETERS + voice.channelIndex * kNumChannelParams;
+    params[chParamIndex + kParamFeedback] = voice.channelIndex == DRUM_CHANNELS[kDrumBD] ? vst->currentSettings[kVST_BD_FB] : 0.0f;
+    params[chParamIndex + kParamConnection] = 0.0f;
+    params[chParamIndex + kParamLeftOutput] = 1.0f;
+    params[chParamIndex + kParamRightOutput] = 1.0f;
+}
+
 static void applyVoiceSettingsToAllChannels(MyOPL3VST* vst)
 {
-    // Apply modulator settings to all modulator operators (operator 0 in each channel)
-    for (int ch = 0; ch < MAX_VOICES; ch++) {
-        int op = ch * 2; // Modulator operator index
-        
-        // Copy all modulator parameters
-        for (int param = 0; param < kNumOperatorParams; param++) {
-            vst->paramValues[op*kNumOperatorParams + param] = vst->currentSettings[param];
-        }
-        
-        // Copy all carrier parameters
-        op = ch * 2 + 1; // Carrier operator index
-        for (int param = 0; param < kNumOperatorParams; param++) {
-            vst->paramValues[op*kNumOperatorParams + param] = vst->currentSettings[kNumOperatorParams + param];
-        }
-        
-        // Copy channel parameters
-        int chParamIndex = TOTAL_OPERATOR_PARAMETERS + ch * kNumChannelParams;
-        for (int param = 0; param < kNumChannelParams; param++) {
-            vst->paramValues[chParamIndex + param] = vst->currentSettings[2*kNumOperatorParams + param];
-        }
+    // Every running channel gets the patch of the part it plays
+    int numVoices = vst->numChips * OPL3_CHANNEL_COUNT;
+    for (int v = 0; v < numVoices; v++) {
+        loadVoicePatch(vst, v);
     }
     
     // Copy global parameters
     int globalBaseIndex = TOTAL_OPERATOR_PARAMETERS + TOTAL_CHANNEL_PARAMETERS;
-    for (int param = 0; param < 2; param++) {  // Only copy the first 2 global parameters we expose
-        vst->paramValues[globalBaseIndex + param] = 
-            vst->currentSettings[2*kNumOperatorParams + kNumChannelParams + param];
+    for (int chip = 0; chip < vst->numChips; chip++) {
+        for (int param = 0; param < 2; param++) {  // Only copy the first 2 global parameters we expose
+            vst->paramValues[chip][globalBaseIndex + param] = vst->currentSettings[kVST_TremoloDepth + param];
+        }
+        // Rhythm mode only ever runs on the first chip
+        vst->paramValues[chip][globalBaseIndex + kParamRhythmMode] = (chip == 0 && vst->rhythmMode) ? 1.0f : 0.0f;
     }
 }
 
@@ -376,7 +1185,7 @@ static intptr_t dispatcher(AEffect* effect, int32_t opCode, int32_t index, intpt
         case effGetParamName:
             if (index >= 0 && index < kNumVSTParams)
             {
-                getParameterName(vst, index, strPtr);
+                getParameterName(vst, getParamOfHostIndex(index), strPtr);
                 return 1;
             }
             return 0;
@@ -384,19 +1193,33 @@ static intptr_t dispatcher(AEffect* effect, int32_t opCode, int32_t index, intpt
         case effGetParamDisplay:
             if (index >= 0 && index < kNumVSTParams)
             {
-                getParameterDisplay(vst, index, strPtr);
+                getParameterDisplay(vst, getParamOfHostIndex(index), strPtr);
                 return 1;
             }
             return 0;
         
+        case effClose:
+            // Stop the render workers before the plugin goes away
+            destroyRenderPool(vst);
+            destroyFastChips(vst);
+            delete vst->mailbox;
+            delete vst;
+            return 1;
+
         case effSetSampleRate:
         {
-            // Host is telling us the sample rate changed
+            // Host is telling us the sample rate changed. The filters for the new
+            // rate are designed here, and the audio thread switches to them at the
+            // start of its next block. The chips keep running, so sounding notes
+            // carry on; only the output's rate conversion changes.
+            ParameterMailbox* mailbox = vst->mailbox;
             float newRate = opt;
-            vst->sampleRate = newRate;
-            OPL3_Reset(&vst->chip, newRate);
-            // Re-initialize all parameters after reset
-            updateOPL3Parameters(vst);
+            std::lock_guard<std::mutex> lock(mailbox->rateLock);
+            if (newRate == mailbox->sampleRate.load(std::memory_order_relaxed)) break;
+            mailbox->sampleRate.store(newRate, std::memory_order_relaxed);
+            buildResamplerTables(newRate, mailbox->resampleCoefs);
+            mailbox->rateChanged.store(true, std::memory_order_release);
+            updateLatency(vst);
             break;
         }
         
@@ -405,38 +1228,93 @@ static intptr_t dispatcher(AEffect* effect, int32_t opCode, int32_t index, intpt
             // 0 => stop, 1 => start
             if (value == 0) {
                 // Deactivate
-                // All notes off
-                for (int i = 0; i < MAX_VOICES; i++) {
-                    if (vst->voices[i].active) {
-                        int ch = vst->voices[i].channelIndex;
-                        int bank = (ch < 9) ? 0 : 1;
-                        int chInBank = ch % 9;
-                        // Turn off note - we need to create a composite register value
-                        uint16_t reg = (bank << 8) | (0xB0 + chInBank);
-                        OPL3_WriteReg(&vst->chip, reg, 0);
-                        vst->voices[i].active = false;
-                    }
-                }
+                // All notes off, done by the audio thread before the next block it renders
+                vst->mailbox->releaseAll.store(true, std::memory_order_release);
             } else {
-                // Reactivate - nothing special required
+                // Reactivate. Render workers for the posted Threads setting are
+                // started here, away from the audio thread.
+                startRenderWorkers(vst, getThreadCount(getHostValue(vst, kVST_Threads).load(std::memory_order_relaxed)));
+            }
+            // A Resampler change posted by setParameter, reported to the host here
+            if (vst->mailbox->latencyChanged.exchange(false, std::memory_order_relaxed)) {
+                updateLatency(vst);
             }
             break;
         }
         
         case effProcessEvents:
         {
-            // Host is sending events (MIDI, etc.)
+            // Host is sending events (MIDI, etc.) for the next processReplacing block.
+            // They are queued here and applied at their deltaFrames offset.
             VstEvents* events = (VstEvents*)ptr;
             for (int i = 0; i < events->numEvents; i++)
             {
                 if (events->events[i]->type == kVstMidiType) {
                     VstMidiEvent* midi = (VstMidiEvent*)events->events[i];
-                    handleMidiEvent(vst, *midi);
+                    queueMidiEvent(vst, *midi);
                 }
             }
             return 1;
         }
         
+        case effSetProgram:
+            setHostProgram(vst, (int)value);
+            return 0;
+
+        case effGetProgram:
+            return vst->mailbox->partPrograms[getHostEditPart(vst->mailbox)].load(std::memory_order_relaxed);
+
+        case effSetProgramName:
+        {
+            int program = vst->mailbox->partPrograms[getHostEditPart(vst->mailbox)].load(std::memory_order_relaxed);
+            strncpy(vst->programNames[program], strPtr, kProgramNameLength - 1);
+            vst->programNames[program][kProgramNameLength - 1] = '\0';
+            return 0;
+        }
+
+        case effGetProgramName:
+        {
+            int program = vst->mailbox->partPrograms[getHostEditPart(vst->mailbox)].load(std::memory_order_relaxed);
+            strcpy(strPtr, vst->programNames[program]);
+            return 0;
+        }
+
+        case effGetProgramNameIndexed:
+            if (index < 0 || index >= kNumPrograms) return 0;
+            strcpy(strPtr, vst->programNames[index]);
+            return 1;
+
+        case effGetChunk:
+            // The bank and the program share the one state
+            if (!ptr) return 0;
+            return saveChunk(vst, (void**)ptr);
+
+        case effSetChunk:
+            // A chunk of our own, or else the contents of an instrument bank file
+            if (loadChunk(vst, ptr, value)) return 1;
+            if (!ptr || value <= 0) return 0;
+            return importBankData(vst, (const uint8_t*)ptr, (size_t)value, 0, 0) > 0 ? 1 : 0;
+
+        case effVendorSpecific:
+        {
+            if (index != kOPL3VendorMagic) return 0;
+            switch (value) {
+                case kOPL3VendorGetStats:
+                    if (!ptr) return 0;
+                    *(OPL3VSTStats*)ptr = vst->stats;
+                    return 1;
+
+                case kOPL3VendorImportBank:
+                {
+                    OPL3VSTBankImport* request = (OPL3VSTBankImport*)ptr;
+                    if (!request || !request->path) return 0;
+                    request->numImported = importBankFile(vst, request->path, request->firstProgram, request->bank);
+                    return request->numImported > 0 ? 1 : 0;
+                }
+            }
+            return 0;
+        }
+        
         default:
             break;
     }
@@ -462,16 +1340,37 @@ static void getParameterName(MyOPL3VST* vst, int32_t index, char* label)
         int paramIndex = index - 2*kNumOperatorParams;
         strcpy(label, CHANNEL_NAMES[paramIndex]);
     }
+    // Operators 3 and 4
+    else if (index < kVST_FourOp) {
+        int paramIndex = index - kVST_Op3_AM;
+        sprintf(label, "%s %s", OPERATOR_TYPES[2 + paramIndex / kNumOperatorParams], PARAM_NAMES[paramIndex % kNumOperatorParams]);
+    }
+    else if (index == kVST_FourOp) {
+        strcpy(label, "4-Op");
+    }
     // Global parameters
-    else {
-        int paramIndex = index - (2*kNumOperatorParams + kNumChannelParams);
+    else if (index <= kVST_RhythmMode) {
+        int paramIndex = index - kVST_TremoloDepth;
         strcpy(label, GLOBAL_NAMES[paramIndex]);
     }
+    // Drum kit
+    else if (index < kVST_BD_FB) {
+        int paramIndex = index - kVST_DrumOps;
+        sprintf(label, "%s %s", DRUM_OP_NAMES[paramIndex / kNumOperatorParams], PARAM_NAMES[paramIndex % kNumOperatorParams]);
+    }
+    else if (index == kVST_BD_FB) {
+        strcpy(label, "BD Feedback");
+    }
+    // Engine parameters
+    else {
+        strcpy(label, ENGINE_NAMES[index - kVST_Resampler]);
+    }
 }
 
 static void getParameterDisplay(MyOPL3VST* vst, int32_t index, char* text)
 {
-    float value = vst->currentSettings[index];
+    // Called from the host's UI thread, so show what the host last set
+    float value = getHostValue(vst, index).load(std::memory_order_relaxed);
     
     // Modulator parameters
     if (index < kNumOperatorParams) {
@@ -515,9 +1414,13 @@ static void getParameterDisplay(MyOPL3VST* vst, int32_t index, char* text)
                 sprintf(text, "%.2f", value);
         }
     }
-    // Carrier parameters
-    else if (index < 2*kNumOperatorParams) {
-        int paramType = index - kNumOperatorParams;
+    // Carrier parameters, operators 3 and 4, and the drum kit's operators
+    else if (index < 2*kNumOperatorParams || (index >= kVST_Op3_AM && index < kVST_FourOp) ||
+             (index >= kVST_DrumOps && index < kVST_BD_FB)) {
+        int first = kNumOperatorParams;
+        if (index >= kVST_DrumOps) first = kVST_DrumOps;
+        else if (index >= kVST_Op3_AM) first = kVST_Op3_AM;
+        int paramType = (index - first) % kNumOperatorParams;
         
         switch (paramType) {
             case kParamAM:
@@ -579,13 +1482,17 @@ static void getParameterDisplay(MyOPL3VST* vst, int32_t index, char* text)
                 sprintf(text, "%.2f", value);
         }
     }
+    else if (index == kVST_FourOp) {
+        sprintf(text, "%s", FOUR_OP_NAMES[getFourOpMode(value)]);
+    }
     // Global parameters
-    else {
-        int paramType = index - (2*kNumOperatorParams + kNumChannelParams);
+    else if (index <= kVST_RhythmMode) {
+        int paramType = index - kVST_TremoloDepth;
         
         switch (paramType) {
             case kParamTremoloDepth:
             case kParamVibratoDepth:
+            case kParamRhythmMode:
                 sprintf(text, "%s", value > 0.5f ? "On" : "Off");
                 break;
                 
@@ -593,6 +1500,59 @@ static void getParameterDisplay(MyOPL3VST* vst, int32_t index, char* text)
                 sprintf(text, "%.2f", value);
         }
     }
+    else if (index == kVST_BD_FB) {
+        sprintf(text, "%d", static_cast<int>(value * 7.0f));
+    }
+    // Engine parameters
+    else {
+        switch (index) {
+            case kVST_Resampler:
+                sprintf(text, "%s", RESAMPLER_TIERS[getResamplerMode(value)].name);
+                break;
+                
+            case kVST_Chips:
+            {
+                int chips = getChipCount(value);
+                sprintf(text, "%d (%d voices)", chips, chips * OPL3_CHANNEL_COUNT);
+                break;
+            }
+
+            case kVST_Threads:
+                sprintf(text, "%d", getThreadCount(value));
+                break;
+
+            case kVST_VoiceSteal:
+                sprintf(text, "%s", STEAL_POLICY_NAMES[getStealPolicy(value)]);
+                break;
+
+            case kVST_BendRange:
+                sprintf(text, "%d semitones", getBendRange(value));
+                break;
+
+            case kVST_Smoothing:
+                sprintf(text, "%.0f ms", getSmoothingTime(value));
+                break;
+
+            case kVST_Multi:
+                sprintf(text, "%s", getMultiTimbral(value) ? "On" : "Off");
+                break;
+
+            case kVST_EditPart:
+                sprintf(text, "Part %d", getEditPart(value) + 1);
+                break;
+
+            case kVST_Core:
+                sprintf(text, "%s", CORE_NAMES[getCore(value)]);
+                break;
+
+            case kVST_IdleSkip:
+                sprintf(text, "%s", getIdleSkip(value) ? "On" : "Off");
+                break;
+                
+            default:
+                sprintf(text, "%.2f", value);
+        }
+    }
 }
 
 // -----------------------------------------------------------------------------
@@ -602,15 +1562,29 @@ static void setParameter(AEffect* effect, int32_t index, float value)
 {
     MyOPL3VST* vst = (MyOPL3VST*)effect->object;
     if (index < 0 || index >= kNumVSTParams) return;
+    index = getParamOfHostIndex(index);
 
-    // Store in currentSettings array
-    vst->currentSettings[index] = value;
-    
-    // Apply the setting to all voices
-    applyVoiceSettingsToAllChannels(vst);
+    // Post the value to the audio thread; the registers this parameter feeds are
+    // recomputed at the start of the next block. The release on the flag makes sure
+    // the value is visible by the time the audio thread sees the flag.
+    ParameterMailbox* mailbox = vst->mailbox;
+    if (index < kNumPatchParams) {
+        int part = getHostEditPart(mailbox);
+        int program = mailbox->partPrograms[part].load(std::memory_order_relaxed);
+        mailbox->bank[program][index].store(value, std::memory_order_relaxed);
+        mailbox->patchValues[part][index].store(value, std::memory_order_relaxed);
+        mailbox->patchDirty[part].fetch_or(1ull << index, std::memory_order_release);
+    } else {
+        mailbox->values[index].store(value, std::memory_order_relaxed);
+        mailbox->dirty[index / 32].fetch_or(1u << (index % 32), std::memory_order_release);
+    }
+    mailbox->changes.fetch_add(1, std::memory_order_relaxed);
 
-    // Immediately update the OPL3 register(s)
-    updateOPL3Parameters(vst);
+    // The new latency is reported from effMainsChanged, not from here: this may be
+    // the audio thread, which must not call back into the host
+    if (index == kVST_Resampler) {
+        mailbox->latencyChanged.store(true, std::memory_order_relaxed);
+    }
 }
 
 static float getParameter(AEffect* effect, int32_t index)
@@ -618,315 +1592,2947 @@ static float getParameter(AEffect* effect, int32_t index)
     MyOPL3VST* vst = (MyOPL3VST*)effect->object;
     if (index < 0 || index >= kNumVSTParams) return 0.f;
 
-    return vst->currentSettings[index];
+    return getHostValue(vst, getParamOfHostIndex(index)).load(std::memory_order_relaxed);
 }
 
-// -----------------------------------------------------------------------------
+// Maps a host parameter number to the plugin's parameter, see HOST_PARAM_RANGES
+static int getParamOfHostIndex(int32_t index)
+{
+    for (int r = 0; r < kNumHostParamRanges; r++) {
+        int count = HOST_PARAM_RANGES[r][1] - HOST_PARAM_RANGES[r][0] + 1;
+        if (index < count) return HOST_PARAM_RANGES[r][0] + index;
+        index -= count;
+    }
+    return kNumVSTParams - 1;
+}
+
+// The part the patch parameters edit: Edit Part in multi-timbral mode, else part 0
+static int getHostEditPart(ParameterMailbox* mailbox)
+{
+    if (!getMultiTimbral(mailbox->values[kVST_Multi].load(std::memory_order_relaxed))) return 0;
+    return getEditPart(mailbox->values[kVST_EditPart].load(std::memory_order_relaxed));
+}
+
+// The host's view of a parameter
+static std::atomic<float>& getHostValue(MyOPL3VST* vst, int32_t index)
+{
+    if (index < kNumPatchParams) {
+        return vst->mailbox->patchValues[getHostEditPart(vst->mailbox)][index];
+    }
+    return vst->mailbox->values[index];
+}
+
+// Fills the chunk buffer with the host's view of every parameter. The buffer stays
+// valid until the next effGetChunk.
+static int32_t saveChunk(MyOPL3VST* vst, void** data)
+{
+    OPL3Chunk& chunk = vst->chunk;
+    ParameterMailbox* mailbox = vst->mailbox;
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.magic = kChunkMagic;
+    chunk.version = kChunkVersion;
+    chunk.size = sizeof(OPL3Chunk);
+    for (int i = kNumPatchParams; i < kNumVSTParams; i++) {
+        chunk.values[i] = mailbox->values[i].load(std::memory_order_relaxed);
+    }
+    for (int p = 0; p < kNumParts; p++) {
+        for (int i = 0; i < kNumPatchParams; i++) {
+            chunk.patches[p][i] = mailbox->patchValues[p][i].load(std::memory_order_relaxed);
+        }
+        chunk.partPrograms[p] = (uint32_t)mailbox->partPrograms[p].load(std::memory_order_relaxed);
+    }
+    for (int n = 0; n < kNumPrograms; n++) {
+        for (int i = 0; i < kNumPatchParams; i++) {
+            chunk.bank[n][i] = mailbox->bank[n][i].load(std::memory_order_relaxed);
+        }
+    }
+    memcpy(chunk.programNames, vst->programNames, sizeof(chunk.programNames));
+    *data = &chunk;
+    return (int32_t)sizeof(OPL3Chunk);
+}
+
+// Posts a saved state to the audio thread in one go. Every value is flagged at once,
+// so the next block recomputes each register group a single time and uploads only
+// the bytes that differ, and the parameters jump to their values instead of gliding.
+static bool loadChunk(MyOPL3VST* vst, const void* data, intptr_t size)
+{
+    if (!data || size != (intptr_t)sizeof(OPL3Chunk)) return false;
+    OPL3Chunk chunk;
+    memcpy(&chunk, data, sizeof(chunk));
+    if (chunk.magic != kChunkMagic || chunk.version != kChunkVersion || chunk.size != sizeof(OPL3Chunk)) {
+        return false;
+    }
+    for (int p = 0; p < kNumParts; p++) {
+        if (chunk.partPrograms[p] >= (uint32_t)kNumPrograms) return false;
+    }
+
+    ParameterMailbox* mailbox = vst->mailbox;
+    mailbox->jump.store(true, std::memory_order_relaxed);
+    for (int i = kNumPatchParams; i < kNumVSTParams; i++) {
+        mailbox->values[i].store(chunk.values[i], std::memory_order_relaxed);
+    }
+    for (int p = 0; p < kNumParts; p++) {
+        for (int i = 0; i < kNumPatchParams; i++) {
+            mailbox->patchValues[p][i].store(chunk.patches[p][i], std::memory_order_relaxed);
+        }
+        mailbox->partPrograms[p].store((int)chunk.partPrograms[p], std::memory_order_relaxed);
+    }
+    for (int n = 0; n < kNumPrograms; n++) {
+        for (int i = 0; i < kNumPatchParams; i++) {
+            mailbox->bank[n][i].store(chunk.bank[n][i], std::memory_order_relaxed);
+        }
+        memcpy(vst->programNames[n], chunk.programNames[n], kProgramNameLength);
+        vst->programNames[n][kProgramNameLength - 1] = '\0';
+    }
+    mailbox->bankChanged.store(true, std::memory_order_relaxed);
+
+    // Flag everything, with release so the values above are seen along with the flags
+    for (int w = 0; w < (kNumVSTParams + 31) / 32; w++) {
+        uint32_t bits = 0;
+        for (int i = w * 32; i < w * 32 + 32 && i < kNumVSTParams; i++) {
+            if (i >= kNumPatchParams) bits |= 1u << (i % 32);
+        }
+        if (bits) mailbox->dirty[w].fetch_or(bits, std::memory_order_release);
+    }
+    uint64_t allPatchParams = kNumPatchParams < 64 ? (1ull << kNumPatchParams) - 1 : ~0ull;
+    for (int p = 0; p < kNumParts; p++) {
+        mailbox->patchDirty[p].fetch_or(allPatchParams, std::memory_order_release);
+    }
+    mailbox->changes.fetch_add(kNumVSTParams - kNumPatchParams + kNumParts * kNumPatchParams, std::memory_order_relaxed);
+
+    startRenderWorkers(vst, getThreadCount(chunk.values[kVST_Threads]));
+    updateLatency(vst);
+    return true;
+}
+
+// Switches the edit part to a program, as effSetProgram. The host's view of the part
+// takes the program's values here; the audio thread loads the program's compiled
+// image at the start of the next block.
+static void setHostProgram(MyOPL3VST* vst, int program)
+{
+    if (program < 0 || program >= kNumPrograms) return;
+    ParameterMailbox* mailbox = vst->mailbox;
+    int part = getHostEditPart(mailbox);
+    for (int i = 0; i < kNumPatchParams; i++) {
+        mailbox->patchValues[part][i].store(mailbox->bank[program][i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    mailbox->partPrograms[part].store(program, std::memory_order_relaxed);
+    mailbox->programChanges.fetch_or(1u << part, std::memory_order_release);
+    mailbox->changes.fetch_add(1, std::memory_order_relaxed);
+}
+
+// A MIDI program change is applied on the audio thread, which then hands the part's
+// new program and patch back to the host's view
+static void publishPartPatch(MyOPL3VST* vst, int part)
+{
+    ParameterMailbox* mailbox = vst->mailbox;
+    for (int i = 0; i < kNumPatchParams; i++) {
+        mailbox->patchValues[part][i].store(vst->patches[part][i], std::memory_order_relaxed);
+    }
+    mailbox->partPrograms[part].store(vst->parts[part].program, std::memory_order_relaxed);
+}
+
+// -----------------------------------------------------------------------------
 // 5) The big function that updates OPL3 registers from paramValues
 // -----------------------------------------------------------------------------
-static void updateOPL3Parameters(MyOPL3VST* vst)
+// Helper function to compute the OPL register bank and offset for operator opIndex
+static std::pair<int, int> getOpBase(int opIndex)
 {
-    // We will recalculate each operator's register from the parameter array.
-    // For simplicity, we'll assume OPL3 bank=0 for all writes.
+    // Convert our opIndex (0, 1, 2, ..., 35) to channel and isCarrier
+    int channel = opIndex / 2;
+    int isCarrier = opIndex % 2;
+    
+    // These arrays map from (channel, isCarrier) to actual OPL3 operator index
+    // Per the OPL3 programmer's guide mapping table
+    static const int actualOpIndex[18][2] = {
+        {0, 3},   {1, 4},   {2, 5},   {6, 9},   {7, 10},  {8, 11},
+        {12, 15}, {13, 16}, {14, 17}, {18, 21}, {19, 22}, {20, 23},
+        {24, 27}, {25, 28}, {26, 29}, {30, 33}, {31, 34}, {32, 35}
+    };
+    
+    // Get the actual OPL3 operator index
+    int actualOp = actualOpIndex[channel][isCarrier];
+    
+    // Map actual operator to register offset
+    // Offsets from the OPL3 programming guide
+    static const int regOffsets[36] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D,
+        0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05,
+        0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15
+    };
+    
+    // Calculate bank and offset
+    int bank = (actualOp >= 18) ? 1 : 0;
+    int offset = regOffsets[actualOp];
+    
+    return std::make_pair(bank, offset);
+}
 
-    // Each channel has 2 operators => operator indices
-    // The location of each operator's regs in OPL3 is more complicated, but we can
-    // do a standard AdLib layout for channels 0..8 in bank 0, 9..17 in bank 1, etc.
-    // The code below is a simplified, partial example.
+// Builds one operator register byte (reg = index into OPERATOR_REG_BASES) from the
+// operator's block of parameters in paramValues
+static uint8_t computeOperatorRegister(const float* params, int reg)
+{
+    // Convert each 0..1 float to an integer in the relevant range
+    switch (reg) {
+        case 0: // 0x20 => AM, VIB, EGT, KSR, MULT
+        {
+            int AM   = (params[kParamAM]  > 0.5f) ? 1 : 0;
+            int VIB  = (params[kParamVIB] > 0.5f) ? 1 : 0;
+            int EGT  = (params[kParamEGT] > 0.5f) ? 1 : 0;
+            int KSR  = (params[kParamKSR] > 0.5f) ? 1 : 0;
+            int MULT = (int)(params[kParamMULT] * 15.999f); // 0..15
+            return (uint8_t)((AM << 7) | (VIB << 6) | (EGT << 5) | (KSR << 4) | MULT);
+        }
+        case 1: // 0x40 => KSL, TL
+        {
+            int KSL = (int)(params[kParamKSL] * 3.999f);   // 0..3
+            int TL  = (int)(params[kParamTL] * 63.999f);   // 0..63
+            return (uint8_t)((KSL << 6) | TL);
+        }
+        case 2: // 0x60 => AR, DR
+        {
+            int AR = (int)(params[kParamAR] * 15.999f);    // 0..15
+            int DR = (int)(params[kParamDR] * 15.999f);    // 0..15
+            return (uint8_t)((AR << 4) | DR);
+        }
+        case 3: // 0x80 => SL, RR
+        {
+            int SL = (int)(params[kParamSL] * 15.999f);    // 0..15
+            int RR = (int)(params[kParamRR] * 15.999f);    // 0..15
+            return (uint8_t)((SL << 4) | RR);
+        }
+        default: // 0xE0 => WS (waveform)
+            return (uint8_t)(int)(params[kParamWS] * 7.999f); // 0..7
+    }
+}
 
-    // Helper function to compute the OPL register offsets for operator i
-    auto getOpBase = [&](int opIndex) -> std::pair<int, int> {
-        // Convert our opIndex (0, 1, 2, ..., 35) to channel and isCarrier
-        int channel = opIndex / 2;
-        int isCarrier = opIndex % 2;
-        
-        // These arrays map from (channel, isCarrier) to actual OPL3 operator index
-        // Per the OPL3 programmer's guide mapping table
-        static const int actualOpIndex[18][2] = {
-            {0, 3},   {1, 4},   {2, 5},   {6, 9},   {7, 10},  {8, 11},
-            {12, 15}, {13, 16}, {14, 17}, {18, 21}, {19, 22}, {20, 23},
-            {24, 27}, {25, 28}, {26, 29}, {30, 33}, {31, 34}, {32, 35}
-        };
-        
-        // Get the actual OPL3 operator index
-        int actualOp = actualOpIndex[channel][isCarrier];
-        
-        // Map actual operator to register offset
-        // Offsets from the OPL3 programming guide
-        static const int regOffsets[36] = {
-            0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D,
-            0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05,
-            0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15
-        };
-        
-        // Calculate bank and offset
-        int bank = (actualOp >= 18) ? 1 : 0;
-        int offset = regOffsets[actualOp];
-        
-        return std::make_pair(bank, offset);
-    };
+// Builds the 0xC0 register byte of a channel from its block of channel parameters
+static uint8_t computeChannelRegister(const float* params)
+{
+    int FB    = (int)(params[kParamFeedback] * 7.999f);    // 3 bits of feedback
+    int CON   = (params[kParamConnection]  > 0.5f) ? 1 : 0; // 0=FM, 1=AM
+    int LEFT  = (params[kParamLeftOutput]  > 0.5f) ? 1 : 0;
+    int RIGHT = (params[kParamRightOutput] > 0.5f) ? 1 : 0;
 
-    // First, handle global parameters
-    int globalBaseIndex = TOTAL_OPERATOR_PARAMETERS + TOTAL_CHANNEL_PARAMETERS;
+    // Left/right output enablers
+    return (uint8_t)((LEFT << 4) | (RIGHT << 5) | (FB << 1) | CON);
+}
+
+// Builds the 0xBD register byte from the global parameters
+static uint8_t computeGlobalRegister(const float* params)
+{
     uint8_t tremVib = 0;
-    if (vst->paramValues[globalBaseIndex + kParamTremoloDepth] > 0.5f) {
+    if (params[kParamTremoloDepth] > 0.5f) {
         tremVib |= 0x80; // Deep tremolo
     }
-    if (vst->paramValues[globalBaseIndex + kParamVibratoDepth] > 0.5f) {
+    if (params[kParamVibratoDepth] > 0.5f) {
         tremVib |= 0x40; // Deep vibrato
     }
     
-    // Always disable rhythm mode
-    uint8_t rhythmBits = 0; // Always keep rhythm mode disabled
+    // The drums' key-on bits are added by the caller
+    uint8_t rhythmBits = 0;
+    if (params[kParamRhythmMode] > 0.5f) {
+        rhythmBits |= 0x20; // Rhythm mode
+    }
+    return rhythmBits | tremVib;
+}
+
+// Compiles the register bytes of a patch. A 4-op voice's connection bits come from
+// its algorithm and only operator 1 has feedback, as in loadVoicePatch.
+static void compilePatchImage(const float* patch, PatchImage& image)
+{
+    static const int OPERATOR_BASES[4] = { kVST_Mod_AM, kVST_Car_AM, kVST_Op3_AM, kVST_Op4_AM };
+    for (int op = 0; op < 4; op++) {
+        for (int reg = 0; reg < kNumOperatorRegs; reg++) {
+            image.ops[op][reg] = computeOperatorRegister(&patch[OPERATOR_BASES[op]], reg);
+        }
+    }
+    image.channel = computeChannelRegister(&patch[kVST_FB]);
+
+    int mode = getFourOpMode(patch[kVST_FourOp]);
+    int algorithm = mode > 0 ? mode - 1 : (patch[kVST_CON] > 0.5f ? 1 : 0);
+    float first[kNumChannelParams], second[kNumChannelParams];
+    memcpy(first, &patch[kVST_FB], sizeof(first));
+    first[kParamConnection] = (algorithm & 1) ? 1.0f : 0.0f;
+    second[kParamFeedback] = 0.0f;
+    second[kParamConnection] = (algorithm & 2) ? 1.0f : 0.0f;
+    second[kParamLeftOutput] = patch[kVST_LEFT];
+    second[kParamRightOutput] = patch[kVST_RIGHT];
+    image.fourOpChannels[0] = computeChannelRegister(first);
+    image.fourOpChannels[1] = computeChannelRegister(second);
+}
+
+// Writes a register straight to a chip and records it in the shadow file.
+// Used for writes that must land on the current sample, such as key-on.
+static void writeRegister(MyOPL3VST* vst, int chip, uint16_t reg, uint8_t value)
+{
+    vst->awakeChips |= 1u << chip;
+    vst->regShadow[chip][reg] = value;
+    if (vst->core == kCoreFast) writeFastRegister(vst, chip, reg, value);
+    else OPL3_WriteReg(&vst->chips[chip], reg, value);
+    vst->stats.regWrites++;
+}
+
+// Writes a register only when its byte differs from the shadow file
+static void setRegister(MyOPL3VST* vst, int chip, uint16_t reg, uint8_t value)
+{
+    if (vst->regShadow[chip][reg] == value) return;
+    writeRegister(vst, chip, reg, value);
+}
+
+// Resets a chip to the host rate and loads the current parameters into it.
+// OPL3_Reset clears every register, so the shadow file starts over at zero.
+static void resetChip(MyOPL3VST* vst, int chip)
+{
+    if (vst->core == kCoreFast) resetFastChip(vst, chip);
+    else OPL3_Reset(&vst->chips[chip], vst->sampleRate);
+    memset(vst->regShadow[chip], 0, sizeof(vst->regShadow[chip]));
+
+    // Enable OPL3 features (not OPL2 mode)
+    writeRegister(vst, chip, 0x105, 1);
     
-    // Create composite register value (bank 0, register 0xBD)
-    uint16_t bdReg = 0x0BD; // Bank 0, register 0xBD
-    OPL3_WriteReg(&vst->chip, bdReg, rhythmBits | tremVib);
+    // Set waveform select enable bit
+    writeRegister(vst, chip, 0x01, 0x20);
 
-    // Now we traverse each operator, read paramValues, and write registers
-    for (int op = 0; op < OPL3_TOTAL_OPERATORS; op++)
-    {
-        // Our param block for this operator is
-        //    [op * kNumOperatorParams ... op * kNumOperatorParams + (kNumOperatorParams-1)]
-        float amF   = vst->paramValues[op*kNumOperatorParams + kParamAM];
-        float vibF  = vst->paramValues[op*kNumOperatorParams + kParamVIB];
-        float egtF  = vst->paramValues[op*kNumOperatorParams + kParamEGT];
-        float ksrF  = vst->paramValues[op*kNumOperatorParams + kParamKSR];
-        float multF = vst->paramValues[op*kNumOperatorParams + kParamMULT];
-        float kslF  = vst->paramValues[op*kNumOperatorParams + kParamKSL];
-        float tlF   = vst->paramValues[op*kNumOperatorParams + kParamTL];
-        float arF   = vst->paramValues[op*kNumOperatorParams + kParamAR];
-        float drF   = vst->paramValues[op*kNumOperatorParams + kParamDR];
-        float slF   = vst->paramValues[op*kNumOperatorParams + kParamSL];
-        float rrF   = vst->paramValues[op*kNumOperatorParams + kParamRR];
-        float wsF   = vst->paramValues[op*kNumOperatorParams + kParamWS];
-
-        // Convert each 0..1 float to an integer in the relevant range
-        int AM   = (amF  > 0.5f) ? 1 : 0;
-        int VIB  = (vibF > 0.5f) ? 1 : 0;
-        int EGT  = (egtF > 0.5f) ? 1 : 0;
-        int KSR  = (ksrF > 0.5f) ? 1 : 0;
-        int MULT = (int)(multF * 15.999f); // 0..15
-        int KSL  = (int)(kslF * 3.999f);   // 0..3
-        int TL   = (int)(tlF * 63.999f);   // 0..63
-        int AR   = (int)(arF * 15.999f);   // 0..15
-        int DR   = (int)(drF * 15.999f);   // 0..15
-        int SL   = (int)(slF * 15.999f);   // 0..15
-        int RR   = (int)(rrF * 15.999f);   // 0..15
-        int WS   = (int)(wsF * 7.999f);    // 0..7
+    for (int group = 0; group < kNumRegGroups; group++) {
+        updateRegisterGroup(vst, chip, group);
+    }
+    setRegister(vst, chip, 0x104, getFourOpMask(vst, chip));
+}
 
+// Moves the running chips to another emulation core. Each chip of the new core
+// starts from power-on and is loaded with the shadow register file: the mode bits
+// first, then the operators and channels, and the key-on registers last, so
+// sounding notes carry on (with their envelopes restarted).
+static void setCore(MyOPL3VST* vst, int core)
+{
+    vst->core = core;
+    for (int c = 0; c < vst->numChips; c++) {
+        uint8_t image[OPL3_REGISTER_COUNT];
+        memcpy(image, vst->regShadow[c], sizeof(image));
+        if (core == kCoreFast) resetFastChip(vst, c);
+        else OPL3_Reset(&vst->chips[c], vst->sampleRate);
+
+        writeRegister(vst, c, 0x105, image[0x105]);
+        writeRegister(vst, c, 0x104, image[0x104]);
+        for (int reg = 0; reg < OPL3_REGISTER_COUNT; reg++) {
+            int low = reg & 0xFF;
+            if ((low >= 0xB0 && low <= 0xBD) || reg == 0x104 || reg == 0x105) continue;
+            writeRegister(vst, c, (uint16_t)reg, image[reg]);
+        }
+        for (int ch = 0; ch < OPL3_CHANNEL_COUNT; ch++) {
+            uint16_t reg = getChannelRegister(ch, 0xB0);
+            writeRegister(vst, c, reg, image[reg]);
+        }
+        writeRegister(vst, c, 0xBD, image[0xBD]);
+    }
+}
+
+// Returns the register group a VST parameter feeds, or -1 for engine parameters
+static int getRegisterGroup(int32_t index)
+{
+    // Drum operators sit in the modulator and carrier slots of chip 0's channels 6-8
+    if (index >= kVST_DrumOps && index < kVST_BD_FB) {
+        int role = (index - kVST_DrumOps) / kNumOperatorParams % 2;
+        return kRegGroupOperators + role * kNumOperatorRegs + OPERATOR_PARAM_REGS[(index - kVST_DrumOps) % kNumOperatorParams];
+    }
+    if (index == kVST_BD_FB) {
+        return kRegGroupChannels;
+    }
+    if (index > kVST_RhythmMode) {
+        return -1;
+    }
+    if (index < 2*kNumOperatorParams) {
+        int role = index / kNumOperatorParams;
+        return kRegGroupOperators + role * kNumOperatorRegs + OPERATOR_PARAM_REGS[index % kNumOperatorParams];
+    }
+    // Operators 3 and 4 sit in the modulator and carrier slots of a pair's second channel
+    if (index >= kVST_Op3_AM && index < kVST_FourOp) {
+        int role = (index - kVST_Op3_AM) / kNumOperatorParams;
+        return kRegGroupOperators + role * kNumOperatorRegs + OPERATOR_PARAM_REGS[(index - kVST_Op3_AM) % kNumOperatorParams];
+    }
+    if (index < kVST_TremoloDepth) {
+        return kRegGroupChannels;  // channel parameters and the 4-op algorithm
+    }
+    return kRegGroupGlobal;
+}
+
+// Recomputes every register of a group from paramValues and sends the bytes that
+// changed to one chip
+static void updateRegisterGroup(MyOPL3VST* vst, int chip, int group)
+{
+    if (group == kRegGroupGlobal) {
+        // Bank 0, register 0xBD
+        int globalBaseIndex = TOTAL_OPERATOR_PARAMETERS + TOTAL_CHANNEL_PARAMETERS;
+        uint8_t value = computeGlobalRegister(&vst->paramValues[chip][globalBaseIndex]);
+        if (chip == 0) value |= vst->drumKeys;
+        setRegister(vst, chip, 0x0BD, value);
+        return;
+    }
+
+    if (group == kRegGroupChannels) {
+        int channelParamOffset = OPL3_TOTAL_OPERATORS * kNumOperatorParams;
+        for (int ch = 0; ch < OPL3_CHANNEL_COUNT; ch++)
+        {
+            // For channel ch, the feedback/connect bits live in register 0xC0 + chInBank
+            int bank = (ch < 9) ? 0 : 1;
+            int chInBank = ch % 9;
+            uint16_t regAddr = (bank << 8) | (0xC0 + chInBank);
+            setRegister(vst, chip, regAddr, computeChannelRegister(&vst->paramValues[chip][channelParamOffset + ch*kNumChannelParams]));
+        }
+        return;
+    }
+
+    // Operator groups cover one register type of either every modulator or every carrier
+    int role = (group - kRegGroupOperators) / kNumOperatorRegs;
+    int reg = (group - kRegGroupOperators) % kNumOperatorRegs;
+    for (int op = role; op < OPL3_TOTAL_OPERATORS; op += OPL3_OPERATORS_PER_CHANNEL)
+    {
         // Get operator's register bank and offset
         std::pair<int, int> opBase = getOpBase(op);
-        int bank = opBase.first;
-        int opSlot = opBase.second;
+        uint16_t regAddr = (opBase.first << 8) | (OPERATOR_REG_BASES[reg] + opBase.second);
+        setRegister(vst, chip, regAddr, computeOperatorRegister(&vst->paramValues[chip][op*kNumOperatorParams], reg));
+    }
+}
 
-        // 0x20 => AM, VIB, EGT, KSR, MULT
-        int r20 = (AM << 7) | (VIB << 6) | (EGT << 5) | (KSR << 4) | MULT;
-        uint16_t reg20 = (bank << 8) | (0x20 + opSlot);
-        OPL3_WriteReg(&vst->chip, reg20, (unsigned char)r20);
+static int getThreadCount(float value)
+{
+    int threads = 1 + (int)(value * (kMaxRenderThreads - 0.001f));
+    if (threads < 1) threads = 1;
+    if (threads > kMaxRenderThreads) threads = kMaxRenderThreads;
+    return threads;
+}
 
-        // 0x40 => KSL, TL
-        int r40 = (KSL << 6) | TL;
-        uint16_t reg40 = (bank << 8) | (0x40 + opSlot);
-        OPL3_WriteReg(&vst->chip, reg40, (unsigned char)r40);
+static int getStealPolicy(float value)
+{
+    int policy = (int)(value * (kNumStealPolicies - 0.001f));
+    if (policy < 0) policy = 0;
+    if (policy > kNumStealPolicies - 1) policy = kNumStealPolicies - 1;
+    return policy;
+}
 
-        // 0x60 => AR, DR
-        int r60 = (AR << 4) | DR;
-        uint16_t reg60 = (bank << 8) | (0x60 + opSlot);
-        OPL3_WriteReg(&vst->chip, reg60, (unsigned char)r60);
+static int getBendRange(float value)
+{
+    int semitones = (int)(value * (kMaxBendRange + 0.999f));
+    if (semitones < 0) semitones = 0;
+    if (semitones > kMaxBendRange) semitones = kMaxBendRange;
+    return semitones;
+}
 
-        // 0x80 => SL, RR
-        int r80 = (SL << 4) | RR;
-        uint16_t reg80 = (bank << 8) | (0x80 + opSlot);
-        OPL3_WriteReg(&vst->chip, reg80, (unsigned char)r80);
+static bool getMultiTimbral(float value)
+{
+    return value > 0.5f;
+}
 
-        // 0xE0 => WS (waveform)
-        uint16_t regE0 = (bank << 8) | (0xE0 + opSlot);
-        OPL3_WriteReg(&vst->chip, regE0, (unsigned char)WS);
-    }
+static int getFourOpMode(float value)
+{
+    int mode = (int)(value * (kNumFourOpModes - 0.001f));
+    if (mode < 0) mode = 0;
+    if (mode > kNumFourOpModes - 1) mode = kNumFourOpModes - 1;
+    return mode;
+}
 
-    // Now each channel's parameters
-    int channelParamOffset = OPL3_TOTAL_OPERATORS * kNumOperatorParams;
-    for (int ch = 0; ch < OPL3_CHANNEL_COUNT; ch++)
-    {
-        float fbF   = vst->paramValues[channelParamOffset + ch*kNumChannelParams + kParamFeedback];
-        float conF  = vst->paramValues[channelParamOffset + ch*kNumChannelParams + kParamConnection];
-        float leftF = vst->paramValues[channelParamOffset + ch*kNumChannelParams + kParamLeftOutput];
-        float rightF = vst->paramValues[channelParamOffset + ch*kNumChannelParams + kParamRightOutput];
-        
-        int FB  = (int)(fbF * 7.999f);   // 3 bits of feedback
-        int CON = (conF > 0.5f) ? 1 : 0; // 0=FM, 1=AM
-        int LEFT = (leftF > 0.5f) ? 1 : 0;
-        int RIGHT = (rightF > 0.5f) ? 1 : 0;
+static int getCore(float value)
+{
+    int core = (int)(value * (kNumCores - 0.001f));
+    if (core < 0) core = 0;
+    if (core > kNumCores - 1) core = kNumCores - 1;
+    return core;
+}
 
-        // For channel ch, the feedback/connect bits live in register 0xC0 + chInBank
-        int bank = (ch < 9) ? 0 : 1;
-        int chInBank = ch % 9;
+static bool getIdleSkip(float value)
+{
+    return value > 0.5f;
+}
 
-        // Left/right output enablers
-        unsigned char regC0 = (LEFT << 4) | (RIGHT << 5) | (FB << 1) | CON;
-        
-        // Create composite register value
-        uint16_t regAddr = (bank << 8) | (0xC0 + chInBank);
-        OPL3_WriteReg(&vst->chip, regAddr, regC0);
-    }
+static int getEditPart(float value)
+{
+    int part = (int)(value * (kNumParts - 0.001f));
+    if (part < 0) part = 0;
+    if (part > kNumParts - 1) part = kNumParts - 1;
+    return part;
 }
 
-// -----------------------------------------------------------------------------
-// 6) processReplacing callback: Generate audio from OPL3
-// -----------------------------------------------------------------------------
-static void processReplacing(AEffect* effect, float** inputs, float** outputs, int32_t sampleFrames)
+static float getSmoothingTime(float value)
 {
-    MyOPL3VST* vst = (MyOPL3VST*)effect->object;
+    if (value < 0.0f) value = 0.0f;
+    if (value > 1.0f) value = 1.0f;
+    return value * kMaxSmoothingMs;
+}
 
-    float* outL = outputs[0];
-    float* outR = outputs[1];
+static int getChipCount(float value)
+{
+    int chips = 1 + (int)(value * (kMaxChips - 0.001f));
+    if (chips < 1) chips = 1;
+    if (chips > kMaxChips) chips = kMaxChips;
+    return chips;
+}
 
-    int16_t buffer[2];
-    for (int i = 0; i < sampleFrames; i++) {
-        // Generate one stereo sample
-        OPL3_Generate(&vst->chip, buffer);
-        
-        outL[i] = (float)buffer[0] / 32768.f;
-        outR[i] = (float)buffer[1] / 32768.f;
+// Starts or stops chips. New chips are reset and loaded with the current parameters;
+// voices on chips that stop are dropped.
+static void setChipCount(MyOPL3VST* vst, int numChips)
+{
+    int firstNew = vst->numChips;
+    vst->numChips = numChips;
+    applyVoiceSettingsToAllChannels(vst);
+    for (int c = firstNew; c < numChips; c++) {
+        resetChip(vst, c);
     }
+    resetVoiceAllocator(vst);
 }
 
-// -----------------------------------------------------------------------------
-// 7) MIDI Handling
-// -----------------------------------------------------------------------------
-static void handleMidiEvent(MyOPL3VST* vst, VstMidiEvent& midiEvent)
+// Applies the parameters changed since the last block. Only the register groups those
+// parameters feed are recomputed, and only bytes that actually changed are written.
+static void flushParameterChanges(MyOPL3VST* vst)
 {
-    // Cast from char* to unsigned char* safely with a local array
-    unsigned char data[3];
-    data[0] = (unsigned char)midiEvent.midiData[0];
-    data[1] = (unsigned char)midiEvent.midiData[1];
-    data[2] = (unsigned char)midiEvent.midiData[2];
-    
-    unsigned char status = data[0] & 0xF0;
-    // Save this variable even if unused to avoid the warning
-    unsigned char channel = data[0] & 0x0F; 
-    unused(channel); // Mark as used to suppress warning
-    
-    unsigned char d1 = data[1];
-    unsigned char d2 = data[2];
+    vst->stats.lastBlockRegWrites = 0;
+    vst->stats.lastBlockRegWritesAvoided = 0;
+    ParameterMailbox* mailbox = vst->mailbox;
+    if (mailbox->changes.load(std::memory_order_relaxed) == 0) return;
+    int changes = mailbox->changes.exchange(0, std::memory_order_relaxed);
 
-    switch (status)
-    {
-        case 0x90: // note on
-        {
-            if (d2 > 0) {
-                // find a free voice
-                for (int i = 0; i < MAX_VOICES; i++) {
-                    if (!vst->voices[i].active) {
-                        vst->voices[i].active = true;
-                        vst->voices[i].midiNote = d1;
-                        float freq = 440.f * powf(2.f, (d1 - 69) / 12.f);
-                        vst->voices[i].frequency = freq;
-                        // Turn on channel i (or voices[i].channelIndex).
-                        int ch = vst->voices[i].channelIndex;
-                        int bank = (ch < 9) ? 0 : 1;
-                        int chInBank = ch % 9;
-
-                        // compute a rough F-Number for OPL3
-                        // Pick an appropriate block (octave) based on the MIDI note
-                        int block = (d1 / 12) - 1;
-                        if (block < 0) block = 0;
-                        if (block > 7) block = 7;
-                        
-                        // This formula is approximate
-                        double fNumDouble = freq * (1 << (20 - block)) / vst->sampleRate;
-                        int fNum = (int)fNumDouble & 0x3FF; // 10 bits
-                        
-                        unsigned char lowF = (unsigned char)(fNum & 0xFF);
-                        unsigned char highF = (unsigned char)(((fNum >> 8) & 3) | (block << 2) | 0x20); // 0x20 => key on
-
-                        // Create composite register values
-                        uint16_t regA0 = (bank << 8) | (0xA0 + chInBank);
-                        uint16_t regB0 = (bank << 8) | (0xB0 + chInBank);
-                        
-                        // Write to A0/B0 regs
-                        OPL3_WriteReg(&vst->chip, regA0, lowF);
-                        OPL3_WriteReg(&vst->chip, regB0, highF);
-
-                        break;
-                    }
+    // Take the flagged values. A value posted after its flag was taken here sets the
+    // flag again and is picked up (again) next block, so no change is ever lost.
+    uint32_t dirtyParams[(kNumVSTParams + 31) / 32];
+    for (int i = 0; i < (kNumVSTParams + 31) / 32; i++) {
+        dirtyParams[i] = mailbox->dirty[i].exchange(0, std::memory_order_acquire);
+    }
+
+    // A new Smoothing time already applies to the parameters changed along with it
+    if (dirtyParams[kVST_Smoothing / 32] & (1u << (kVST_Smoothing % 32))) {
+        vst->smoothingMs = getSmoothingTime(mailbox->values[kVST_Smoothing].load(std::memory_order_relaxed));
+    }
+
+    // A restored chunk replaces every value outright, glides included
+    bool jump = mailbox->jump.load(std::memory_order_relaxed) && mailbox->jump.exchange(false, std::memory_order_relaxed);
+    if (jump) {
+        for (int i = 0; i < kNumParts * kNumSmoothedParams; i++) {
+            vst->smoothers[i / kNumSmoothedParams][i % kNumSmoothedParams].framesLeft = 0;
+        }
+        vst->numSmoothing = 0;
+    }
+
+    // A restored chunk or an imported bank file brings new programs, compiled here once
+    if (mailbox->bankChanged.load(std::memory_order_relaxed) && mailbox->bankChanged.exchange(false, std::memory_order_acquire)) {
+        for (int n = 0; n < kNumPrograms; n++) {
+            syncProgram(vst, n);
+        }
+        for (int part = 0; part < kNumParts; part++) {
+            vst->parts[part].program = mailbox->partPrograms[part].load(std::memory_order_relaxed);
+        }
+    }
+
+    // Programs picked by the host, ahead of any edits made to them since. Edits made
+    // to the program a part leaves are taken from the host's bank first.
+    uint32_t programChanges = mailbox->programChanges.exchange(0, std::memory_order_acquire);
+    for (int part = 0; programChanges != 0; part++, programChanges >>= 1) {
+        if (programChanges & 1) {
+            syncProgram(vst, vst->parts[part].program);
+            setPartProgram(vst, part, mailbox->partPrograms[part].load(std::memory_order_relaxed));
+        }
+    }
+
+    // Patch parameters, part by part. setParameter edited the part's program in the
+    // host's bank as well, which the bank here then follows.
+    bool dirtyGroups[kNumRegGroups] = {};
+    int glides = 0;
+    for (int part = 0; part < kNumParts; part++) {
+        uint64_t dirty = mailbox->patchDirty[part].exchange(0, std::memory_order_acquire);
+        if (dirty == 0) continue;
+        for (int index = 0; dirty != 0; index++, dirty >>= 1) {
+            if (!(dirty & 1)) continue;
+            float value = mailbox->patchValues[part][index].load(std::memory_order_relaxed);
+            int slot = getSmoothedSlot(index);
+            if (slot >= 0 && !jump && startSmoothing(vst, part, slot, value)) {
+                glides++;
+                continue;  // the glide writes the registers from here on
+            }
+            vst->patches[part][index] = value;
+            dirtyGroups[getRegisterGroup(index)] = true;
+        }
+        compilePatchImage(vst->patches[part], vst->partImages[part]);
+        syncProgram(vst, vst->parts[part].program);
+    }
+
+    for (int index = kNumPatchParams; index < kNumVSTParams; index++) {
+        if (dirtyParams[index / 32] & (1u << (index % 32))) {
+            vst->currentSettings[index] = mailbox->values[index].load(std::memory_order_relaxed);
+            int group = getRegisterGroup(index);
+            if (index == kVST_RhythmMode) {
+                bool on = vst->currentSettings[index] > 0.5f;
+                if (on != vst->rhythmMode) {
+                    setRhythmMode(vst, on);
+                    // Channels 6-8 of chip 0 change between the drum kit and their parts
+                    for (int g = 0; g < kNumRegGroups; g++) dirtyGroups[g] = true;
                 }
             }
-            else {
-                // velocity=0 => treat as note off
-                // handle same as 0x80
-                for (int i = 0; i < MAX_VOICES; i++) {
-                    if (vst->voices[i].active && vst->voices[i].midiNote == d1) {
-                        int ch = vst->voices[i].channelIndex;
-                        int bank = (ch < 9) ? 0 : 1;
-                        int chInBank = ch % 9;
-                        
-                        // Read existing value to preserve block/fnum
-                        unsigned char highF = 0;
-                        // Clear the key-on bit
-                        highF &= ~0x20;
-                        
-                        // Create composite register value
-                        uint16_t regB0 = (bank << 8) | (0xB0 + chInBank);
-                        OPL3_WriteReg(&vst->chip, regB0, highF);
-                        vst->voices[i].active = false;
-                    }
+            else if (group >= 0) {
+                dirtyGroups[group] = true;
+            }
+            else if (index == kVST_Resampler) {
+                int mode = getResamplerMode(vst->currentSettings[index]);
+                if (mode != vst->resamplerMode) {
+                    vst->resamplerMode = mode;
+                    resetResampler(vst);
                 }
             }
-            break;
-        }
-        case 0x80: // note off
-        {
-            for (int i = 0; i < MAX_VOICES; i++) {
-                if (vst->voices[i].active && vst->voices[i].midiNote == d1) {
-                    int ch = vst->voices[i].channelIndex;
-                    int bank = (ch < 9) ? 0 : 1;
-                    int chInBank = ch % 9;
-
-                    // Read existing value to preserve block/fnum
-                    unsigned char highF = 0;
-                    // Clear the key-on bit
-                    highF &= ~0x20;
-                    
-                    // Create composite register value
-                    uint16_t regB0 = (bank << 8) | (0xB0 + chInBank);
-                    OPL3_WriteReg(&vst->chip, regB0, highF);
-                    vst->voices[i].active = false;
+            else if (index == kVST_Chips) {
+                int chips = getChipCount(vst->currentSettings[index]);
+                if (chips != vst->numChips) {
+                    setChipCount(vst, chips);
                 }
             }
-            break;
-        }
-        case 0xB0: // CC
-        {
-            // Handle common MIDI CCs here
-            switch (d1) {
-                case 120: // All Sound Off
-                case 123: // All Notes Off
-                    for (int i = 0; i < MAX_VOICES; i++) {
-                        if (vst->voices[i].active) {
-                            int ch = vst->voices[i].channelIndex;
-                            int bank = (ch < 9) ? 0 : 1;
-                            int chInBank = ch % 9;
-                            
-                            // Create composite register value
-                            uint16_t regB0 = (bank << 8) | (0xB0 + chInBank);
-                            OPL3_WriteReg(&vst->chip, regB0, 0);
-                            vst->voices[i].active = false;
-                        }
-                    }
-                    break;
-                // Add other CC handlers as needed
+            else if (index == kVST_Threads) {
+                vst->renderThreads = getThreadCount(vst->currentSettings[index]);
+            }
+            else if (index == kVST_Core) {
+                int core = getCore(vst->currentSettings[index]);
+                if (core != vst->core) {
+                    setCore(vst, core);
+                }
+            }
+            else if (index == kVST_IdleSkip) {
+                vst->idleSkip = getIdleSkip(vst->currentSettings[index]);
+                if (!vst->idleSkip) vst->awakeChips = ~0u;
+            }
+            else if (index == kVST_VoiceSteal) {
+                vst->stealPolicy = getStealPolicy(vst->currentSettings[index]);
+            }
+            else if (index == kVST_BendRange) {
+                // The default range: parts whose range came from RPN 0 keep it
+                for (int part = 0; part < kNumParts; part++) {
+                    if (vst->parts[part].rpnBendRange) continue;
+                    vst->parts[part].bendRangeCents = getBendRange(vst->currentSettings[index]) * 100;
+                    updatePitchBend(vst, part);
+                }
+            }
+            else if (index == kVST_Multi) {
+                vst->multiTimbral = getMultiTimbral(vst->currentSettings[index]);
+                // Queued bends may now belong to other parts
+                for (int part = 0; part < kNumParts; part++) {
+                    vst->parts[part].queuedBend = -1;
+                }
             }
-            break;
         }
-        case 0xE0: // Pitch bend
-        {
-            // TODO: Implement pitch bend by adjusting F-number
-            break;
+    }
+
+    int64 writesBefore = vst->stats.regWrites;
+    updateRegisterGroups(vst, dirtyGroups);
+
+    // Changes handed to a glide write nothing yet, and do not count as sweeps saved
+    int32 written = (int32)(vst->stats.regWrites - writesBefore);
+    int32 avoided = (changes - glides) * kFullRegisterSweep * vst->numChips - written;
+    if (avoided < 0) avoided = 0;
+    vst->stats.lastBlockRegWrites = written;
+    vst->stats.lastBlockRegWritesAvoided = avoided;
+    vst->stats.regWritesAvoided += avoided;
+}
+
+// Brings the per-operator parameter copies up to date and rewrites the dirty
+// register groups of every running chip
+static void updateRegisterGroups(MyOPL3VST* vst, const bool* dirtyGroups)
+{
+    applyVoiceSettingsToAllChannels(vst);
+    for (int chip = 0; chip < vst->numChips; chip++) {
+        for (int group = 0; group < kNumRegGroups; group++) {
+            if (dirtyGroups[group]) updateRegisterGroup(vst, chip, group);
         }
-        default:
-            // Other MIDI events can be handled here
-            break;
     }
-}
\ No newline at end of file
+}
+
+// Returns the SMOOTHED_PARAMS slot of a VST parameter, or -1 if it is not smoothed
+static int getSmoothedSlot(int index)
+{
+    for (int slot = 0; slot < kNumSmoothedParams; slot++) {
+        if (SMOOTHED_PARAMS[slot].index == index) return slot;
+    }
+    return -1;
+}
+
+// The register field value a smoothed parameter maps to
+static int getSmoothedLevel(int slot, float value)
+{
+    return (int)(value * (SMOOTHED_PARAMS[slot].levels - 0.001f));
+}
+
+// Starts a glide of a part's smoothed parameter towards value, from wherever it is
+// now. Returns false, leaving the caller to apply value at once, when the Smoothing
+// time is shorter than one glide step.
+static bool startSmoothing(MyOPL3VST* vst, int part, int slot, float value)
+{
+    ParamSmoother& smoother = vst->smoothers[part][slot];
+    int32_t frames = (int32_t)(vst->smoothingMs * 0.001f * vst->sampleRate);
+    if (frames < kSmoothInterval) {
+        if (smoother.framesLeft > 0) {
+            smoother.framesLeft = 0;
+            vst->numSmoothing--;
+        }
+        return false;
+    }
+
+    if (smoother.framesLeft == 0) {
+        smoother.value = vst->patches[part][SMOOTHED_PARAMS[slot].index];
+        if (vst->numSmoothing++ == 0) {
+            vst->smoothDelay = kSmoothInterval;
+        }
+    }
+    smoother.target = value;
+    smoother.step = (value - smoother.value) / frames;
+    smoother.framesLeft = frames;
+    return true;
+}
+
+// Moves every gliding parameter one step on. Registers are only rewritten when the
+// quantized value of a parameter changes, so most steps write nothing at all.
+static void advanceSmoothing(MyOPL3VST* vst)
+{
+    bool dirtyGroups[kNumRegGroups] = {};
+    bool changedParts[kNumParts] = {};
+    bool changed = false;
+    for (int i = 0; i < kNumParts * kNumSmoothedParams; i++) {
+        int part = i / kNumSmoothedParams;
+        int slot = i % kNumSmoothedParams;
+        ParamSmoother& smoother = vst->smoothers[part][slot];
+        if (smoother.framesLeft == 0) continue;
+
+        smoother.framesLeft -= kSmoothInterval;
+        if (smoother.framesLeft <= 0) {
+            smoother.framesLeft = 0;
+            smoother.value = smoother.target;
+            vst->numSmoothing--;
+        } else {
+            smoother.value += smoother.step * kSmoothInterval;
+        }
+
+        int index = SMOOTHED_PARAMS[slot].index;
+        if (getSmoothedLevel(slot, smoother.value) != getSmoothedLevel(slot, vst->patches[part][index])) {
+            dirtyGroups[getRegisterGroup(index)] = true;
+            changedParts[part] = true;
+            changed = true;
+        }
+        vst->patches[part][index] = smoother.value;
+    }
+    vst->smoothDelay = kSmoothInterval;
+
+    if (changed) {
+        for (int part = 0; part < kNumParts; part++) {
+            if (changedParts[part]) compilePatchImage(vst->patches[part], vst->partImages[part]);
+        }
+        updateRegisterGroups(vst, dirtyGroups);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 6) processReplacing callback: Generate audio from OPL3
+// -----------------------------------------------------------------------------
+static void processReplacing(AEffect* effect, float** inputs, float** outputs, int32_t sampleFrames)
+{
+    MyOPL3VST* vst = (MyOPL3VST*)effect->object;
+
+    float* outL = outputs[0];
+    float* outR = outputs[1];
+
+    // A new host rate is taken over unless effSetSampleRate is still designing
+    // its filters; then it waits for the next block
+    ParameterMailbox* mailbox = vst->mailbox;
+    if (mailbox->rateChanged.load(std::memory_order_acquire) && mailbox->rateLock.try_lock()) {
+        vst->sampleRate = mailbox->sampleRate.load(std::memory_order_relaxed);
+        memcpy(vst->resampleCoefs, mailbox->resampleCoefs, sizeof(vst->resampleCoefs));
+        mailbox->rateChanged.store(false, std::memory_order_relaxed);
+        mailbox->rateLock.unlock();
+        setOutputRate(vst);
+    }
+
+    // Parameter changes from setParameter reach the chip here, once per block
+    flushParameterChanges(vst);
+    vst->stats.blocks++;
+
+    // Processing was stopped since the last block: every note is released
+    if (vst->mailbox->releaseAll.load(std::memory_order_relaxed) &&
+        vst->mailbox->releaseAll.exchange(false, std::memory_order_acquire)) {
+        releaseAllVoices(vst);
+    }
+
+    // Released voices whose envelopes have died away become idle
+    updateReleasingVoices(vst);
+
+    // Render in sub-blocks between event offsets so every queued event
+    // takes effect on its exact sample
+    int32_t pos = 0;
+    int ev = 0;
+    while (pos < sampleFrames) {
+        // Apply every event that is due at this position
+        while (ev < vst->numQueuedEvents && vst->eventQueue[ev].deltaFrames <= pos) {
+            handleMidiEvent(vst, vst->eventQueue[ev]);
+            ev++;
+        }
+        // Drum key-ons and key-offs due here go out in a single 0xBD write
+        if (vst->drumKeysDirty) writeDrumKeys(vst);
+
+        // Render up to the next event or the end of the block
+        int32_t end = sampleFrames;
+        if (ev < vst->numQueuedEvents && vst->eventQueue[ev].deltaFrames < end) {
+            end = vst->eventQueue[ev].deltaFrames;
+        }
+        // ...or up to the point where stolen voices get their key-on
+        if ((vst->numPendingKeyOns > 0 || vst->drumRetrigger) && pos + vst->keyOnDelay < end) {
+            end = pos + vst->keyOnDelay;
+        }
+        // ...or up to the next step of the gliding parameters
+        if (vst->numSmoothing > 0 && pos + vst->smoothDelay < end) {
+            end = pos + vst->smoothDelay;
+        }
+        // ...or up to the next check for silent chips
+        if (pos + vst->idleDelay < end) {
+            end = pos + vst->idleDelay;
+        }
+        renderFrames(vst, outL + pos, outR + pos, end - pos);
+        vst->framesRendered += end - pos;
+
+        if (vst->numPendingKeyOns > 0 || vst->drumRetrigger) {
+            vst->keyOnDelay -= end - pos;
+            if (vst->keyOnDelay <= 0) applyPendingKeyOns(vst);
+        }
+        if (vst->numSmoothing > 0) {
+            vst->smoothDelay -= end - pos;
+            if (vst->smoothDelay <= 0) advanceSmoothing(vst);
+        }
+        vst->idleDelay -= end - pos;
+        if (vst->idleDelay <= 0) updateIdleChips(vst);
+        pos = end;
+    }
+
+    // Events with an offset past the end of the block still get applied
+    while (ev < vst->numQueuedEvents) {
+        handleMidiEvent(vst, vst->eventQueue[ev]);
+        ev++;
+    }
+    if (vst->drumKeysDirty) writeDrumKeys(vst);
+    vst->numQueuedEvents = 0;
+    for (int part = 0; part < kNumParts; part++) {
+        vst->parts[part].queuedBend = vst->parts[part].bendValue;
+    }
+}
+
+static void renderFrames(MyOPL3VST* vst, float* outL, float* outR, int32_t numFrames)
+{
+    if (vst->resamplerMode != kResamplerNuked) {
+        renderResampled(vst, outL, outR, numFrames);
+        return;
+    }
+
+    // Nothing to emulate until the next key-on or register write
+    if (allChipsIdle(vst)) {
+        memset(outL, 0, numFrames * sizeof(float));
+        memset(outR, 0, numFrames * sizeof(float));
+        vst->stats.framesSkipped += (int64)numFrames * vst->numChips;
+        return;
+    }
+
+    while (numFrames > 0) {
+        int32_t chunk = numFrames < kRenderBlockFrames ? numFrames : kRenderBlockFrames;
+
+        // Generate a run of stereo samples at the host rate, then convert them in one pass
+        generateChips(vst, chunk, false);
+        mixChipsToFloat(vst, outL, outR, chunk);
+
+        outL += chunk;
+        outR += chunk;
+        numFrames -= chunk;
+    }
+}
+
+// Fills chipBuffers with numFrames frames from every active chip, either through
+// Nuked's resampler at the host rate or at the chip's native rate. With more than
+// one render thread the chips are split between the audio thread and the workers.
+static void generateChips(MyOPL3VST* vst, int32_t numFrames, bool nativeRate)
+{
+    for (int c = 0; c < vst->numChips; c++) {
+        if (!(vst->awakeChips & (1u << c))) vst->stats.framesSkipped += numFrames;
+    }
+
+    int threads = getActiveRenderThreads(vst, numFrames);
+    if (threads > 1) {
+        dispatchRenderJob(vst, threads, numFrames, nativeRate);
+        return;
+    }
+    renderChipShare(vst, 0, 1, numFrames, nativeRate);
+}
+
+// Renders chips first, first + stride, ... into their buffers
+static void renderChipShare(MyOPL3VST* vst, int first, int stride, int32_t numFrames, bool nativeRate)
+{
+    for (int c = first; c < vst->numChips; c += stride) {
+        if (!(vst->awakeChips & (1u << c))) {
+            memset(vst->chipBuffers[c], 0, numFrames * 2 * sizeof(int16_t));
+        } else if (vst->core == kCoreFast) {
+            renderFastChip(vst, c, numFrames, nativeRate);
+        } else if (nativeRate) {
+            for (int32_t i = 0; i < numFrames; i++) {
+                OPL3_Generate(&vst->chips[c], vst->chipBuffers[c] + i * 2);
+            }
+        } else {
+            OPL3_GenerateStream(&vst->chips[c], vst->chipBuffers[c], (uint32_t)numFrames);
+        }
+    }
+}
+
+// True when no running chip is being emulated
+static bool allChipsIdle(MyOPL3VST* vst)
+{
+    return (vst->awakeChips & ((1u << vst->numChips) - 1)) == 0;
+}
+
+// Puts the chips that have gone silent to sleep, with Idle Skip on. A chip is silent
+// when it holds no note and every one of its slots is keyed off with its envelope at
+// full attenuation, and a sleeping chip outputs zeros until a register write wakes
+// it. That is not exact: a silent operator still outputs -1 on the negative half of
+// its waveform, and the LFOs, noise and envelope timers stop while the chip sleeps,
+// so a note started after a sleep can differ in its last bits. Idle Skip is off by
+// default for that reason.
+static void updateIdleChips(MyOPL3VST* vst)
+{
+    vst->idleDelay = kIdleCheckInterval;
+    if (!vst->idleSkip) return;
+
+    // Chips with a held note or a sounding drum stay awake without a closer look
+    uint32_t busy = vst->drumKeys ? 1u : 0u;
+    for (int v = vst->heldVoices.head; v != -1; v = vst->voices[v].next) {
+        busy |= 1u << vst->voices[v].chipIndex;
+    }
+
+    for (int c = 0; c < vst->numChips; c++) {
+        uint32_t bit = 1u << c;
+        if (!(vst->awakeChips & bit) || (busy & bit)) continue;
+        bool silent = true;
+        for (int s = 0; s < OPL3_TOTAL_OPERATORS && silent; s++) {
+            silent = !isSlotKeyed(vst, c, s) && getSlotEnvelope(vst, c, s) >= 0x1FF;
+        }
+        if (silent) vst->awakeChips &= ~bit;
+    }
+}
+
+// Sums the chip buffers and converts the result to float. A single chip is
+// converted directly; several chips are summed in int32 first so that the
+// mix never clips before the conversion.
+static void mixChipsToFloat(MyOPL3VST* vst, float* outL, float* outR, int32_t numFrames)
+{
+    if (vst->numChips == 1) {
+        kernels->deinterleave(vst->chipBuffers[0], outL, outR, numFrames);
+        return;
+    }
+    kernels->sumChips(vst->mixBuffer, vst->chipBuffers, vst->numChips, numFrames * 2);
+    kernels->convertMix(vst->mixBuffer, outL, outR, numFrames);
+}
+
+static void sumChips(int32_t* mix, const int16_t (*chips)[kRenderBlockFrames * 2], int numChips, int32_t numSamples)
+{
+    for (int32_t i = 0; i < numSamples; i++) {
+        mix[i] = chips[0][i];
+    }
+    for (int c = 1; c < numChips; c++) {
+        const int16_t* in = chips[c];
+        int32_t i = 0;
+#if defined(__SSE2__)
+        for (; i + 8 <= numSamples; i += 8) {
+            __m128i pcm = _mm_loadu_si128((const __m128i*)(in + i));
+            __m128i lo  = _mm_srai_epi32(_mm_unpacklo_epi16(pcm, pcm), 16);
+            __m128i hi  = _mm_srai_epi32(_mm_unpackhi_epi16(pcm, pcm), 16);
+            __m128i* sum = (__m128i*)(mix + i);
+            _mm_storeu_si128(sum,     _mm_add_epi32(_mm_loadu_si128(sum), lo));
+            _mm_storeu_si128(sum + 1, _mm_add_epi32(_mm_loadu_si128(sum + 1), hi));
+        }
+#endif
+        for (; i < numSamples; i++) {
+            mix[i] += in[i];
+        }
+    }
+}
+
+static void convertMixToFloat(const int32_t* mix, float* outL, float* outR, int32_t numFrames)
+{
+    const float scale = 1.f / 32768.f;
+    int32_t i = 0;
+#if defined(__SSE2__)
+    const __m128 vscale = _mm_set1_ps(scale);
+    for (; i + 4 <= numFrames; i += 4) {
+        __m128 flo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(mix + i * 2))), vscale);
+        __m128 fhi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(mix + i * 2 + 4))), vscale);
+        _mm_storeu_ps(outL + i, _mm_shuffle_ps(flo, fhi, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(outR + i, _mm_shuffle_ps(flo, fhi, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+#endif
+    for (; i < numFrames; i++) {
+        outL[i] = (float)mix[i * 2] * scale;
+        outR[i] = (float)mix[i * 2 + 1] * scale;
+    }
+}
+
+static void deinterleaveToFloat(const int16_t* in, float* outL, float* outR, int32_t numFrames)
+{
+    const float scale = 1.f / 32768.f;
+    int32_t i = 0;
+
+#if defined(__SSE2__)
+    // 4 frames per iteration: sign-extend L/R pairs to int32, convert, then split the channels
+    const __m128 vscale = _mm_set1_ps(scale);
+    for (; i + 4 <= numFrames; i += 4) {
+        __m128i pcm = _mm_loadu_si128((const __m128i*)(in + i * 2));
+        __m128i lo  = _mm_srai_epi32(_mm_unpacklo_epi16(pcm, pcm), 16); // L0 R0 L1 R1
+        __m128i hi  = _mm_srai_epi32(_mm_unpackhi_epi16(pcm, pcm), 16); // L2 R2 L3 R3
+        __m128 flo  = _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale);
+        __m128 fhi  = _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale);
+        _mm_storeu_ps(outL + i, _mm_shuffle_ps(flo, fhi, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(outR + i, _mm_shuffle_ps(flo, fhi, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+#endif
+
+    for (; i < numFrames; i++) {
+        outL[i] = (float)in[i * 2] * scale;
+        outR[i] = (float)in[i * 2 + 1] * scale;
+    }
+}
+
+#if defined(CNUKED_AVX2_KERNELS)
+// Splits 8 converted frames, L0 R0 .. L3 R3 and L4 R4 .. L7 R7, into the channels.
+// The in-lane shuffle leaves L0 L1 L4 L5 L2 L3 L6 L7, which the permute puts in order.
+KERNEL_AVX2 static inline void storeChannelsAvx2(__m256 flo, __m256 fhi, float* outL, float* outR)
+{
+    __m256 left = _mm256_shuffle_ps(flo, fhi, _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 right = _mm256_shuffle_ps(flo, fhi, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm256_storeu_ps(outL, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(left), _MM_SHUFFLE(3, 1, 2, 0))));
+    _mm256_storeu_ps(outR, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(right), _MM_SHUFFLE(3, 1, 2, 0))));
+}
+
+// The three kernels above, 8 frames per iteration
+KERNEL_AVX2 static void deinterleaveToFloatAvx2(const int16_t* in, float* outL, float* outR, int32_t numFrames)
+{
+    const float scale = 1.f / 32768.f;
+    const __m256 vscale = _mm256_set1_ps(scale);
+    int32_t i = 0;
+    for (; i + 8 <= numFrames; i += 8) {
+        __m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i * 2)));
+        __m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i * 2 + 8)));
+        storeChannelsAvx2(_mm256_mul_ps(_mm256_cvtepi32_ps(lo), vscale),
+                          _mm256_mul_ps(_mm256_cvtepi32_ps(hi), vscale), outL + i, outR + i);
+    }
+    for (; i < numFrames; i++) {
+        outL[i] = (float)in[i * 2] * scale;
+        outR[i] = (float)in[i * 2 + 1] * scale;
+    }
+}
+
+KERNEL_AVX2 static void sumChipsAvx2(int32_t* mix, const int16_t (*chips)[kRenderBlockFrames * 2], int numChips, int32_t numSamples)
+{
+    // Each run of 8 samples is summed across the chips in a register and stored once
+    int32_t i = 0;
+    for (; i + 8 <= numSamples; i += 8) {
+        __m256i sum = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(chips[0] + i)));
+        for (int c = 1; c < numChips; c++) {
+            sum = _mm256_add_epi32(sum, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(chips[c] + i))));
+        }
+        _mm256_storeu_si256((__m256i*)(mix + i), sum);
+    }
+    for (; i < numSamples; i++) {
+        int32_t sum = chips[0][i];
+        for (int c = 1; c < numChips; c++) sum += chips[c][i];
+        mix[i] = sum;
+    }
+}
+
+KERNEL_AVX2 static void convertMixToFloatAvx2(const int32_t* mix, float* outL, float* outR, int32_t numFrames)
+{
+    const float scale = 1.f / 32768.f;
+    const __m256 vscale = _mm256_set1_ps(scale);
+    int32_t i = 0;
+    for (; i + 8 <= numFrames; i += 8) {
+        __m256 flo = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(mix + i * 2))), vscale);
+        __m256 fhi = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(mix + i * 2 + 8))), vscale);
+        storeChannelsAvx2(flo, fhi, outL + i, outR + i);
+    }
+    for (; i < numFrames; i++) {
+        outL[i] = (float)mix[i * 2] * scale;
+        outR[i] = (float)mix[i * 2 + 1] * scale;
+    }
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// 7) MIDI Handling
+// -----------------------------------------------------------------------------
+static bool isNoteOn(const VstMidiEvent& midiEvent)
+{
+    return (midiEvent.midiData[0] & 0xF0) == 0x90 && (midiEvent.midiData[2] & 0x7F) != 0;
+}
+
+// Frees a place in the full queue for an event that is not a note-on. The latest
+// queued note-on is dropped; with none queued, the earliest event is applied now,
+// ahead of its offset, which keeps every event and their order.
+static void makeQueueRoom(MyOPL3VST* vst)
+{
+    int n = vst->numQueuedEvents;
+    int drop = n - 1;
+    while (drop >= 0 && !isNoteOn(vst->eventQueue[drop])) drop--;
+    if (drop >= 0) {
+        vst->stats.notesDropped++;
+    } else {
+        drop = 0;
+        handleMidiEvent(vst, vst->eventQueue[0]);
+    }
+    memmove(&vst->eventQueue[drop], &vst->eventQueue[drop + 1], (n - 1 - drop) * sizeof(VstMidiEvent));
+    vst->numQueuedEvents--;
+}
+
+static void queueMidiEvent(MyOPL3VST* vst, const VstMidiEvent& midiEvent)
+{
+    if (vst->numQueuedEvents >= kMaxQueuedEvents) {
+        if (isNoteOn(midiEvent)) {
+            vst->stats.notesDropped++;
+            return;
+        }
+        makeQueueRoom(vst);
+    }
+
+    // Hosts normally deliver events in time order, so the insertion point is
+    // almost always the end of the queue. Equal offsets keep their arrival order.
+    int32_t delta = midiEvent.deltaFrames > 0 ? midiEvent.deltaFrames : 0;
+    int last = vst->numQueuedEvents - 1;
+
+    // Pitch bends are coalesced: a bend that repeats the value already in effect for
+    // its part is dropped, and a bend on the same frame as a bend queued just before
+    // it on the same MIDI channel replaces it
+    if ((midiEvent.midiData[0] & 0xF0) == 0xE0) {
+        PartState& state = vst->parts[getPart(vst, midiEvent.midiData[0] & 0x0F)];
+        int value = (midiEvent.midiData[1] & 0x7F) | ((midiEvent.midiData[2] & 0x7F) << 7);
+        if (last < 0 || vst->eventQueue[last].deltaFrames <= delta) {
+            if (value == state.queuedBend) return;
+            state.queuedBend = value;
+            if (last >= 0 && vst->eventQueue[last].deltaFrames == delta &&
+                vst->eventQueue[last].midiData[0] == midiEvent.midiData[0]) {
+                vst->eventQueue[last] = midiEvent;
+                vst->eventQueue[last].deltaFrames = delta;
+                return;
+            }
+        } else {
+            // Out of order: the bend in effect at the end of the block is no longer known
+            state.queuedBend = -1;
+        }
+    }
+
+    int pos = vst->numQueuedEvents;
+    while (pos > 0 && vst->eventQueue[pos - 1].deltaFrames > delta) {
+        vst->eventQueue[pos] = vst->eventQueue[pos - 1];
+        pos--;
+    }
+    vst->eventQueue[pos] = midiEvent;
+    vst->eventQueue[pos].deltaFrames = delta;
+    vst->numQueuedEvents++;
+}
+
+static void handleMidiEvent(MyOPL3VST* vst, VstMidiEvent& midiEvent)
+{
+    // Cast from char* to unsigned char* safely with a local array
+    unsigned char data[3];
+    data[0] = (unsigned char)midiEvent.midiData[0];
+    data[1] = (unsigned char)midiEvent.midiData[1];
+    data[2] = (unsigned char)midiEvent.midiData[2];
+    
+    unsigned char status = data[0] & 0xF0;
+    unsigned char channel = data[0] & 0x0F; 
+    int part = getPart(vst, channel);
+    PartState& state = vst->parts[part];
+    
+    unsigned char d1 = data[1] & 0x7F;
+    unsigned char d2 = data[2] & 0x7F;
+
+    // In rhythm mode the notes of MIDI channel 10 play the drum kit. Its other
+    // messages still reach the part.
+    bool drumChannel = vst->rhythmMode && channel == kDrumMidiChannel;
+    if (drumChannel && (status == 0x80 || status == 0x90)) {
+        handleDrumNote(vst, status, d1, d2);
+        return;
+    }
+
+    switch (status)
+    {
+        case 0x90: // note on
+        {
+            if (d2 > 0) {
+                startVoice(vst, part, d1);
+            }
+            else {
+                // velocity=0 => treat as note off
+                // handle same as 0x80
+                while (state.noteVoices[d1] >= 0) {
+                    releaseVoice(vst, state.noteVoices[d1]);
+                }
+            }
+            break;
+        }
+        case 0x80: // note off
+        {
+            // Every voice of this part holding this note is released
+            while (state.noteVoices[d1] >= 0) {
+                releaseVoice(vst, state.noteVoices[d1]);
+            }
+            break;
+        }
+        case 0xB0: // CC
+        {
+            // Handle common MIDI CCs here
+            switch (d1) {
+                case 120: // All Sound Off
+                case 123: // All Notes Off
+                    if (vst->multiTimbral) releasePartVoices(vst, part);
+                    else releaseAllVoices(vst);
+                    if (drumChannel) releaseDrums(vst);
+                    break;
+                case 121: // Reset All Controllers
+                    state.rpnMsb = state.rpnLsb = 127;
+                    setPitchBend(vst, part, kBendCenter);
+                    break;
+                case 101: // RPN MSB
+                    state.rpnMsb = d2;
+                    break;
+                case 100: // RPN LSB
+                    state.rpnLsb = d2;
+                    break;
+                case 99:  // NRPN MSB
+                case 98:  // NRPN LSB
+                    // Data entry now goes to an NRPN, none of which we implement
+                    state.rpnMsb = state.rpnLsb = 127;
+                    break;
+                case 6:   // Data Entry MSB
+                case 38:  // Data Entry LSB
+                    handleDataEntry(vst, part, d1, d2);
+                    break;
+                // Add other CC handlers as needed
+            }
+            break;
+        }
+        case 0xC0: // Program change
+        {
+            setPartProgram(vst, part, d1);
+            publishPartPatch(vst, part);
+            break;
+        }
+        case 0xE0: // Pitch bend
+        {
+            setPitchBend(vst, part, d1 | (d2 << 7));
+            break;
+        }
+        default:
+            // Other MIDI events can be handled here
+            break;
+    }
+}
+
+// Voices are kept on three lists: idle voices whose channels are silent, released
+// voices whose envelope tails are still sounding, both in the order they got
+// there, and held voices in note-on order, so the oldest note is at the head.
+// Each part's noteVoices chains its held voices of each MIDI note. Note-on and
+// note-off are constant time; only the Quietest policy scans the held voices, and
+// only when a voice has to be stolen.
+static int getPart(MyOPL3VST* vst, int midiChannel)
+{
+    return vst->multiTimbral ? midiChannel : 0;
+}
+
+static void listAppend(MyOPL3VST* vst, VoiceList& list, int v)
+{
+    vst->voices[v].prev = list.tail;
+    vst->voices[v].next = -1;
+    if (list.tail >= 0) vst->voices[list.tail].next = v;
+    else list.head = v;
+    list.tail = v;
+}
+
+static void listRemove(MyOPL3VST* vst, VoiceList& list, int v)
+{
+    VoiceInfo& voice = vst->voices[v];
+    if (voice.prev >= 0) vst->voices[voice.prev].next = voice.next;
+    else list.head = voice.next;
+    if (voice.next >= 0) vst->voices[voice.next].prev = voice.prev;
+    else list.tail = voice.prev;
+    voice.prev = voice.next = -1;
+}
+
+// Takes a voice out of its note's chain. The chain is almost always one voice long.
+static void unlinkNote(MyOPL3VST* vst, int v)
+{
+    int* link = &vst->parts[vst->voices[v].part].noteVoices[vst->voices[v].midiNote];
+    while (*link >= 0 && *link != v) {
+        link = &vst->voices[*link].nextSameNote;
+    }
+    if (*link == v) *link = vst->voices[v].nextSameNote;
+    vst->voices[v].nextSameNote = -1;
+}
+
+// Register address of a channel register type (0xA0, 0xB0, 0xC0) for channel ch
+static uint16_t getChannelRegister(int ch, int base)
+{
+    int bank = (ch < 9) ? 0 : 1;
+    int chInBank = ch % 9;
+    return (uint16_t)((bank << 8) | (base + chInBank));
+}
+
+// Fills pitchTable. F-numbers count in units of the chip's own clock, so the table
+// does not depend on the host rate and is built once per instance. Each pitch gets
+// the lowest block whose F-number still fits in 10 bits, which keeps the most
+// F-number precision.
+static void buildPitchTable(MyOPL3VST* vst)
+{
+    for (int pitch = 0; pitch < kNumPitches; pitch++) {
+        double freq = 440.0 * pow(2.0, ((double)pitch / kPitchSteps - 69.0) / 12.0);
+        int block = 0;
+        int fNum = (int)(freq * (1 << 20) / OPL3_NATIVE_RATE + 0.5);
+        while (fNum > 0x3FF && block < 7) {
+            block++;
+            fNum = (int)(freq * (1 << (20 - block)) / OPL3_NATIVE_RATE + 0.5);
+        }
+        if (fNum > 0x3FF) fNum = 0x3FF;
+        vst->pitchTable[pitch] = (uint16_t)((block << 10) | fNum);
+    }
+}
+
+// The pitch a note plays at under its part's current bend
+static int getBentPitch(MyOPL3VST* vst, int part, int midiNote)
+{
+    int pitch = midiNote * kPitchSteps + vst->parts[part].bendSteps;
+    if (pitch < 0) pitch = 0;
+    if (pitch > kNumPitches - 1) pitch = kNumPitches - 1;
+    return pitch;
+}
+
+// Writes a voice's pitch to its channel's A0/B0 registers with the key-on bit set
+static void keyOnVoice(MyOPL3VST* vst, int v)
+{
+    VoiceInfo& voice = vst->voices[v];
+    voice.pitch = getBentPitch(vst, voice.part, voice.midiNote);
+    uint16_t entry = vst->pitchTable[voice.pitch];
+
+    unsigned char lowF = (unsigned char)(entry & 0xFF);
+    unsigned char highF = (unsigned char)((entry >> 8) | 0x20); // 0x20 => key on
+
+    writeRegister(vst, voice.chipIndex, getChannelRegister(voice.channelIndex, 0xA0), lowF);
+    writeRegister(vst, voice.chipIndex, getChannelRegister(voice.channelIndex, 0xB0), highF);
+}
+
+// Clears the key-on bit. Block and F-number stay as they are so the release tail
+// keeps its pitch.
+static void keyOffVoice(MyOPL3VST* vst, int v)
+{
+    int chip = vst->voices[v].chipIndex;
+    uint16_t regB0 = getChannelRegister(vst->voices[v].channelIndex, 0xB0);
+    writeRegister(vst, chip, regB0, vst->regShadow[chip][regB0] & ~0x20);
+}
+
+// Loads the patch of a voice's part onto its channel, and onto its partner channel
+// for a 4-op voice, from the part's compiled image
+static void writeVoicePatch(MyOPL3VST* vst, int v)
+{
+    loadVoicePatch(vst, v);
+    writePatchImage(vst, v, vst->partImages[vst->voices[v].part]);
+}
+
+// Writes a compiled patch to a voice's channels. Only the operator and 0xC0 bytes
+// that differ from the shadow file are sent.
+static void writePatchImage(MyOPL3VST* vst, int v, const PatchImage& image)
+{
+    const VoiceInfo& voice = vst->voices[v];
+    int numChannels = voice.fourOp ? 2 : 1;
+    for (int n = 0; n < numChannels; n++) {
+        int ch = voice.channelIndex + n * 3;
+        for (int role = 0; role < 2; role++) {
+            std::pair<int, int> opBase = getOpBase(ch * 2 + role);
+            for (int reg = 0; reg < kNumOperatorRegs; reg++) {
+                uint16_t regAddr = (opBase.first << 8) | (OPERATOR_REG_BASES[reg] + opBase.second);
+                setRegister(vst, voice.chipIndex, regAddr, image.ops[n * 2 + role][reg]);
+            }
+        }
+        uint8_t c0 = voice.fourOp ? image.fourOpChannels[n] : image.channel;
+        setRegister(vst, voice.chipIndex, getChannelRegister(ch, 0xC0), c0);
+    }
+}
+
+// 4-op pairs: channels 0-2 of each register bank can be joined with the channel 3
+// above them. Returns the first channel's voice of the pair v belongs to, or -1 for
+// the three channels per bank that cannot be paired.
+static int getPairVoice(int v)
+{
+    int slot = (v % OPL3_CHANNEL_COUNT) % 9;
+    if (slot < 3) return v;
+    if (slot < 6) return v - 3;
+    return -1;
+}
+
+// The 0x104 connection select bit of the pair starting at channel ch
+static uint8_t getPairBit(int ch)
+{
+    return (uint8_t)(1 << ((ch / 9) * 3 + ch % 9));
+}
+
+// The 0x104 byte for the 4-op voices of a chip
+static uint8_t getFourOpMask(MyOPL3VST* vst, int chip)
+{
+    uint8_t mask = 0;
+    for (int ch = 0; ch < OPL3_CHANNEL_COUNT; ch++) {
+        if (vst->voices[chip * OPL3_CHANNEL_COUNT + ch].fourOp) mask |= getPairBit(ch);
+    }
+    return mask;
+}
+
+// Host frames after a key-off by which the chip is sure to have run a native sample
+static int32_t getKeyOffFrames(MyOPL3VST* vst)
+{
+    return (int32_t)(vst->sampleRate / OPL3_NATIVE_RATE) + 2;
+}
+
+// Takes a voice off whichever list it is on. A held voice is keyed off first and
+// true is returned: it needs a key-off sample before its next attack. So does a
+// voice released too recently for the chip to have run with its key off, as when
+// a note-off and the next note-on share a frame.
+static bool takeVoice(MyOPL3VST* vst, int v)
+{
+    VoiceInfo& voice = vst->voices[v];
+    if (voice.active) {
+        keyOffVoice(vst, v);
+        unlinkNote(vst, v);
+        listRemove(vst, vst->heldVoices, v);
+        voice.active = false;
+        return true;
+    }
+    if (voice.releasing) {
+        listRemove(vst, vst->releasingVoices, v);
+        voice.releasing = false;
+        return vst->framesRendered - voice.releasedAt < getKeyOffFrames(vst);
+    } else {
+        listRemove(vst, vst->idleVoices[voice.chipIndex], v);
+    }
+    return false;
+}
+
+// Makes v the first channel of a 4-op pair. The partner channel is taken off
+// whatever it was playing; returns true if it was holding a note.
+static bool pairVoice(MyOPL3VST* vst, int v)
+{
+    VoiceInfo& voice = vst->voices[v];
+    VoiceInfo& partner = vst->voices[v + 3];
+    bool held = takeVoice(vst, v + 3);
+    partner.keyOnPending = false;
+    partner.paired = true;
+    voice.fourOp = true;
+
+    int chip = voice.chipIndex;
+    setRegister(vst, chip, 0x104, vst->regShadow[chip][0x104] | getPairBit(voice.channelIndex));
+    return held;
+}
+
+// Turns a 4-op voice back into two 2-op channels. The partner may still be sounding
+// the end of the pair's release, so it joins the releasing list with the same note.
+static void splitVoice(MyOPL3VST* vst, int v)
+{
+    VoiceInfo& voice = vst->voices[v];
+    VoiceInfo& partner = vst->voices[v + 3];
+    int chip = voice.chipIndex;
+    setRegister(vst, chip, 0x104, vst->regShadow[chip][0x104] & ~getPairBit(voice.channelIndex));
+    voice.fourOp = false;
+    partner.paired = false;
+
+    // While paired, the chip kept the partner's pitch in step with the first channel
+    partner.part = voice.part;
+    partner.midiNote = voice.midiNote;
+    partner.pitch = voice.pitch;
+    uint16_t regA0 = getChannelRegister(voice.channelIndex, 0xA0);
+    uint16_t regB0 = getChannelRegister(voice.channelIndex, 0xB0);
+    setRegister(vst, chip, getChannelRegister(partner.channelIndex, 0xA0), vst->regShadow[chip][regA0]);
+    setRegister(vst, chip, getChannelRegister(partner.channelIndex, 0xB0), vst->regShadow[chip][regB0] & ~0x20);
+    writeVoicePatch(vst, v + 3);
+
+    partner.releasing = true;
+    partner.releasedAt = vst->framesRendered;
+    listAppend(vst, vst->releasingVoices, v + 3);
+}
+
+// Part of Idle Skip: with a single render thread, a note costs less on a chip that
+// is already being emulated than on one that is asleep (see updateIdleChips), so
+// idle voices are taken from the awake chips first. Spread over several threads,
+// notes are better left on every chip in turn.
+static bool packOntoAwakeChips(MyOPL3VST* vst)
+{
+    return vst->idleSkip && vst->renderThreads <= 1 && vst->numChips > 1 &&
+           (vst->awakeChips & ((1u << vst->numChips) - 1)) != 0;
+}
+
+// Puts a silent voice at the end of its chip's idle list
+static void addIdleVoice(MyOPL3VST* vst, int v)
+{
+    VoiceInfo& voice = vst->voices[v];
+    voice.idleSince = vst->idleCount++;
+    listAppend(vst, vst->idleVoices[voice.chipIndex], v);
+}
+
+// Picks the idle voice for a 2-op note: the one idle longest, on an awake chip if
+// notes are being packed. Only the head of each chip's list is looked at.
+static int findIdleVoice(MyOPL3VST* vst)
+{
+    uint32_t chips = packOntoAwakeChips(vst) ? vst->awakeChips : ~0u;
+    int found = -1;
+    for (int c = 0; c < vst->numChips; c++) {
+        int v = vst->idleVoices[c].head;
+        if (v < 0 || !(chips & (1u << c))) continue;
+        if (found < 0 || vst->voices[v].idleSince < vst->voices[found].idleSince) found = v;
+    }
+    if (found < 0 && chips != ~0u) {
+        for (int c = 0; c < vst->numChips; c++) {
+            int v = vst->idleVoices[c].head;
+            if (v >= 0 && (found < 0 || vst->voices[v].idleSince < vst->voices[found].idleSince)) found = v;
+        }
+    }
+    return found;
+}
+
+// Finds a pair of channels for a 4-op note: the pair idle longest with both channels
+// silent (on an awake chip if notes are being packed), else one with no held note,
+// cutting the oldest release tail, else the pair of the oldest held note. The steal
+// policy only applies to 2-op notes.
+static int findFourOpVoice(MyOPL3VST* vst)
+{
+    bool pack = packOntoAwakeChips(vst);
+    int found = -1;
+    bool foundAwake = false;
+    for (int c = 0; c < vst->numChips; c++) {
+        bool awake = !pack || (vst->awakeChips & (1u << c));
+        if (foundAwake && !awake) continue;
+        for (int v = vst->idleVoices[c].head; v >= 0; v = vst->voices[v].next) {
+            int p = getPairVoice(v);
+            if (p < 0) continue;
+            const VoiceInfo& first = vst->voices[p];
+            const VoiceInfo& partner = vst->voices[p + 3];
+            if (!first.active && !first.releasing &&
+                (partner.paired || (!partner.active && !partner.releasing))) {
+                if (found < 0 || (awake && !foundAwake) ||
+                    vst->voices[v].idleSince < vst->voices[found].idleSince) {
+                    found = v;
+                    foundAwake = awake;
+                }
+                break;  // the rest of this chip's list went idle later
+            }
+        }
+    }
+    if (found >= 0) return getPairVoice(found);
+    for (int v = vst->releasingVoices.head; v >= 0; v = vst->voices[v].next) {
+        int p = getPairVoice(v);
+        if (p >= 0 && !vst->voices[p].active && !vst->voices[p + 3].active) {
+            vst->stats.releaseTailsCut++;
+            return p;
+        }
+    }
+    for (int v = vst->heldVoices.head; v >= 0; v = vst->voices[v].next) {
+        int p = getPairVoice(v);
+        if (p >= 0) {
+            vst->stats.voiceSteals++;
+            return p;
+        }
+    }
+    return -1;
+}
+
+// A channel is silent once every operator that reaches the output has finished
+// its release: the carrier always, the modulator too in AM (additive) mode.
+// Which of a 4-op voice's operators reach the output depends on both channels'
+// connection bits: operator 4 always, 1 with the first bit set, 2 with only the
+// second set and 3 with both.
+static bool isVoiceSilent(MyOPL3VST* vst, int v)
+{
+    const VoiceInfo& voice = vst->voices[v];
+    int chip = voice.chipIndex;
+    int ch = voice.channelIndex;
+    bool con = vst->regShadow[chip][getChannelRegister(ch, 0xC0)] & 1;
+    if (voice.fourOp) {
+        bool partnerCon = vst->regShadow[chip][getChannelRegister(ch + 3, 0xC0)] & 1;
+        if (getSlotEnvelope(vst, chip, getChannelSlot(ch + 3, 1)) < 0x1FF) return false;
+        if (con && getSlotEnvelope(vst, chip, getChannelSlot(ch, 0)) < 0x1FF) return false;
+        if (!con && partnerCon && getSlotEnvelope(vst, chip, getChannelSlot(ch, 1)) < 0x1FF) return false;
+        if (con && partnerCon && getSlotEnvelope(vst, chip, getChannelSlot(ch + 3, 0)) < 0x1FF) return false;
+        return true;
+    }
+    if (getSlotEnvelope(vst, chip, getChannelSlot(ch, 1)) < 0x1FF) return false;
+    return !con || getSlotEnvelope(vst, chip, getChannelSlot(ch, 0)) >= 0x1FF;
+}
+
+// Rebuilds the voice lists for the running chips. Held and releasing voices keep
+// their order; voices on chips that stopped are dropped. Idle voices visit the
+// chips in turn so notes spread across them.
+static void resetVoiceAllocator(MyOPL3VST* vst)
+{
+    int held[MAX_VOICES], releasing[MAX_VOICES];
+    int numHeld = 0, numReleasing = 0;
+    for (int v = vst->heldVoices.head; v >= 0 && numHeld < MAX_VOICES; v = vst->voices[v].next) {
+        held[numHeld++] = v;
+    }
+    for (int v = vst->releasingVoices.head; v >= 0 && numReleasing < MAX_VOICES; v = vst->voices[v].next) {
+        releasing[numReleasing++] = v;
+    }
+
+    for (int c = 0; c < kMaxChips; c++) {
+        vst->idleVoices[c].head = vst->idleVoices[c].tail = -1;
+    }
+    vst->releasingVoices.head = vst->releasingVoices.tail = -1;
+    vst->heldVoices.head = vst->heldVoices.tail = -1;
+    for (int part = 0; part < kNumParts; part++) {
+        for (int n = 0; n < 128; n++) {
+            vst->parts[part].noteVoices[n] = -1;
+            vst->parts[part].lastNoteVoices[n] = -1;
+        }
+    }
+    for (int i = 0; i < MAX_VOICES; i++) {
+        vst->voices[i].prev = vst->voices[i].next = -1;
+        vst->voices[i].nextSameNote = -1;
+    }
+
+    for (int h = 0; h < numHeld; h++) {
+        VoiceInfo& voice = vst->voices[held[h]];
+        if (voice.active && voice.chipIndex < vst->numChips) {
+            PartState& state = vst->parts[voice.part];
+            listAppend(vst, vst->heldVoices, held[h]);
+            voice.nextSameNote = state.noteVoices[voice.midiNote];
+            state.noteVoices[voice.midiNote] = held[h];
+            state.lastNoteVoices[voice.midiNote] = held[h];
+        } else {
+            voice.active = false;
+            voice.keyOnPending = false;
+        }
+    }
+    for (int v = vst->numChips * OPL3_CHANNEL_COUNT; v < MAX_VOICES; v++) {
+        vst->voices[v].fourOp = false;  // pairs on stopped chips are gone
+        vst->voices[v].paired = false;
+    }
+    for (int r = 0; r < numReleasing; r++) {
+        VoiceInfo& voice = vst->voices[releasing[r]];
+        if (voice.releasing && voice.chipIndex < vst->numChips) {
+            listAppend(vst, vst->releasingVoices, releasing[r]);
+            vst->parts[voice.part].lastNoteVoices[voice.midiNote] = releasing[r];
+        } else {
+            voice.releasing = false;
+        }
+    }
+
+    int numVoices = vst->numChips * OPL3_CHANNEL_COUNT;
+    for (int n = 0; n < numVoices; n++) {
+        int i = (n % vst->numChips) * OPL3_CHANNEL_COUNT + n / vst->numChips;
+        if (!vst->voices[i].active && !vst->voices[i].releasing && !vst->voices[i].paired && !vst->voices[i].drum) {
+            addIdleVoice(vst, i);
+        }
+    }
+}
+
+// Picks the held voice to take over when no voice is idle
+static int chooseVictim(MyOPL3VST* vst)
+{
+    int victim = vst->heldVoices.head;
+    if (vst->stealPolicy != kStealQuietest) return victim;
+
+    // The carrier's envelope attenuation (0 = loudest, 511 = silent) tells which
+    // note is quietest; ties go to the oldest
+    int loudest = -1;
+    for (int v = vst->heldVoices.head; v >= 0; v = vst->voices[v].next) {
+        // A 4-op voice's last carrier is operator 4, in the partner channel
+        int ch = vst->voices[v].channelIndex + (vst->voices[v].fourOp ? 3 : 0);
+        int attenuation = getSlotAttenuation(vst, vst->voices[v].chipIndex, getChannelSlot(ch, 1));
+        if (attenuation > loudest) {
+            loudest = attenuation;
+            victim = v;
+        }
+    }
+    return victim;
+}
+
+// Allocates a voice for a part's note-on, loads the part's patch onto it and keys
+// it on. A 4-op patch needs a pair of channels (see findFourOpVoice); otherwise,
+// in order of preference:
+//   - the voice still releasing this same note of the part, which attacks again from
+//     its current level instead of leaving a second tail sounding next to the new note
+//   - a silent voice, preferably on a chip that is being emulated already
+//   - the voice released longest ago, whose tail is cut short
+//   - a held voice, chosen by the stealing policy
+// A held voice that is taken over is keyed off first; its key-on waits until the
+// chip has run with the key off, otherwise the envelope would carry on instead of
+// starting a new attack. The same goes for a voice released only just now.
+static void startVoice(MyOPL3VST* vst, int part, int midiNote)
+{
+    PartState& state = vst->parts[part];
+    bool fourOp = getFourOpMode(vst->patches[part][kVST_FourOp]) > 0;
+    int v = -1;
+    if (vst->stealPolicy == kStealSameNote) {
+        v = state.noteVoices[midiNote];
+    }
+    if (v < 0) {
+        int last = state.lastNoteVoices[midiNote];
+        if (last >= 0 && vst->voices[last].releasing && vst->voices[last].midiNote == midiNote &&
+            vst->voices[last].part == part) {
+            v = last;
+        }
+    }
+    if (v >= 0 && vst->voices[v].fourOp != fourOp) {
+        v = -1;  // the voice would have to be rebuilt anyway
+    }
+    if (v < 0 && fourOp) {
+        v = findFourOpVoice(vst);
+        if (v < 0) return;
+    }
+    if (v < 0) {
+        v = findIdleVoice(vst);
+    }
+    if (v < 0 && vst->releasingVoices.head >= 0) {
+        v = vst->releasingVoices.head;
+        vst->stats.releaseTailsCut++;
+    }
+    if (v < 0) {
+        v = chooseVictim(vst);
+        if (v < 0) return;
+        vst->stats.voiceSteals++;
+    }
+
+    VoiceInfo& voice = vst->voices[v];
+    bool retrigger = takeVoice(vst, v);
+    bool reload = voice.part != part || voice.fourOp != fourOp;
+    if (fourOp && !voice.fourOp) {
+        retrigger |= pairVoice(vst, v);
+    } else if (!fourOp && voice.fourOp) {
+        splitVoice(vst, v);
+    }
+
+    voice.active = true;
+    voice.part = part;
+    voice.midiNote = midiNote;
+    state.lastNoteVoices[midiNote] = v;
+    voice.nextSameNote = state.noteVoices[midiNote];
+    state.noteVoices[midiNote] = v;
+    listAppend(vst, vst->heldVoices, v);
+    if (reload) {
+        writeVoicePatch(vst, v);
+    }
+
+    if (!retrigger) {
+        keyOnVoice(vst, v);
+        return;
+    }
+
+    if (!voice.keyOnPending) {
+        voice.keyOnPending = true;
+        vst->pendingKeyOns[vst->numPendingKeyOns++] = v;
+    }
+    // Enough host frames for the chip to run at least one native sample
+    vst->keyOnDelay = getKeyOffFrames(vst);
+}
+
+// Keys a voice off and moves it to the back of the releasing list
+static void releaseVoice(MyOPL3VST* vst, int v)
+{
+    VoiceInfo& voice = vst->voices[v];
+    keyOffVoice(vst, v);
+    unlinkNote(vst, v);
+    listRemove(vst, vst->heldVoices, v);
+    listAppend(vst, vst->releasingVoices, v);
+    voice.active = false;
+    voice.keyOnPending = false;
+    voice.releasing = true;
+    voice.releasedAt = vst->framesRendered;
+}
+
+static void releasePartVoices(MyOPL3VST* vst, int part)
+{
+    int v = vst->heldVoices.head;
+    while (v >= 0) {
+        int next = vst->voices[v].next;
+        if (vst->voices[v].part == part) releaseVoice(vst, v);
+        v = next;
+    }
+}
+
+static void releaseAllVoices(MyOPL3VST* vst)
+{
+    while (vst->heldVoices.head >= 0) {
+        releaseVoice(vst, vst->heldVoices.head);
+    }
+    vst->numPendingKeyOns = 0;
+
+    // The drums are keyed off along with the notes
+    releaseDrums(vst);
+}
+
+// Moves released voices whose channels have gone silent to the idle list. The
+// envelope state is read from the chip, so a long Release setting keeps its voice
+// out of the idle list for exactly as long as the tail can be heard.
+static void updateReleasingVoices(MyOPL3VST* vst)
+{
+    int v = vst->releasingVoices.head;
+    while (v >= 0) {
+        int next = vst->voices[v].next;
+        if (isVoiceSilent(vst, v)) {
+            listRemove(vst, vst->releasingVoices, v);
+            addIdleVoice(vst, v);
+            vst->voices[v].releasing = false;
+        }
+        v = next;
+    }
+}
+
+// Moves a sounding voice to its note's current bent pitch. Only A0/B0 are touched,
+// the key-on bit is kept, and bytes equal to the shadow file are not resent.
+static void retuneVoice(MyOPL3VST* vst, int v)
+{
+    VoiceInfo& voice = vst->voices[v];
+    int pitch = getBentPitch(vst, voice.part, voice.midiNote);
+    if (pitch == voice.pitch) return;
+    voice.pitch = pitch;
+
+    uint16_t entry = vst->pitchTable[pitch];
+    uint16_t regA0 = getChannelRegister(voice.channelIndex, 0xA0);
+    uint16_t regB0 = getChannelRegister(voice.channelIndex, 0xB0);
+    setRegister(vst, voice.chipIndex, regA0, (uint8_t)(entry & 0xFF));
+    setRegister(vst, voice.chipIndex, regB0, (uint8_t)((entry >> 8) | (vst->regShadow[voice.chipIndex][regB0] & 0x20)));
+}
+
+static void setPitchBend(MyOPL3VST* vst, int part, int value)
+{
+    vst->parts[part].bendValue = value;
+    updatePitchBend(vst, part);
+}
+
+// Converts a part's bend to pitch steps and retunes every sounding voice of the
+// part, held or releasing. Bend values that round to the current step cost nothing.
+static void updatePitchBend(MyOPL3VST* vst, int part)
+{
+    PartState& state = vst->parts[part];
+    double steps = (double)(state.bendValue - kBendCenter) * state.bendRangeCents * kPitchSteps / (kBendCenter * 100.0);
+    int bendSteps = (int)floor(steps + 0.5);
+    if (bendSteps == state.bendSteps) return;
+    state.bendSteps = bendSteps;
+
+    for (int v = vst->heldVoices.head; v >= 0; v = vst->voices[v].next) {
+        if (vst->voices[v].part == part) retuneVoice(vst, v);
+    }
+    for (int v = vst->releasingVoices.head; v >= 0; v = vst->voices[v].next) {
+        if (vst->voices[v].part == part) retuneVoice(vst, v);
+    }
+}
+
+// Data entry for RPN 0 (pitch bend sensitivity): the MSB sets semitones, the LSB cents
+static void handleDataEntry(MyOPL3VST* vst, int part, int controller, int value)
+{
+    PartState& state = vst->parts[part];
+    if (state.rpnMsb != 0 || state.rpnLsb != 0) return;
+
+    int semitones = state.bendRangeCents / 100;
+    int cents = state.bendRangeCents % 100;
+    if (controller == 6) {
+        semitones = value;
+    } else {
+        cents = value < 100 ? value : 99;
+    }
+    state.bendRangeCents = semitones * 100 + cents;
+    state.rpnBendRange = true;
+    updatePitchBend(vst, part);
+}
+
+// Copies a program from the host's bank and compiles it
+static void syncProgram(MyOPL3VST* vst, int program)
+{
+    Program& entry = vst->programs[program];
+    for (int i = 0; i < kNumPatchParams; i++) {
+        entry.patch[i] = vst->mailbox->bank[program][i].load(std::memory_order_relaxed);
+    }
+    compilePatchImage(entry.patch, entry.image);
+}
+
+// Switches a part to a program of the bank. The program's patch and compiled image
+// become the part's, and every channel holding the part gets the image, compared
+// against the shadow file so only the bytes that differ are written. No register
+// value is computed here, so a program change costs little more than a copy.
+static void setPartProgram(MyOPL3VST* vst, int part, int program)
+{
+    vst->parts[part].program = program;
+    memcpy(vst->patches[part], vst->programs[program].patch, sizeof(vst->patches[part]));
+    vst->partImages[part] = vst->programs[program].image;
+
+    // The new patch replaces any glide of the old one
+    for (int slot = 0; slot < kNumSmoothedParams; slot++) {
+        if (vst->smoothers[part][slot].framesLeft > 0) {
+            vst->smoothers[part][slot].framesLeft = 0;
+            vst->numSmoothing--;
+        }
+    }
+
+    int numVoices = vst->numChips * OPL3_CHANNEL_COUNT;
+    for (int v = 0; v < numVoices; v++) {
+        const VoiceInfo& voice = vst->voices[v];
+        if (voice.part == part && !voice.paired && !voice.drum) writeVoicePatch(vst, v);
+    }
+}
+
+// Keys on the stolen voices that are still held
+static void applyPendingKeyOns(MyOPL3VST* vst)
+{
+    for (int p = 0; p < vst->numPendingKeyOns; p++) {
+        int v = vst->pendingKeyOns[p];
+        if (vst->voices[v].keyOnPending) {
+            vst->voices[v].keyOnPending = false;
+            keyOnVoice(vst, v);
+        }
+    }
+    vst->numPendingKeyOns = 0;
+
+    if (vst->drumRetrigger) {
+        vst->drumKeys |= vst->drumRetrigger;
+        vst->drumRetrigger = 0;
+        writeDrumKeys(vst);
+    }
+}
+
+// Rhythm mode: register 0xBD of chip 0 switches channels 6-8 over to the five drums
+// and holds their key-on bits. Drum notes only update drumKeys; every change due on
+// the same frame is then sent in one 0xBD write. The bass drum takes its pitch from
+// channel 6, the hi-hat and snare drum from channel 7 and the tom-tom and cymbal from
+// channel 8, so drums sharing a channel also share the pitch of the last one played.
+static void setRhythmMode(MyOPL3VST* vst, bool on)
+{
+    vst->rhythmMode = on;
+    vst->drumKeys = 0;
+    vst->drumRetrigger = 0;
+    vst->drumKeysDirty = false;
+
+    // The drum channels leave the voice lists, or come back to them idle
+    for (int v = kFirstDrumChannel; v < kFirstDrumChannel + 3; v++) {
+        VoiceInfo& voice = vst->voices[v];
+        if (on) {
+            takeVoice(vst, v);
+            voice.keyOnPending = false;
+            voice.drum = true;
+        } else {
+            voice.drum = false;
+            addIdleVoice(vst, v);
+        }
+    }
+}
+
+// The drum a General MIDI percussion note plays, or -1 for notes the kit lacks
+static int getDrum(int note)
+{
+    switch (note) {
+        case 35: case 36:                               // bass drums
+            return kDrumBD;
+        case 37: case 38: case 39: case 40:             // side stick, snares, clap
+            return kDrumSD;
+        case 41: case 43: case 45: case 47: case 48: case 50:
+            return kDrumTOM;
+        case 42: case 44: case 46:                      // closed, pedal and open hi-hat
+            return kDrumHH;
+        case 49: case 51: case 52: case 53: case 55: case 57: case 59:
+            return kDrumTC;                             // crash, ride, china, splash
+        default:
+            return -1;
+    }
+}
+
+// Plays a note-on or note-off of the drum channel
+static void handleDrumNote(MyOPL3VST* vst, int status, int note, int velocity)
+{
+    int drum = getDrum(note);
+    if (drum < 0) return;
+    uint8_t bit = (uint8_t)(1 << drum);
+
+    if (status == 0x80 || velocity == 0) {
+        // A restart already waiting for its key-on still plays
+        vst->drumKeys &= ~bit;
+        vst->drumKeysDirty = true;
+        return;
+    }
+
+    // The drum's channel plays the note's pitch
+    int ch = DRUM_CHANNELS[drum];
+    uint16_t entry = vst->pitchTable[note * kPitchSteps];
+    setRegister(vst, 0, getChannelRegister(ch, 0xA0), (uint8_t)(entry & 0xFF));
+    setRegister(vst, 0, getChannelRegister(ch, 0xB0), (uint8_t)(entry >> 8));
+
+    if ((vst->regShadow[0][0x0BD] | vst->drumRetrigger) & bit) {
+        // Still keyed on, or only just keyed off: like a stolen voice, the chip has
+        // to see the key-off before the new attack
+        vst->drumKeys &= ~bit;
+        vst->drumRetrigger |= bit;
+        vst->keyOnDelay = getKeyOffFrames(vst);
+    } else {
+        vst->drumKeys |= bit;
+    }
+    vst->drumKeysDirty = true;
+}
+
+// Keys off every drum, including restarts waiting for their key-on
+static void releaseDrums(MyOPL3VST* vst)
+{
+    vst->drumKeys = 0;
+    vst->drumRetrigger = 0;
+    vst->drumKeysDirty = true;
+}
+
+// Sends the drums' key-on bits, along with the rest of 0xBD, to chip 0
+static void writeDrumKeys(MyOPL3VST* vst)
+{
+    vst->drumKeysDirty = false;
+    updateRegisterGroup(vst, 0, kRegGroupGlobal);
+}
+
+// -----------------------------------------------------------------------------
+// 8) Native-rate rendering and polyphase resampler
+// -----------------------------------------------------------------------------
+// In the sinc modes the chip always runs at OPL3_NATIVE_RATE into a ring buffer, and
+// a windowed-sinc filter converts to the host rate. Each output frame reads `taps`
+// native samples around its fractional read position; the filter for that position is
+// interpolated between the two nearest of kResamplePhases tabulated phases.
+static int getResamplerMode(float value)
+{
+    int mode = (int)(value * (kNumResamplerModes - 0.001f));
+    if (mode < 0) mode = 0;
+    if (mode > kNumResamplerModes - 1) mode = kNumResamplerModes - 1;
+    return mode;
+}
+
+// Offset of a tier's coefficient table inside resampleCoefs
+static int getResamplerCoefOffset(int mode)
+{
+    int offset = 0;
+    for (int m = kResamplerLow; m < mode; m++) {
+        offset += (kResamplePhases + 1) * RESAMPLER_TIERS[m].taps;
+    }
+    return offset;
+}
+
+// Zeroth-order modified Bessel function, for the Kaiser window
+static double besselI0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+// Designs the filters of every sinc tier for a host rate into coefs. Runs when the
+// plugin is created and on effSetSampleRate, never on the audio thread.
+static void buildResamplerTables(float sampleRate, float* coefs)
+{
+    // When downsampling, the cutoff follows the host's Nyquist frequency
+    double ratio = sampleRate / OPL3_NATIVE_RATE;
+    double bandwidth = ratio < 1.0 ? ratio : 1.0;
+
+    for (int mode = kResamplerLow; mode < kNumResamplerModes; mode++) {
+        const ResamplerTier& tier = RESAMPLER_TIERS[mode];
+        int half = tier.taps / 2;
+        double cutoff = 0.5 * bandwidth * tier.rolloff; // cycles per native sample
+        double windowNorm = besselI0(tier.beta);
+        float* table = coefs + getResamplerCoefOffset(mode);
+
+        for (int phase = 0; phase <= kResamplePhases; phase++) {
+            double frac = (double)phase / kResamplePhases;
+            double coefs[kMaxResampleTaps];
+            double sum = 0.0;
+            for (int j = 0; j < tier.taps; j++) {
+                // Distance of tap j from the output position, in native samples
+                double x = j - half + 1 - frac;
+                double w = x / half;
+                double window = (w > -1.0 && w < 1.0) ? besselI0(tier.beta * sqrt(1.0 - w * w)) / windowNorm : 0.0;
+                double arg = 2.0 * M_PI * cutoff * x;
+                double sinc = (x == 0.0) ? 1.0 : sin(arg) / arg;
+                coefs[j] = 2.0 * cutoff * sinc * window;
+                sum += coefs[j];
+            }
+
+            // Normalize every phase to unity gain at DC
+            for (int j = 0; j < tier.taps; j++) {
+                table[phase * tier.taps + j] = (float)(coefs[j] / sum);
+            }
+        }
+    }
+}
+
+// Empties the ring buffer and restarts the read position
+static void resetResampler(MyOPL3VST* vst)
+{
+    memset(vst->ringL, 0, sizeof(vst->ringL));
+    memset(vst->ringR, 0, sizeof(vst->ringR));
+    vst->resamplePos = 0;
+    vst->nativeWritePos = 0;
+    vst->nativeSilentFrom = 0;
+}
+
+// Moves the output to vst->sampleRate without touching the chips' state. The ring
+// and the read position count native samples, so the polyphase resampler carries on
+// with only a new step (its filters are already in resampleCoefs). Chips that
+// resample for themselves (Linear) get the new step in place, instead of the reset
+// that would silence them.
+static void setOutputRate(MyOPL3VST* vst)
+{
+    vst->resampleStep = (uint64_t)(OPL3_NATIVE_RATE / vst->sampleRate * 4294967296.0 + 0.5);
+    for (int c = 0; c < vst->numChips; c++) {
+        if (vst->core == kCoreFast) setFastChipRate(vst, c);
+        else vst->chips[c].rateratio = getStreamRateRatio((uint32_t)vst->sampleRate);
+    }
+}
+
+// Reports the resampler's latency to the host as initialDelay. The sinc modes run
+// the chips half a filter ahead of the output, so everything is heard that many
+// native samples late. Runs on effSetSampleRate, effSetChunk and effMainsChanged,
+// from the posted mode and rate; never on the audio thread.
+static void updateLatency(MyOPL3VST* vst)
+{
+    int mode = getResamplerMode(getHostValue(vst, kVST_Resampler).load(std::memory_order_relaxed));
+    float rate = vst->mailbox->sampleRate.load(std::memory_order_relaxed);
+    int32_t delay = (int32_t)(RESAMPLER_TIERS[mode].taps / 2 * rate / OPL3_NATIVE_RATE + 0.5);
+    if (delay == vst->aeffect.initialDelay) return;
+
+    vst->aeffect.initialDelay = delay;
+    if (vst->audioMaster) vst->audioMaster(&vst->aeffect, audioMasterIOChanged, 0, 0, nullptr, 0.f);
+}
+
+// opl3_chip::rateratio belongs to Nuked OPL3. Changing the host rate without a reset
+// means setting it the way OPL3_Reset does, which ties this to Nuked OPL3 1.8: host
+// rate over the native rate with RSM_FRAC fractional bits, counted down by
+// OPL3_GenerateResampled. opl3.h does not export RSM_FRAC in 1.8, so its value there
+// is assumed when it is missing. Check this on every Nuked update.
+#ifndef RSM_FRAC
+#define RSM_FRAC 10
+#endif
+static_assert(RSM_FRAC == kFastRsmFrac, "the fast core's resampler must match Nuked OPL3's");
+static_assert(sizeof(((opl3_chip*)nullptr)->rateratio) == sizeof(int32_t), "rateratio changed in Nuked OPL3");
+
+// Native samples per host sample in fixed point, as OPL3_Reset sets it
+static int32_t getStreamRateRatio(uint32_t sampleRate)
+{
+    return (int32_t)((sampleRate << RSM_FRAC) / 49716);
+}
+
+// Runs the chips at their native rate and appends `count` frames to the ring buffer
+static void generateNative(MyOPL3VST* vst, int32_t count)
+{
+    while (count > 0) {
+        // Chunks stop at the end of the ring so they never wrap
+        uint32_t w = vst->nativeWritePos & (kResampleRingSize - 1);
+        int32_t chunk = count < kRenderBlockFrames ? count : kRenderBlockFrames;
+        if (chunk > (int32_t)(kResampleRingSize - w)) chunk = (int32_t)(kResampleRingSize - w);
+
+        if (allChipsIdle(vst)) {
+            memset(vst->ringL + w, 0, chunk * sizeof(float));
+            memset(vst->ringR + w, 0, chunk * sizeof(float));
+            vst->stats.framesSkipped += (int64)chunk * vst->numChips;
+        } else {
+            generateChips(vst, chunk, true);
+            mixChipsToFloat(vst, vst->ringL + w, vst->ringR + w, chunk);
+            vst->nativeSilentFrom = vst->nativeWritePos + chunk;
+        }
+
+        // Mirror whatever landed in the head of the ring behind its end
+        if (w < (uint32_t)kMaxResampleTaps) {
+            int32_t headEnd = (int32_t)w + chunk;
+            if (headEnd > kMaxResampleTaps) headEnd = kMaxResampleTaps;
+            memcpy(vst->ringL + kResampleRingSize + w, vst->ringL + w, (headEnd - w) * sizeof(float));
+            memcpy(vst->ringR + kResampleRingSize + w, vst->ringR + w, (headEnd - w) * sizeof(float));
+        }
+
+        vst->nativeWritePos += chunk;
+        count -= chunk;
+    }
+}
+
+#if defined(__SSE2__)
+static inline float horizontalSum(__m128 v)
+{
+    __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+#endif
+
+static void renderResampled(MyOPL3VST* vst, float* outL, float* outR, int32_t numFrames)
+{
+    const ResamplerTier& tier = RESAMPLER_TIERS[vst->resamplerMode];
+    const int taps = tier.taps;
+    const int half = taps / 2;
+    const float* table = vst->resampleCoefs + getResamplerCoefOffset(vst->resamplerMode);
+
+    // A chunk may not read further ahead than the ring can hold
+    int32_t maxChunk = (int32_t)(((uint64_t)(kResampleRingSize - 2 * kMaxResampleTaps) << 32) / vst->resampleStep);
+    if (maxChunk > kRenderBlockFrames) maxChunk = kRenderBlockFrames;
+    if (maxChunk < 1) maxChunk = 1;
+
+    while (numFrames > 0) {
+        int32_t chunk = numFrames < maxChunk ? numFrames : maxChunk;
+
+        // Generate every native sample the last frame of this chunk reads
+        uint64_t lastPos = vst->resamplePos + (uint64_t)(chunk - 1) * vst->resampleStep;
+        uint32_t needed = (uint32_t)(lastPos >> 32) + half + 1;
+        int32_t missing = (int32_t)(needed - vst->nativeWritePos);
+        if (missing > 0) {
+            generateNative(vst, missing);
+        }
+
+        // Every sample the chunk reads is silence: the filter would only sum zeros
+        uint32_t firstRead = (uint32_t)(vst->resamplePos >> 32) - half + 1;
+        if (allChipsIdle(vst) && (int32_t)(firstRead - vst->nativeSilentFrom) >= 0) {
+            memset(outL, 0, chunk * sizeof(float));
+            memset(outR, 0, chunk * sizeof(float));
+            vst->resamplePos += (uint64_t)chunk * vst->resampleStep;
+            outL += chunk;
+            outR += chunk;
+            numFrames -= chunk;
+            continue;
+        }
+
+        kernels->resample(table, taps, vst->ringL, vst->ringR, vst->resamplePos, vst->resampleStep, outL, outR, chunk);
+        vst->resamplePos += (uint64_t)chunk * vst->resampleStep;
+
+        outL += chunk;
+        outR += chunk;
+        numFrames -= chunk;
+    }
+}
+
+// Filters numFrames output frames, the first at native position pos (32.32 fixed
+// point) and each step further on, from the ring
+static void resampleFrames(const float* table, int taps, const float* ringL, const float* ringR,
+                           uint64_t pos, uint64_t step, float* outL, float* outR, int32_t numFrames)
+{
+    const int half = taps / 2;
+    for (int32_t i = 0; i < numFrames; i++) {
+        uint32_t start = ((uint32_t)(pos >> 32) - half + 1) & (kResampleRingSize - 1);
+        // Both taken from the integer fraction, so p stays below kResamplePhases
+        int p = (int)((uint32_t)pos >> kResampleFracBits);
+        float f = (float)((uint32_t)pos & ((1u << kResampleFracBits) - 1)) * kResampleFracScale;
+        const float* c0 = table + p * taps;
+        const float* c1 = c0 + taps;
+        const float* xL = ringL + start;
+        const float* xR = ringR + start;
+
+#if defined(__SSE2__)
+        const __m128 vf = _mm_set1_ps(f);
+        __m128 accL = _mm_setzero_ps();
+        __m128 accR = _mm_setzero_ps();
+        for (int j = 0; j < taps; j += 4) {
+            __m128 k0 = _mm_loadu_ps(c0 + j);
+            __m128 k = _mm_add_ps(k0, _mm_mul_ps(vf, _mm_sub_ps(_mm_loadu_ps(c1 + j), k0)));
+            accL = _mm_add_ps(accL, _mm_mul_ps(k, _mm_loadu_ps(xL + j)));
+            accR = _mm_add_ps(accR, _mm_mul_ps(k, _mm_loadu_ps(xR + j)));
+        }
+        outL[i] = horizontalSum(accL);
+        outR[i] = horizontalSum(accR);
+#else
+        float accL = 0.f, accR = 0.f;
+        for (int j = 0; j < taps; j++) {
+            float k = c0[j] + f * (c1[j] - c0[j]);
+            accL += k * xL[j];
+            accR += k * xR[j];
+        }
+        outL[i] = accL;
+        outR[i] = accR;
+#endif
+
+        pos += step;
+    }
+}
+
+#if defined(CNUKED_AVX2_KERNELS)
+// The same 8 taps at a time, with fused multiply-adds
+KERNEL_AVX2_FMA static void resampleFramesAvx2(const float* table, int taps, const float* ringL, const float* ringR,
+                                               uint64_t pos, uint64_t step, float* outL, float* outR, int32_t numFrames)
+{
+    const int half = taps / 2;
+    for (int32_t i = 0; i < numFrames; i++) {
+        uint32_t start = ((uint32_t)(pos >> 32) - half + 1) & (kResampleRingSize - 1);
+        // Both taken from the integer fraction, so p stays below kResamplePhases
+        int p = (int)((uint32_t)pos >> kResampleFracBits);
+        float f = (float)((uint32_t)pos & ((1u << kResampleFracBits) - 1)) * kResampleFracScale;
+        const float* c0 = table + p * taps;
+        const float* c1 = c0 + taps;
+        const float* xL = ringL + start;
+        const float* xR = ringR + start;
+
+        const __m256 vf = _mm256_set1_ps(f);
+        __m256 accL = _mm256_setzero_ps();
+        __m256 accR = _mm256_setzero_ps();
+        for (int j = 0; j < taps; j += 8) {
+            __m256 k0 = _mm256_loadu_ps(c0 + j);
+            __m256 k = _mm256_fmadd_ps(vf, _mm256_sub_ps(_mm256_loadu_ps(c1 + j), k0), k0);
+            accL = _mm256_fmadd_ps(k, _mm256_loadu_ps(xL + j), accL);
+            accR = _mm256_fmadd_ps(k, _mm256_loadu_ps(xR + j), accR);
+        }
+        outL[i] = horizontalSum(_mm_add_ps(_mm256_castps256_ps128(accL), _mm256_extractf128_ps(accL, 1)));
+        outR[i] = horizontalSum(_mm_add_ps(_mm256_castps256_ps128(accR), _mm256_extractf128_ps(accR, 1)));
+
+        pos += step;
+    }
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// 9) Render worker pool
+// -----------------------------------------------------------------------------
+// Chips share no state, so each one can be rendered on its own thread. For every run
+// of frames the audio thread publishes a job word, renders chips 0, n, 2n, ... itself
+// and spins until the workers have rendered the rest; worker w takes chips w, w + n,
+// ... The handoff is lock-free: the audio thread never blocks and never allocates.
+// Idle workers spin for a while so back-to-back runs are picked up at once, then park
+// in the kernel until the next job.
+struct RenderPool {
+    MyOPL3VST*              vst;
+    std::thread             workers[kMaxRenderThreads - 1];
+    std::atomic<int>        numWorkers;   // workers started so far
+    std::atomic<uint64_t>   job;          // generation | frames << 32 | threads << 48 | native << 56
+    std::atomic<uint32_t>   wakeSeq;      // futex word, bumped with every job
+    std::atomic<int>        pending;      // workers still rendering the current job
+    std::atomic<int>        parked;       // workers asleep on wakeSeq
+    std::atomic<bool>       quit;
+    std::mutex              startLock;    // host threads starting workers take turns
+};
+
+static inline void cpuRelax()
+{
+#if defined(__SSE2__)
+    _mm_pause();
+#endif
+}
+
+// Sleeps until wakeSeq moves past `seen`. Elsewhere than Linux the worker naps instead.
+static void parkWorker(RenderPool* pool, uint32_t seen)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&pool->wakeSeq), FUTEX_WAIT_PRIVATE, seen, nullptr, nullptr, 0);
+#else
+    unused(pool);
+    unused(seen);
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+#endif
+}
+
+static void wakeWorkers(RenderPool* pool)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&pool->wakeSeq), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+    unused(pool);
+#endif
+}
+
+// `seen` is the job word from before the worker was counted in numWorkers: every job
+// that includes it is published later, so none can be mistaken for one already done
+static void renderWorker(RenderPool* pool, int index, uint64_t seen)
+{
+    for (;;) {
+        uint64_t job;
+        int spins = 0;
+        while ((job = pool->job.load(std::memory_order_acquire)) == seen) {
+            if (spins < kWorkerSpinCount) {
+                spins++;
+                cpuRelax();
+                continue;
+            }
+            // Announce the nap before the last look at the job word, so a job
+            // published in between is either seen here or wakes the futex
+            uint32_t wake = pool->wakeSeq.load();
+            pool->parked.fetch_add(1);
+            if (pool->job.load() == seen) {
+                parkWorker(pool, wake);
+            }
+            pool->parked.fetch_sub(1);
+            spins = 0;
+        }
+        seen = job;
+        if (pool->quit.load(std::memory_order_acquire)) return;
+
+        int threads = (int)((job >> 48) & 0xFF);
+        if (index < threads) {
+            renderChipShare(pool->vst, index, threads, (int32_t)((job >> 32) & 0xFFFF), ((job >> 56) & 1) != 0);
+            pool->pending.fetch_sub(1, std::memory_order_release);
+        }
+    }
+}
+
+static RenderPool* createRenderPool(MyOPL3VST* vst)
+{
+    RenderPool* pool = new RenderPool();
+    pool->vst = vst;
+    pool->numWorkers.store(0);
+    pool->job.store(0);
+    pool->wakeSeq.store(0);
+    pool->pending.store(0);
+    pool->parked.store(0);
+    pool->quit.store(false);
+    return pool;
+}
+
+// Starts workers until `threads` threads, the audio thread included, can render.
+// More threads than CPU cores would only take turns, so the count is capped there.
+// Runs on effMainsChanged and effSetChunk, never from setParameter, which hosts may
+// call on the audio thread. Workers are only ever added while the plugin lives; the
+// audio thread uses as many of the requested threads as have been started.
+static void startRenderWorkers(MyOPL3VST* vst, int threads)
+{
+    RenderPool* pool = vst->renderPool;
+    int cores = (int)std::thread::hardware_concurrency();
+    if (cores > 0 && threads > cores) threads = cores;
+
+    std::lock_guard<std::mutex> lock(pool->startLock);
+    for (int w = pool->numWorkers.load(std::memory_order_relaxed) + 1; w < threads; w++) {
+        uint64_t seen = pool->job.load(std::memory_order_acquire);
+        pool->workers[w - 1] = std::thread(renderWorker, pool, w, seen);
+        pool->numWorkers.store(w, std::memory_order_release);
+    }
+}
+
+static void destroyRenderPool(MyOPL3VST* vst)
+{
+    RenderPool* pool = vst->renderPool;
+    if (!pool) return;
+
+    pool->quit.store(true, std::memory_order_release);
+    pool->job.fetch_add(1);
+    pool->wakeSeq.fetch_add(1);
+    wakeWorkers(pool);
+    for (int w = 0; w < pool->numWorkers.load(); w++) {
+        pool->workers[w].join();
+    }
+    delete pool;
+    vst->renderPool = nullptr;
+}
+
+// Threads that take part in rendering the next run of frames
+static int getActiveRenderThreads(MyOPL3VST* vst, int32_t numFrames)
+{
+    if (vst->renderThreads <= 1 || vst->numChips <= 1 || numFrames < kMinParallelFrames) return 1;
+
+    int threads = vst->renderThreads;
+    int started = vst->renderPool->numWorkers.load(std::memory_order_acquire) + 1;
+    if (threads > started) threads = started;
+    if (threads > vst->numChips) threads = vst->numChips;
+    return threads;
+}
+
+// Hands a run of frames to the workers, renders the audio thread's share of the
+// chips and waits for the rest
+static void dispatchRenderJob(MyOPL3VST* vst, int threads, int32_t numFrames, bool nativeRate)
+{
+    RenderPool* pool = vst->renderPool;
+    pool->pending.store(threads - 1, std::memory_order_relaxed);
+
+    uint64_t generation = (uint32_t)(pool->job.load(std::memory_order_relaxed) + 1);
+    pool->job.store(generation | ((uint64_t)numFrames << 32) | ((uint64_t)threads << 48) |
+                    ((uint64_t)(nativeRate ? 1 : 0) << 56));
+    pool->wakeSeq.fetch_add(1);
+    if (pool->parked.load() > 0) {
+        wakeWorkers(pool);
+    }
+
+    renderChipShare(vst, 0, threads, numFrames, nativeRate);
+
+    // A worker that is still waking up, or that lost its core to another thread,
+    // gets the CPU back instead of being spun against
+    int spins = 0;
+    while (pool->pending.load(std::memory_order_acquire) > 0) {
+        if (spins < kWorkerSpinCount) {
+            spins++;
+            cpuRelax();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 10) Instrument bank import
+// -----------------------------------------------------------------------------
+// Bank files hold OPL register bytes, which are decoded to parameter values and
+// posted to the program bank like a restored chunk. A file is mapped rather than
+// read, and only the instruments that fit in the bank are parsed, so a WOPL file
+// with thousands of instruments costs no more than one with 128. Parsed banks are
+// cached by path, size and modification time for every instance in the process.
+// All of this runs on host threads; the audio thread only sees the finished bank.
+
+// One instrument as register bytes: 0x20, 0x40, 0x60, 0x80 and 0xE0 of the
+// modulator, carrier, operator 3 and operator 4, and 0xC0 of both channels
+struct OplInstrument {
+    uint8_t ops[4][kNumOperatorRegs];
+    uint8_t channels[2];
+    bool    fourOp;
+    char    name[kProgramNameLength];
+};
+
+// The instruments of a file, decoded to patches
+struct ImportedBank {
+    int   count;
+    float patches[kNumPrograms][kNumPatchParams];
+    char  names[kNumPrograms][kProgramNameLength];
+};
+
+static const int kMaxCachedBanks = 4;
+
+struct CachedBank {
+    char          path[1024];
+    int64_t       size;
+    int64_t       mtime;
+    int           bank;
+    uint64_t      lastUse;
+    ImportedBank* parsed;       // nullptr when the slot is free
+};
+
+static std::mutex g_bankCacheLock;
+static CachedBank g_bankCache[kMaxCachedBanks];
+static uint64_t   g_bankCacheClock;
+
+static uint16_t readLE16(const uint8_t* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static uint16_t readBE16(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static uint32_t readLE32(const uint8_t* p) { return (uint32_t)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24)); }
+
+// Copies a fixed-length name field, keeping printable characters only
+static void copyInstrumentName(char* name, const uint8_t* field, int length)
+{
+    int n = 0;
+    for (int i = 0; i < length && field[i] && n < kProgramNameLength - 1; i++) {
+        name[n++] = (field[i] >= 0x20 && field[i] < 0x7F) ? (char)field[i] : ' ';
+    }
+    while (n > 0 && name[n - 1] == ' ') n--;
+    name[n] = '\0';
+}
+
+// The 16-byte instrument record shared by SBI and IBK: the modulator's and the
+// carrier's bytes interleaved, then 0xC0
+static void readSbiRecord(const uint8_t* d, OplInstrument& inst)
+{
+    for (int role = 0; role < 2; role++) {
+        for (int reg = 0; reg < kNumOperatorRegs; reg++) {
+            inst.ops[role][reg] = d[reg * 2 + role];
+        }
+    }
+    inst.channels[0] = d[10];
+}
+
+// AdLib BNK operator record: one byte per field
+static void readBnkOperator(const uint8_t* d, uint8_t waveform, uint8_t* regs)
+{
+    // ksl, mult, feedback, attack, sustain level, sustaining, decay, release, level, am, vib, ksr, fm
+    regs[0] = (uint8_t)(((d[9] & 1) << 7) | ((d[10] & 1) << 6) | ((d[5] & 1) << 5) | ((d[11] & 1) << 4) | (d[1] & 0x0F));
+    regs[1] = (uint8_t)(((d[0] & 3) << 6) | (d[8] & 0x3F));
+    regs[2] = (uint8_t)(((d[3] & 0x0F) << 4) | (d[6] & 0x0F));
+    regs[3] = (uint8_t)(((d[4] & 0x0F) << 4) | (d[7] & 0x0F));
+    regs[4] = (uint8_t)(waveform & 7);
+}
+
+// Parses up to `max` instruments of a file. Returns how many, or -1 if the format
+// is not recognized or the file is cut short.
+static int parseBankFile(const uint8_t* data, size_t size, int bank, OplInstrument* out, int max)
+{
+    // SBI: one instrument
+    if (size >= 52 && !memcmp(data, "SBI\x1A", 4)) {
+        readSbiRecord(data + 36, out[0]);
+        copyInstrumentName(out[0].name, data + 4, 32);
+        return 1;
+    }
+
+    // IBK: 128 records, then 128 names of 9 bytes
+    if (size >= 4 + 128 * 25 && !memcmp(data, "IBK\x1A", 4)) {
+        int count = max < 128 ? max : 128;
+        for (int i = 0; i < count; i++) {
+            readSbiRecord(data + 4 + i * 16, out[i]);
+            copyInstrumentName(out[i].name, data + 4 + 128 * 16 + i * 9, 9);
+        }
+        return count;
+    }
+
+    // AdLib BNK: a name list pointing into 30-byte instrument records
+    if (size >= 28 && !memcmp(data + 2, "ADLIB-", 6)) {
+        int used = readLE16(data + 8);
+        uint32_t namesOffset = readLE32(data + 12);
+        uint32_t dataOffset = readLE32(data + 16);
+        int count = 0;
+        for (int e = 0; e < used && count < max; e++) {
+            size_t entry = namesOffset + (size_t)e * 12;
+            if (entry + 12 > size) return -1;
+            size_t record = dataOffset + (size_t)readLE16(data + entry) * 30;
+            if (record + 30 > size) return -1;
+            const uint8_t* d = data + record;
+            OplInstrument& inst = out[count++];
+            readBnkOperator(d + 2, d[28], inst.ops[0]);
+            readBnkOperator(d + 15, d[29], inst.ops[1]);
+            inst.channels[0] = (uint8_t)(((d[4] & 7) << 1) | ((d[14] & 1) ^ 1));
+            copyInstrumentName(inst.name, data + entry + 3, 9);
+        }
+        return count;
+    }
+
+    // DMX OP2 (GENMIDI): 175 records of 36 bytes, the first 128 melodic, then names.
+    // Only each record's first voice is used.
+    if (size >= 8 + 175 * 68 && !memcmp(data, "#OPL_II#", 8)) {
+        int count = max < 128 ? max : 128;
+        for (int i = 0; i < count; i++) {
+            const uint8_t* v = data + 8 + i * 36 + 4;
+            OplInstrument& inst = out[i];
+            for (int role = 0; role < 2; role++) {
+                const uint8_t* op = v + role * 7;
+                inst.ops[role][0] = op[0];
+                inst.ops[role][1] = (uint8_t)((op[4] & 0xC0) | (op[5] & 0x3F));
+                inst.ops[role][2] = op[1];
+                inst.ops[role][3] = op[2];
+                inst.ops[role][4] = op[3];
+            }
+            inst.channels[0] = v[6];
+            copyInstrumentName(inst.name, data + 8 + 175 * 36 + i * 32, 32);
+        }
+        return count;
+    }
+
+    // WOPL: only the records of the requested melodic bank are read
+    if (size >= 19 && !memcmp(data, "WOPL3-BANK\0", 11)) {
+        int version = readLE16(data + 11);
+        int melodicBanks = readBE16(data + 13);
+        int percussionBanks = readBE16(data + 15);
+        if (bank < 0 || bank >= melodicBanks) return -1;
+        size_t recordSize = version >= 3 ? 66 : 62;
+        size_t first = 19 + (version >= 2 ? (size_t)(melodicBanks + percussionBanks) * 34 : 0) +
+                       (size_t)bank * 128 * recordSize;
+        int count = 0;
+        for (int i = 0; i < 128 && count < max; i++) {
+            size_t record = first + i * recordSize;
+            if (record + recordSize > size) return -1;
+            const uint8_t* d = data + record;
+            OplInstrument& inst = out[count++];
+            // Operators are stored carrier first: carrier 1, modulator 1, carrier 2, modulator 2
+            static const int ORDER[4] = { 1, 0, 3, 2 };
+            for (int op = 0; op < 4; op++) {
+                memcpy(inst.ops[ORDER[op]], d + 42 + op * 5, kNumOperatorRegs);
+            }
+            inst.channels[0] = d[40];
+            inst.channels[1] = d[41];
+            // Flags bit 0 is 4-op, bit 1 pseudo 4-op: two 2-op voices layered on one note,
+            // which editors mark with bit 0 as well. Only the first of those is used.
+            inst.fourOp = (d[39] & 0x03) == 0x01;
+            copyInstrumentName(inst.name, d, 32);
+        }
+        return count;
+    }
+
+    return -1;
+}
+
+// Decodes one operator's register bytes into its block of parameter values
+static void decodeOperator(const uint8_t* regs, float* op)
+{
+    op[kParamAM]   = (regs[0] & 0x80) ? 1.0f : 0.0f;
+    op[kParamVIB]  = (regs[0] & 0x40) ? 1.0f : 0.0f;
+    op[kParamEGT]  = (regs[0] & 0x20) ? 1.0f : 0.0f;
+    op[kParamKSR]  = (regs[0] & 0x10) ? 1.0f : 0.0f;
+    op[kParamMULT] = (regs[0] & 0x0F) / 15.0f;
+    op[kParamKSL]  = (regs[1] >> 6) / 3.0f;
+    op[kParamTL]   = (regs[1] & 0x3F) / 63.0f;
+    op[kParamAR]   = (regs[2] >> 4) / 15.0f;
+    op[kParamDR]   = (regs[2] & 0x0F) / 15.0f;
+    op[kParamSL]   = (regs[3] >> 4) / 15.0f;
+    op[kParamRR]   = (regs[3] & 0x0F) / 15.0f;
+    op[kParamWS]   = (regs[4] & 0x07) / 7.0f;
+}
+
+// Decodes an instrument into a patch. The bank formats leave stereo to the player,
+// so both outputs are on. A 2-op instrument's operators 3 and 4 copy the modulator
+// and the carrier, like the default patch.
+static void decodeInstrument(const OplInstrument& inst, float* patch)
+{
+    decodeOperator(inst.ops[0], &patch[kVST_Mod_AM]);
+    decodeOperator(inst.ops[1], &patch[kVST_Car_AM]);
+    decodeOperator(inst.ops[inst.fourOp ? 2 : 0], &patch[kVST_Op3_AM]);
+    decodeOperator(inst.ops[inst.fourOp ? 3 : 1], &patch[kVST_Op4_AM]);
+    patch[kVST_FB]    = ((inst.channels[0] >> 1) & 7) / 7.0f;
+    patch[kVST_CON]   = (inst.channels[0] & 1) ? 1.0f : 0.0f;
+    patch[kVST_LEFT]  = 1.0f;
+    patch[kVST_RIGHT] = 1.0f;
+
+    // The 4-Op setting picks the algorithm from both channels' connection bits
+    int algorithm = (inst.channels[0] & 1) | ((inst.channels[1] & 1) << 1);
+    patch[kVST_FourOp] = inst.fourOp ? (algorithm + 1) / (float)(kNumFourOpModes - 1) : 0.0f;
+}
+
+// Parses a file's contents into an ImportedBank, or returns nullptr
+static ImportedBank* parseBank(const uint8_t* data, size_t size, int bank)
+{
+    OplInstrument* instruments = new OplInstrument[kNumPrograms];
+    memset(instruments, 0, sizeof(OplInstrument) * kNumPrograms);
+    int count = parseBankFile(data, size, bank, instruments, kNumPrograms);
+    if (count <= 0) {
+        delete[] instruments;
+        return nullptr;
+    }
+
+    ImportedBank* parsed = new ImportedBank;
+    parsed->count = count;
+    for (int i = 0; i < count; i++) {
+        decodeInstrument(instruments[i], parsed->patches[i]);
+        memcpy(parsed->names[i], instruments[i].name, kProgramNameLength);
+    }
+    delete[] instruments;
+    return parsed;
+}
+
+// Posts imported patches to the program bank. Every part reloads its program, so
+// parts on replaced programs switch to the new sounds at the next block.
+static int postImportedBank(MyOPL3VST* vst, const ImportedBank& parsed, int firstProgram)
+{
+    if (firstProgram < 0 || firstProgram >= kNumPrograms) return 0;
+    int count = parsed.count;
+    if (count > kNumPrograms - firstProgram) count = kNumPrograms - firstProgram;
+
+    ParameterMailbox* mailbox = vst->mailbox;
+    for (int i = 0; i < count; i++) {
+        int program = firstProgram + i;
+        for (int p = 0; p < kNumPatchParams; p++) {
+            mailbox->bank[program][p].store(parsed.patches[i][p], std::memory_order_relaxed);
+        }
+        if (parsed.names[i][0]) {
+            memcpy(vst->programNames[program], parsed.names[i], kProgramNameLength);
+        } else {
+            snprintf(vst->programNames[program], kProgramNameLength, "Program %d", program + 1);
+        }
+    }
+    mailbox->bankChanged.store(true, std::memory_order_release);
+    for (int part = 0; part < kNumParts; part++) {
+        int program = mailbox->partPrograms[part].load(std::memory_order_relaxed);
+        for (int i = 0; i < kNumPatchParams; i++) {
+            mailbox->patchValues[part][i].store(mailbox->bank[program][i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+    mailbox->programChanges.fetch_or((1u << kNumParts) - 1, std::memory_order_release);
+    mailbox->changes.fetch_add(1, std::memory_order_relaxed);
+    return count;
+}
+
+static int importBankData(MyOPL3VST* vst, const uint8_t* data, size_t size, int firstProgram, int bank)
+{
+    ImportedBank* parsed = parseBank(data, size, bank);
+    if (!parsed) return 0;
+    int count = postImportedBank(vst, *parsed, firstProgram);
+    delete parsed;
+    return count;
+}
+
+static int importBankFile(MyOPL3VST* vst, const char* path, int firstProgram, int bank)
+{
+#if defined(__linux__)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+        close(fd);
+        return 0;
+    }
+    int64_t size = (int64_t)info.st_size;
+    int64_t mtime = (int64_t)info.st_mtime;
+#else
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    fseek(file, 0, SEEK_END);
+    int64_t size = (int64_t)ftell(file);
+    int64_t mtime = 0;
+    if (size <= 0) {
+        fclose(file);
+        return 0;
+    }
+#endif
+
+    std::lock_guard<std::mutex> lock(g_bankCacheLock);
+    g_bankCacheClock++;
+
+    // A bank parsed before, by this or any other instance
+    for (int c = 0; c < kMaxCachedBanks; c++) {
+        CachedBank& entry = g_bankCache[c];
+        if (entry.parsed && entry.size == size && entry.mtime == mtime && entry.bank == bank &&
+            !strcmp(entry.path, path)) {
+            entry.lastUse = g_bankCacheClock;
+#if defined(__linux__)
+            close(fd);
+#else
+            fclose(file);
+#endif
+            return postImportedBank(vst, *entry.parsed, firstProgram);
+        }
+    }
+
+    // Map the file so only the pages the parser touches are read
+    ImportedBank* parsed = nullptr;
+#if defined(__linux__)
+    void* mapped = mmap(nullptr, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return 0;
+    parsed = parseBank((const uint8_t*)mapped, (size_t)size, bank);
+    munmap(mapped, (size_t)size);
+#else
+    uint8_t* contents = new uint8_t[size];
+    fseek(file, 0, SEEK_SET);
+    if (fread(contents, 1, (size_t)size, file) == (size_t)size) {
+        parsed = parseBank(contents, (size_t)size, bank);
+    }
+    fclose(file);
+    delete[] contents;
+#endif
+    if (!parsed) return 0;
+
+    // Keep it, in place of the bank used longest ago
+    if (strlen(path) < sizeof(g_bankCache[0].path)) {
+        int slot = 0;
+        for (int c = 1; c < kMaxCachedBanks; c++) {
+            if (!g_bankCache[c].parsed || g_bankCache[c].lastUse < g_bankCache[slot].lastUse) slot = c;
+            if (!g_bankCache[slot].parsed) break;
+        }
+        CachedBank& entry = g_bankCache[slot];
+        delete entry.parsed;
+        strcpy(entry.path, path);
+        entry.size = size;
+        entry.mtime = mtime;
+        entry.bank = bank;
+        entry.lastUse = g_bankCacheClock;
+        entry.parsed = parsed;
+        return postImportedBank(vst, *parsed, firstProgram);
+    }
+
+    int count = postImportedBank(vst, *parsed, firstProgram);
+    delete parsed;
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+// 11) Fast operator core
+// -----------------------------------------------------------------------------
+// The second emulation core, chosen with the Core parameter, lives in
+// CNukedFast.cpp: it is derived from Nuked OPL3 and shares its license (LGPL).
+// These helpers run it on the plugin's chips.
+
+// Slot of a channel's operator 0 (modulator) or 1 (carrier), as Nuked numbers them
+static int getChannelSlot(int channel, int op)
+{
+    return (channel / 9) * 18 + CHANNEL_SLOTS[channel % 9] + 3 * op;
+}
+
+static FastChip* createFastChips()
+{
+    fastInitTables();  // built here rather than on the audio thread
+    return new FastChip[kMaxChips];
+}
+
+static void destroyFastChips(MyOPL3VST* vst)
+{
+    delete[] vst->fastChips;
+    vst->fastChips = nullptr;
+}
+
+static void resetFastChip(MyOPL3VST* vst, int chip)
+{
+    fastReset(vst->fastChips[chip], (uint32_t)vst->sampleRate);
+}
+
+static void setFastChipRate(MyOPL3VST* vst, int chip)
+{
+    fastSetSampleRate(vst->fastChips[chip], (uint32_t)vst->sampleRate);
+}
+
+static void writeFastRegister(MyOPL3VST* vst, int chip, uint16_t reg, uint8_t value)
+{
+    fastWriteReg(vst->fastChips[chip], reg, value);
+}
+
+// Renders a chip into its buffer, at the native rate or through the linear resampler
+static void renderFastChip(MyOPL3VST* vst, int chip, int32_t numFrames, bool nativeRate)
+{
+    if (nativeRate) fastGenerate(vst->fastChips[chip], vst->chipBuffers[chip], numFrames);
+    else fastGenerateStream(vst->fastChips[chip], vst->chipBuffers[chip], numFrames);
+}
+
+// Envelope attenuation of a slot (0 = loudest, 0x1FF = silent) in the running core
+static int getSlotEnvelope(MyOPL3VST* vst, int chip, int slot)
+{
+    if (vst->core == kCoreFast) return vst->fastChips[chip].egRout[slot];
+    return vst->chips[chip].slot[slot].eg_rout;
+}
+
+// The same with the slot's level, key scaling and tremolo added
+static int getSlotAttenuation(MyOPL3VST* vst, int chip, int slot)
+{
+    if (vst->core == kCoreFast) return vst->fastChips[chip].egOut[slot];
+    return vst->chips[chip].slot[slot].eg_out;
+}
+
+// True while a slot is keyed on by its channel or the rhythm register
+static bool isSlotKeyed(MyOPL3VST* vst, int chip, int slot)
+{
+    if (vst->core == kCoreFast) return vst->fastChips[chip].key[slot] != 0;
+    return vst->chips[chip].slot[slot].key != 0;
+}
+// -----------------------------------------------------------------------------
+// 12) CPU feature dispatch
+// -----------------------------------------------------------------------------
+// The Makefile builds for SSE2 so that one binary runs on every x86-64 machine.
+// The kernels above also have AVX2 builds, made with a target attribute in this
+// same file; the first VSTPluginMain asks cpuid which ones the CPU and the OS
+// support and points kernels at the best set. The choice is never changed after.
+// The fast core keeps a single SSE2 build: its time goes to the serial waveform
+// lookups and envelope steps, and an AVX2 build of it was no faster. AVX-512 is
+// left out for a similar reason, as the filter has at most 32 taps and the
+// conversions are a small share of a block.
+static const Kernels KERNEL_SETS[kNumIsas] = {
+#if defined(__SSE2__)
+    { "SSE2",
+#else
+    { "Scalar",
+#endif
+      deinterleaveToFloat, sumChips, convertMixToFloat, resampleFrames },
+#if defined(CNUKED_AVX2_KERNELS)
+    { "AVX2", deinterleaveToFloatAvx2, sumChipsAvx2, convertMixToFloatAvx2, resampleFramesAvx2 },
+#else
+    { "AVX2", nullptr, nullptr, nullptr, nullptr },
+#endif
+};
+
+// The best instruction set both the CPU and the OS support
+static int detectIsa()
+{
+#if defined(CNUKED_AVX2_KERNELS)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return kIsaBaseline;
+    // AVX and FMA, and the OS saves the YMM registers across context switches (XCR0 bits 1-2)
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX) || !(ecx & bit_FMA)) return kIsaBaseline;
+    unsigned int xcr0Lo, xcr0Hi;
+    __asm__ __volatile__("xgetbv" : "=a"(xcr0Lo), "=d"(xcr0Hi) : "c"(0));
+    if ((xcr0Lo & 0x6) != 0x6) return kIsaBaseline;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return kIsaBaseline;
+    if (ebx & bit_AVX2) return kIsaAvx2;
+#endif
+    return kIsaBaseline;
+}
+
+// The CNUKEDVST_ISA environment variable can hold back the detected set: "baseline"
+// or the name of a set the CPU supports ("sse2", "avx2"). The AVX2 resampler rounds
+// differently from the baseline one, so renders meant to be compared bit for bit
+// across machines force the baseline.
+static int selectIsa()
+{
+    int isa = detectIsa();
+    const char* forced = getenv("CNUKEDVST_ISA");
+    if (!forced) return isa;
+    if (!strcasecmp(forced, "baseline")) return kIsaBaseline;
+    for (int i = 0; i <= isa; i++) {
+        if (!strcasecmp(forced, KERNEL_SETS[i].name)) return i;
+    }
+    return isa;
+}
+
+static void selectKernels()
+{
+    static std::once_flag once;
+    std::call_once(once, [] { kernels = &KERNEL_SETS[selectIsa()]; });
+}
@@ -0,0 +1,48 @@
+/******************************************************************************
+ * CNukedVST.h (vendor-specific extensions of the OPL3 FM VST)                *
+ ******************************************************************************/
+
+#ifndef __cnukedvst_h__
+#define __cnukedvst_h__
+
+#include "aeffect.h"
+
+// Hosts and tools reach these through the dispatcher:
+//   dispatcher(effect, effVendorSpecific, kOPL3VendorMagic, <opcode>, ptr, opt)
+// The call returns 1 when the opcode was handled and 0 otherwise.
+#define kOPL3VendorMagic CCONST('O', 'P', 'L', '3')
+
+// Vendor-specific opcodes
+enum {
+    kOPL3VendorGetStats = 1,  // ptr -> OPL3VSTStats, filled in by the plugin
+    kOPL3VendorImportBank = 2 // ptr -> OPL3VSTBankImport, loads a bank file into the programs
+};
+
+// An instrument bank file to load into the program bank: SBI, IBK, AdLib BNK, DMX
+// OP2 (GENMIDI) or WOPL. Its instruments replace consecutive programs starting at
+// firstProgram; those past the last program are left out. Only the instruments that
+// fit are parsed, and parsed banks are cached, so reloading one is cheap.
+struct OPL3VSTBankImport {
+    const char* path;           // the bank file
+    int32 firstProgram;         // program that takes the file's first instrument
+    int32 bank;                 // WOPL melodic bank to load, 0 for the other formats
+    int32 numImported;          // filled in: programs replaced
+};
+
+// Runtime counters of the plugin. "Avoided" register writes are the writes a
+// full register sweep per parameter change would have issued minus the writes
+// that were actually needed because a register byte changed. Only host parameter
+// changes applied at block start count; those that start a glide do not.
+struct OPL3VSTStats {
+    int64 blocks;                  // processReplacing calls
+    int64 regWrites;               // total OPL3 register writes
+    int64 regWritesAvoided;        // total register writes skipped
+    int32 lastBlockRegWrites;      // register writes flushed at the start of the last block
+    int32 lastBlockRegWritesAvoided; // register writes skipped at the start of the last block
+    int64 voiceSteals;             // note-ons that took over a held voice
+    int64 releaseTailsCut;         // note-ons that took over a voice whose release was still audible
+    int64 framesSkipped;           // frames not emulated because a chip was silent, summed over the chips
+    int64 notesDropped;            // note-ons left out because the MIDI event queue was full
+};
+
+#endif // __cnukedvst_h__